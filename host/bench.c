@@ -0,0 +1,182 @@
+/* Microbenchmarks for the hot paths of the hardware independent code:
+ * decoding what the SCD30 sends (including the CRC) and rendering the
+ * responses. Absolute numbers on the build host are of course nothing
+ * like those on the ESP32, but changes in them are.
+ * Usage: bench [-q]   (-q: quick run with few iterations, for CI) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cbor.h"
+#include "render.h"
+#include "respbuf.h"
+#include "scd30proto.h"
+#include "scd30sim.h"
+
+static long iterations = 2000000;
+
+/* Keeps the compiler from optimizing the benchmarked code away. */
+static volatile uint32_t sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char * name, double start, long n)
+{
+    printf("%-28s %10.1f ns/op  (%ld ops)\n", name, (now_ns() - start) / n, n);
+}
+
+/* The CRC bit by bit, to see what the table buys us. */
+static uint8_t crc_bitwise(uint8_t b1, uint8_t b2)
+{
+    uint8_t crc = 0xff;
+    uint8_t b[2] = { b1, b2 };
+    for (int i = 0; i < 2; i++) {
+      crc ^= b[i];
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 0x80) ? ((crc << 1) ^ 0x31) : (crc << 1);
+      }
+    }
+    return crc;
+}
+
+static int discard(void * ctx, const char * data, size_t len)
+{
+    sink += len;
+    return 0;
+}
+
+static void bench_crc(void)
+{
+    double start;
+    uint32_t acc = 0;
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+      acc += scd30proto_crc(i, i >> 8);
+    }
+    report("crc (table)", start, iterations);
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+      acc += crc_bitwise(i, i >> 8);
+    }
+    report("crc (bitwise)", start, iterations);
+    sink = acc;
+}
+
+static void bench_decode(void)
+{
+    struct scd30sim sim;
+    struct scd30transport tp;
+    struct scd30data d;
+    uint8_t frame[SCD30_MEASLEN];
+    uint8_t cmd[SCD30_MAXCMDLEN];
+    int badword;
+    double start;
+    scd30sim_init(&sim, 42);
+    scd30sim_transport(&sim, &tp);
+    tp.write(tp.ctx, cmd, scd30proto_buildcmd(cmd, 0x0010, 1, 0));
+    /* Get one real frame out of the simulation */
+    scd30sim_measure(&sim, 812.5, 22.25, 48.5);
+    tp.write(tp.ctx, cmd, scd30proto_buildcmd(cmd, 0x0300, 0, 0));
+    tp.read(tp.ctx, frame, sizeof(frame));
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+      sink += scd30proto_decodemeas(frame, &d, &badword);
+    }
+    report("decodemeas", start, iterations);
+    frame[16] ^= 1;
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+      sink += scd30proto_decodemeas(frame, &d, &badword);
+    }
+    report("decodemeas (crc fail)", start, iterations);
+    start = now_ns();
+    for (long i = 0; i < iterations / 4; i++) {
+      scd30sim_measure(&sim, 400.0 + (i & 1023), 22.25, 48.5);
+      sink += scd30sim_fetch(&tp, &d, &badword);
+    }
+    report("simulated fetch", start, iterations / 4);
+}
+
+static void bench_render(void)
+{
+    char buf[RENDER_HTMLTABLEMAXLEN];
+    struct snapshot sn = { .seq = 1, .ts = 1700000000, .co2 = 812.5, .temp = 22.25, .hum = 48.5 };
+    struct aggresult aggres[AGG_NUMWINDOWS];
+    static const char * aggnames[AGG_NUMWINDOWS] = { "1m", "5m", "1h", "24h" };
+    struct histentry he = { .ts = 1700000000, .co2 = 812, .temp = 2225, .hum = 485 };
+    struct respbuf rb;
+    double start;
+    long n = iterations / 4;
+    for (int i = 0; i < AGG_NUMWINDOWS; i++) {
+      aggres[i].name = aggnames[i];
+      aggres[i].count = 100;
+      for (int v = 0; v < AGG_NUMVALS; v++) {
+        aggres[i].min[v] = 400 + v;
+        aggres[i].max[v] = 1800 + v;
+        aggres[i].mean[v] = 900 + v;
+        aggres[i].ewma[v] = 950 + v;
+      }
+    }
+    start = now_ns();
+    for (long i = 0; i < n; i++) {
+      sn.ts++;
+      sink += render_json(buf, &sn, 0);
+    }
+    report("render_json", start, n);
+    start = now_ns();
+    for (long i = 0; i < n; i++) {
+      sn.ts++;
+      sink += render_htmltable(buf, &sn, 0);
+    }
+    report("render_htmltable", start, n);
+    if (respbuf_init(&rb, discard, NULL) != 0) {
+      fprintf(stderr, "No respbuf\n");
+      exit(1);
+    }
+    start = now_ns();
+    for (long i = 0; i < n; i++) {
+      render_aggjson(&rb, aggres);
+    }
+    report("render_aggjson", start, n);
+    start = now_ns();
+    for (long i = 0; i < n; i++) {
+      render_agghtml(&rb, aggres);
+    }
+    report("render_agghtml", start, n);
+    start = now_ns();
+    for (long i = 0; i < n; i++) {
+      he.ts++;
+      render_histentry(&rb, &he, 0);
+    }
+    report("render_histentry", start, n);
+    start = now_ns();
+    for (long i = 0; i < n; i++) {
+      sn.ts++;
+      render_cbor(&rb, &sn, 0);
+    }
+    report("render_cbor", start, n);
+    start = now_ns();
+    for (long i = 0; i < n; i++) {
+      he.ts++;
+      render_histentrycbor(&rb, &he);
+    }
+    report("render_histentrycbor", start, n);
+    respbuf_finish(&rb);
+}
+
+int main(int argc, char ** argv)
+{
+    if ((argc > 1) && (strcmp(argv[1], "-q") == 0)) {
+      iterations = 20000;
+    }
+    bench_crc();
+    bench_decode();
+    bench_render();
+    return 0;
+}
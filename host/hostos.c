@@ -0,0 +1,61 @@
+/* The operating system underneath the firmware code in the host build. */
+
+#include <stdlib.h>
+#include <sched.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "hostos.h"
+
+static volatile int64_t hostuptime = 0;
+static time_t hostboottime = 0;
+
+void hostos_setuptime(int64_t us)
+{
+    __atomic_store_n(&hostuptime, us, __ATOMIC_RELEASE);
+}
+
+void hostos_setboottime(time_t bootts)
+{
+    hostboottime = bootts;
+}
+
+time_t hostos_time(void)
+{
+    return hostboottime + (esp_timer_get_time() / 1000000);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return __atomic_load_n(&hostuptime, __ATOMIC_ACQUIRE);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return esp_timer_get_time() / (1000 * portTICK_PERIOD_MS);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    /* Virtual time only moves when the simulation says so, so all
+     * we can do is let someone else run. */
+    sched_yield();
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t s = malloc(sizeof(pthread_mutex_t));
+    if (s != NULL) pthread_mutex_init(s, NULL);
+    return s;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait)
+{
+    return (pthread_mutex_lock(s) == 0) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+    return (pthread_mutex_unlock(s) == 0) ? pdTRUE : pdFALSE;
+}
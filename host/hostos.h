@@ -0,0 +1,20 @@
+
+/* The operating system underneath the firmware code in the host
+ * build: FreeRTOS and esp_timer stand-ins, and a virtual clock that
+ * the simulation moves forward as fast as it likes. */
+
+#ifndef _HOSTOS_H_
+#define _HOSTOS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/* Sets the virtual uptime (what esp_timer_get_time returns) in
+ * microseconds. It must never go backwards. */
+void hostos_setuptime(int64_t us);
+
+/* The wall clock: bootts plus the virtual uptime. */
+void hostos_setboottime(time_t bootts);
+time_t hostos_time(void);
+
+#endif /* _HOSTOS_H_ */
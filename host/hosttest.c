@@ -0,0 +1,309 @@
+/* Checks for the hardware independent parts of the firmware,
+ * run on the build host (see CMakeLists.txt). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cbor.h"
+#include "render.h"
+#include "respbuf.h"
+#include "scd30proto.h"
+#include "scd30sim.h"
+
+static int failures = 0;
+
+#define CHECK(c) do { \
+    if (!(c)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+      failures++; \
+    } \
+  } while (0)
+
+#define CHECKSTR(a, b) do { \
+    if (strcmp((a), (b)) != 0) { \
+      fprintf(stderr, "%s:%d: got '%s', expected '%s'\n", __FILE__, __LINE__, (a), (b)); \
+      failures++; \
+    } \
+  } while (0)
+
+/* The CRC as the datasheet describes it, bit by bit. */
+static uint8_t crc_bitwise(uint8_t b1, uint8_t b2)
+{
+    uint8_t crc = 0xff;
+    uint8_t b[2] = { b1, b2 };
+    for (int i = 0; i < 2; i++) {
+      crc ^= b[i];
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 0x80) ? ((crc << 1) ^ 0x31) : (crc << 1);
+      }
+    }
+    return crc;
+}
+
+static void test_crc(void)
+{
+    /* The example from the datasheet */
+    CHECK(scd30proto_crc(0xbe, 0xef) == 0x92);
+    int bad = 0;
+    for (int i = 0; i < 65536; i++) {
+      if (scd30proto_crc(i >> 8, i & 0xff) != crc_bitwise(i >> 8, i & 0xff)) bad++;
+    }
+    CHECK(bad == 0);
+}
+
+static void test_frames(void)
+{
+    uint8_t buf[SCD30_MAXCMDLEN];
+    uint16_t w;
+    /* Start periodic measurement without pressure compensation */
+    CHECK(scd30proto_buildcmd(buf, 0x0010, 1, 0) == 5);
+    CHECK((buf[0] == 0x00) && (buf[1] == 0x10) && (buf[2] == 0x00)
+       && (buf[3] == 0x00) && (buf[4] == 0x81));
+    CHECK(scd30proto_buildcmd(buf, 0x0300, 0, 0) == 2);
+    CHECK((buf[0] == 0x03) && (buf[1] == 0x00));
+    uint8_t word[3] = { 0xbe, 0xef, 0x92 };
+    CHECK((scd30proto_decodeword(word, &w) == 0) && (w == 0xbeef));
+    word[2] ^= 1;
+    CHECK(scd30proto_decodeword(word, &w) == -1);
+}
+
+static void test_sim(void)
+{
+    struct scd30sim sim;
+    struct scd30transport tp;
+    struct scd30data d;
+    int badword = -1;
+    scd30sim_init(&sim, 1);
+    scd30sim_transport(&sim, &tp);
+    /* Not measuring yet, so there is never data */
+    scd30sim_measure(&sim, 800.0, 21.5, 45.0);
+    CHECK(scd30sim_fetch(&tp, &d, &badword) == -1);
+    uint8_t cmd[SCD30_MAXCMDLEN];
+    tp.write(tp.ctx, cmd, scd30proto_buildcmd(cmd, 0x0010, 1, 0));
+    CHECK(sim.measuring == 1);
+    CHECK(scd30sim_fetch(&tp, &d, &badword) == SCD30_DECODE_OK);
+    CHECK(d.valid && (d.co2 == 800.0f) && (d.temp == 21.5f) && (d.hum == 45.0f));
+    /* Read, so nothing new until the next measurement */
+    CHECK(scd30sim_fetch(&tp, &d, &badword) == -1);
+    /* A broken argument CRC gets rejected */
+    scd30proto_buildcmd(cmd, 0x4600, 1, 30);
+    cmd[4] ^= 0x55;
+    CHECK(tp.write(tp.ctx, cmd, 5) != 0);
+    CHECK((sim.interval == 2) && (sim.badframes == 1));
+    tp.write(tp.ctx, cmd, scd30proto_buildcmd(cmd, 0x4600, 1, 30));
+    CHECK(sim.interval == 30);
+    /* Implausible values */
+    scd30sim_measure(&sim, 50.0, 21.5, 45.0);
+    CHECK(scd30sim_fetch(&tp, &d, &badword) == SCD30_DECODE_INSANE);
+    CHECK(!d.valid);
+    scd30sim_measure(&sim, 800.0, 21.5, 120.0);
+    CHECK(scd30sim_fetch(&tp, &d, &badword) == SCD30_DECODE_INSANE);
+}
+
+/* Runs n measurements through the simulation with the given faults,
+ * and checks that every fault that was injected shows up as exactly
+ * one failed read, and that everything that gets through is right. */
+static void test_faults(uint16_t crcrate, uint16_t nanrate, uint16_t timeoutrate)
+{
+    struct scd30sim sim;
+    struct scd30transport tp;
+    struct scd30data d;
+    uint8_t cmd[SCD30_MAXCMDLEN];
+    uint32_t ok = 0, crcfails = 0, insane = 0, iofails = 0, wrong = 0;
+    const int n = 20000;
+    scd30sim_init(&sim, 0x12345678);
+    scd30sim_transport(&sim, &tp);
+    tp.write(tp.ctx, cmd, scd30proto_buildcmd(cmd, 0x0010, 1, 0));
+    sim.crcrate = crcrate;
+    sim.nanrate = nanrate;
+    sim.timeoutrate = timeoutrate;
+    for (int i = 0; i < n; i++) {
+      float co2 = 400.0 + (i % 1600);
+      float temp = 15.0 + (i % 100) * 0.1;
+      float hum = 30.0 + (i % 50);
+      int badword = -1;
+      scd30sim_measure(&sim, co2, temp, hum);
+      int res = scd30sim_fetch(&tp, &d, &badword);
+      if (res == -1) {
+        iofails++;
+      } else if (res == SCD30_DECODE_CRCFAIL) {
+        crcfails++;
+        CHECK((badword >= 0) && (badword < 6));
+        CHECK(!d.valid);
+      } else if (res == SCD30_DECODE_INSANE) {
+        insane++;
+        CHECK(!d.valid);
+      } else {
+        ok++;
+        if ((!d.valid) || (d.co2 != co2) || (d.temp != temp) || (d.hum != hum)) wrong++;
+      }
+    }
+    CHECK(wrong == 0);
+    CHECK(ok + crcfails + insane + iofails == n);
+    if ((crcrate > 0) && (nanrate == 0) && (timeoutrate == 0)) {
+      /* A corrupted "data ready" reply also makes the fetch fail */
+      CHECK(crcfails + iofails == sim.crcinjected);
+      CHECK(crcfails > 0);
+    }
+    if ((nanrate > 0) && (crcrate == 0) && (timeoutrate == 0)) {
+      CHECK(insane == sim.naninjected);
+      CHECK(insane > 0);
+    }
+    if ((timeoutrate > 0) && (crcrate == 0) && (nanrate == 0)) {
+      CHECK(iofails == sim.timeouts);
+      CHECK(iofails > 0);
+    }
+    if (crcrate + nanrate + timeoutrate == 0) {
+      CHECK(ok == n);
+    }
+}
+
+static void test_render(void)
+{
+    char buf[RENDER_HTMLTABLEMAXLEN];
+    struct snapshot sn = { .seq = 7, .ts = 1700000000, .co2 = 612.4, .temp = 21.456, .hum = 40.26 };
+    CHECK(render_json(buf, &sn, 0) < RENDER_JSONMAXLEN);
+    CHECKSTR(buf, "{\"ts\":1700000000,\"co2\":\"612\",\"temp\":\"21.46\",\"hum\":\"40.3\"}");
+    render_json(buf, &sn, 1);
+    CHECKSTR(buf, "{\"ts\":1700000000,\"co2\":\"----\",\"temp\":\"--.--\",\"hum\":\"--.-\"}");
+    sn.temp = -3.04;
+    render_json(buf, &sn, 0);
+    CHECKSTR(buf, "{\"ts\":1700000000,\"co2\":\"612\",\"temp\":\"-3.04\",\"hum\":\"40.3\"}");
+    /* The longest values we can get must fit the buffers */
+    sn.ts = 0x7fffffff; sn.co2 = 40000.0; sn.temp = -999.99; sn.hum = -999.99;
+    CHECK(render_json(buf, &sn, 0) < RENDER_JSONMAXLEN);
+    CHECK(render_htmltable(buf, &sn, 0) < RENDER_HTMLTABLEMAXLEN);
+    CHECK(render_htmltable(buf, &sn, 1) < RENDER_HTMLTABLEMAXLEN);
+}
+
+/* A flush function that collects everything into one large buffer. */
+struct collector {
+  char data[16384];
+  size_t len;
+  int failafter; /* Fail after that many flushes, -1 = never */
+};
+
+static int collect(void * ctx, const char * data, size_t len)
+{
+    struct collector * c = (struct collector *)ctx;
+    if (c->failafter == 0) return -1;
+    if (c->failafter > 0) c->failafter--;
+    if (c->len + len > sizeof(c->data)) return -1;
+    memcpy(c->data + c->len, data, len);
+    c->len += len;
+    return 0;
+}
+
+static void test_respbuf(void)
+{
+    struct respbuf rb, rb2, rb3;
+    static struct collector c;
+    /* Numbers */
+    CHECK(respbuf_init(&rb, NULL, NULL) == 0);
+    respbuf_fixed(&rb, -5, 2);
+    respbuf_char(&rb, ' ');
+    respbuf_fixed(&rb, 123456, 3);
+    respbuf_char(&rb, ' ');
+    respbuf_int(&rb, INT64_MIN);
+    respbuf_char(&rb, ' ');
+    respbuf_uint(&rb, UINT64_MAX);
+    respbuf_char(&rb, 0);
+    CHECKSTR(rb.buf, "-0.05 123.456 -9223372036854775808 18446744073709551615");
+    CHECK(rb.err == 0);
+    /* The pool only has RESPBUF_POOLSIZE buffers */
+    CHECK(respbuf_init(&rb2, NULL, NULL) == 0);
+    CHECK(respbuf_init(&rb3, NULL, NULL) == -1);
+    respbuf_release(&rb2);
+    /* Without a flush function, it truncates instead of overflowing */
+    rb.len = 0;
+    for (int i = 0; i < RESPBUF_SIZE; i++) respbuf_str(&rb, "xy");
+    CHECK((rb.len == RESPBUF_SIZE) && (rb.err != 0));
+    CHECK(respbuf_finish(&rb) != 0);
+    /* With one, everything gets through in order */
+    c.len = 0;
+    c.failafter = -1;
+    CHECK(respbuf_init(&rb, collect, &c) == 0);
+    static char big[3000];
+    memset(big, 'b', sizeof(big));
+    for (int i = 0; i < 1000; i++) {
+      respbuf_uint(&rb, i);
+      respbuf_char(&rb, ',');
+    }
+    respbuf_mem(&rb, big, sizeof(big));
+    CHECK(respbuf_finish(&rb) == 0);
+    CHECK(rb.flushes > 3);
+    size_t pos = 0;
+    int bad = 0;
+    for (int i = 0; i < 1000; i++) {
+      char tmp[16];
+      int l = sprintf(tmp, "%d,", i);
+      if (memcmp(c.data + pos, tmp, l) != 0) bad++;
+      pos += l;
+    }
+    CHECK(bad == 0);
+    CHECK((c.len == pos + sizeof(big)) && (memcmp(c.data + pos, big, sizeof(big)) == 0));
+    /* A failing flush sticks */
+    c.len = 0;
+    c.failafter = 1;
+    CHECK(respbuf_init(&rb, collect, &c) == 0);
+    for (int i = 0; i < 1000; i++) respbuf_str(&rb, "0123456789");
+    CHECK(respbuf_finish(&rb) != 0);
+    /* Only the first buffer, filled with as many whole strings as fit */
+    CHECK(c.len == (RESPBUF_SIZE / 10) * 10);
+}
+
+static void test_cbor(void)
+{
+    struct respbuf rb;
+    CHECK(respbuf_init(&rb, NULL, NULL) == 0);
+    cbor_uint(&rb, 23);
+    cbor_uint(&rb, 24);
+    cbor_uint(&rb, 500);
+    cbor_int(&rb, -1);
+    cbor_int(&rb, -1000);
+    cbor_uint(&rb, 1700000000);
+    cbor_text(&rb, "co2");
+    cbor_bool(&rb, 1);
+    cbor_null(&rb);
+    static const uint8_t exp[] = {
+      0x17, 0x18, 0x18, 0x19, 0x01, 0xf4, 0x20, 0x39, 0x03, 0xe7,
+      0x1a, 0x65, 0x53, 0xf1, 0x00, 0x63, 'c', 'o', '2', 0xf5, 0xf6
+    };
+    CHECK((rb.len == sizeof(exp)) && (memcmp(rb.buf, exp, sizeof(exp)) == 0));
+    respbuf_release(&rb);
+    /* /json as CBOR */
+    struct snapshot sn = { .seq = 1, .ts = 100, .co2 = 612.4, .temp = 21.456, .hum = 40.26 };
+    CHECK(respbuf_init(&rb, NULL, NULL) == 0);
+    render_cbor(&rb, &sn, 0);
+    static const uint8_t expjson[] = {
+      0xa6, 0x61, 'v', 0x01, 0x62, 't', 's', 0x18, 100,
+      0x65, 'v', 'a', 'l', 'i', 'd', 0xf5,
+      0x63, 'c', 'o', '2', 0x19, 0x02, 0x64,
+      0x64, 't', 'e', 'm', 'p', 0x19, 0x08, 0x62,
+      0x63, 'h', 'u', 'm', 0x19, 0x01, 0x93
+    };
+    CHECK((rb.len == sizeof(expjson)) && (memcmp(rb.buf, expjson, sizeof(expjson)) == 0));
+    respbuf_release(&rb);
+}
+
+int main(int argc, char ** argv)
+{
+    test_crc();
+    test_frames();
+    test_sim();
+    test_faults(0, 0, 0);
+    test_faults(20, 0, 0);
+    test_faults(0, 20, 0);
+    test_faults(0, 0, 20);
+    test_faults(20, 20, 20);
+    test_render();
+    test_respbuf();
+    test_cbor();
+    if (failures > 0) {
+      fprintf(stderr, "%d checks failed.\n", failures);
+      return 1;
+    }
+    printf("All checks passed.\n");
+    return 0;
+}
@@ -0,0 +1,170 @@
+/* A simulated SCD30 for the host build. */
+
+#include <string.h>
+#include <math.h>
+#include "scd30sim.h"
+
+/* xorshift32 - good enough for deciding when to misbehave. */
+static uint32_t scd30sim_rand(struct scd30sim * s)
+{
+    uint32_t x = s->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    s->rng = x;
+    return x;
+}
+
+/* Returns 1 with a probability of rate/1000. */
+static int scd30sim_chance(struct scd30sim * s, uint16_t rate)
+{
+    if (rate == 0) return 0;
+    return ((scd30sim_rand(s) % 1000) < rate);
+}
+
+void scd30sim_init(struct scd30sim * s, uint32_t seed)
+{
+    memset(s, 0, sizeof(struct scd30sim));
+    s->interval = 2; /* The sensors default */
+    s->rng = seed;
+}
+
+/* Puts a 16 bit word and its CRC into buf, as the sensor sends it. */
+static void scd30sim_putword(uint8_t * buf, uint16_t w)
+{
+    buf[0] = (w >> 8) & 0xff;
+    buf[1] = (w >> 0) & 0xff;
+    buf[2] = scd30proto_crc(buf[0], buf[1]);
+}
+
+/* A float is sent as two words, most significant first. */
+static void scd30sim_putfloat(uint8_t * buf, float f)
+{
+    uint32_t raw;
+    memcpy(&raw, &f, 4);
+    scd30sim_putword(buf, raw >> 16);
+    scd30sim_putword(buf + 3, raw & 0xffff);
+}
+
+static int scd30sim_write(void * ctx, const uint8_t * buf, size_t len)
+{
+    struct scd30sim * s = (struct scd30sim *)ctx;
+    uint16_t cmd, arg = 0;
+    s->writes++;
+    if (scd30sim_chance(s, s->timeoutrate)) {
+      s->timeouts++;
+      return SCD30SIM_TIMEOUT;
+    }
+    if ((len != 2) && (len != 5)) {
+      s->badframes++;
+      return -1;
+    }
+    cmd = ((uint16_t)buf[0] << 8) | buf[1];
+    if (len == 5) {
+      if (scd30proto_decodeword(buf + 2, &arg) != 0) {
+        /* The sensor ignores commands with a broken argument */
+        s->badframes++;
+        return -1;
+      }
+    }
+    s->lastcmd = cmd;
+    switch (cmd) {
+    case 0x0010: /* Start periodic measurement */
+      s->measuring = 1;
+      s->pressure = arg;
+      break;
+    case 0x0104: /* Stop periodic measurement */
+      s->measuring = 0;
+      break;
+    case 0x4600: /* Measurement interval, without argument it is read */
+      if (len == 5) {
+        if ((arg < 2) || (arg > 1800)) {
+          s->badframes++;
+          return -1;
+        }
+        s->interval = arg;
+      }
+      break;
+    default:
+      break;
+    }
+    return 0;
+}
+
+static int scd30sim_read(void * ctx, uint8_t * buf, size_t len)
+{
+    struct scd30sim * s = (struct scd30sim *)ctx;
+    s->reads++;
+    if (scd30sim_chance(s, s->timeoutrate)) {
+      s->timeouts++;
+      return SCD30SIM_TIMEOUT;
+    }
+    memset(buf, 0xff, len);
+    switch (s->lastcmd) {
+    case 0x0202: /* Data ready status */
+      if (len < 3) return -1;
+      scd30sim_putword(buf, (s->measuring && s->dataready) ? 1 : 0);
+      break;
+    case 0x4600:
+      if (len < 3) return -1;
+      scd30sim_putword(buf, s->interval);
+      break;
+    case 0x0300: /* Read measurement */
+      if (len < SCD30_MEASLEN) return -1;
+      {
+        float v[3] = { s->co2, s->temp, s->hum };
+        if (scd30sim_chance(s, s->nanrate)) {
+          v[scd30sim_rand(s) % 3] = NAN;
+          s->naninjected++;
+        }
+        for (int i = 0; i < 3; i++) {
+          scd30sim_putfloat(buf + (i * 6), v[i]);
+        }
+        s->dataready = 0;
+      }
+      break;
+    default:
+      /* The real sensor would NACK this */
+      s->badframes++;
+      return -1;
+    }
+    if (scd30sim_chance(s, s->crcrate)) {
+      /* Flip one bit in one of the words we sent, data or CRC. */
+      uint32_t r = scd30sim_rand(s);
+      size_t pos = (r >> 8) % ((len / 3) * 3);
+      buf[pos] ^= (1 << (r & 7));
+      s->crcinjected++;
+    }
+    return 0;
+}
+
+void scd30sim_transport(struct scd30sim * s, struct scd30transport * t)
+{
+    t->write = scd30sim_write;
+    t->read = scd30sim_read;
+    t->ctx = s;
+}
+
+void scd30sim_measure(struct scd30sim * s, float co2, float temp, float hum)
+{
+    s->co2 = co2;
+    s->temp = temp;
+    s->hum = hum;
+    s->dataready = 1;
+}
+
+int scd30sim_fetch(const struct scd30transport * t, struct scd30data * d, int * badword)
+{
+    uint8_t buf[SCD30_MEASLEN];
+    uint8_t cmd[SCD30_MAXCMDLEN];
+    uint16_t w;
+    size_t len;
+    len = scd30proto_buildcmd(cmd, 0x0202, 0, 0);
+    if (t->write(t->ctx, cmd, len) != 0) return -1;
+    if (t->read(t->ctx, buf, 3) != 0) return -1;
+    if ((scd30proto_decodeword(buf, &w) != 0) || (w != 1)) return -1;
+    len = scd30proto_buildcmd(cmd, 0x0300, 0, 0);
+    if (t->write(t->ctx, cmd, len) != 0) return -1;
+    if (t->read(t->ctx, buf, SCD30_MEASLEN) != 0) return -1;
+    return scd30proto_decodemeas(buf, d, badword);
+}
@@ -0,0 +1,52 @@
+
+/* A simulated SCD30 for the host build. It speaks the same protocol
+ * as the real sensor through a struct scd30transport, and can be told
+ * to misbehave: corrupt CRCs, send NaNs, or not answer at all. */
+
+#ifndef _SCD30SIM_H_
+#define _SCD30SIM_H_
+
+#include <stdint.h>
+#include "scd30proto.h"
+
+/* What read/write return when the sensor does not answer, the same
+ * value as ESP_ERR_TIMEOUT in the IDF. */
+#define SCD30SIM_TIMEOUT 0x107
+
+struct scd30sim {
+  /* The device */
+  uint16_t lastcmd;    /* Last command written, determines what a read returns */
+  uint16_t interval;   /* Measurement interval in seconds */
+  uint16_t pressure;   /* Pressure compensation in mbar, 0 = off */
+  uint8_t measuring;   /* Periodic measurement started? */
+  uint8_t dataready;   /* Is there a measurement that has not been read? */
+  float co2, temp, hum; /* What the next measurement will contain */
+  /* Fault injection. Rates are per 1000 transfers (or measurements
+   * for nanrate), and decided by a PRNG so runs are repeatable. */
+  uint16_t crcrate;     /* Flip a bit in one word of a reply */
+  uint16_t nanrate;     /* Replace one value with NaN (with a valid CRC) */
+  uint16_t timeoutrate; /* Do not answer a read or write */
+  uint32_t rng;
+  /* Statistics, for the checks */
+  uint32_t writes, reads;
+  uint32_t crcinjected, naninjected, timeouts;
+  uint32_t badframes;   /* Writes the real sensor would have NACKed */
+};
+
+/* Initializes the device model. seed must not be 0. */
+void scd30sim_init(struct scd30sim * s, uint32_t seed);
+
+/* Fills in t so that the firmware code talks to s through it. */
+void scd30sim_transport(struct scd30sim * s, struct scd30transport * t);
+
+/* Sets the values of the next measurement and makes it ready, as if
+ * the measurement interval had passed. */
+void scd30sim_measure(struct scd30sim * s, float co2, float temp, float hum);
+
+/* Does what scd30.c does to get one measurement through the transport:
+ * ask whether data is ready, then read and decode it. Returns -1 if
+ * the transport failed or no data was ready, otherwise the result of
+ * scd30proto_decodemeas. */
+int scd30sim_fetch(const struct scd30transport * t, struct scd30data * d, int * badword);
+
+#endif /* _SCD30SIM_H_ */
@@ -0,0 +1,779 @@
+/* Time-accelerated soak test. Measurements from a simulated SCD30 go
+ * through the same code as on the device - decoding, snapshot,
+ * aggregates, history and the adaptive measurement interval - under a
+ * virtual clock, while client threads request pages, and WiFi drops
+ * out now and then. The page contents and the /live sessions come
+ * from pages.c, exactly as the webserver sends them. Afterwards it
+ * reports the heap growth and peak of that code, and how the latency
+ * of every kind of request developed over the simulated weeks.
+ *
+ * What this does NOT cover is everything that needs the ESP-IDF: the
+ * HTTP part of webserver.c (esp_http_server and lwIP), the pipeline
+ * with its queues and tasks, measlog, network and the exporter. In
+ * their place are a few lines of glue here - what the httpd does
+ * around the handlers, and what consume_live does. So the heap
+ * figures are those of the code under test, not of the firmware, and
+ * leaks or slowdowns in those other parts cannot show up here. Like
+ * on the device, only one request is handled at a time.
+ *
+ * Usage: soak [-d days] [-c clients] [-r seconds] [-x speedup]
+ *             [-f file] [-s seed] [-m maxdrift]
+ *   -d  how long to simulate (default 90 days)
+ *   -c  number of concurrent clients (default 4)
+ *   -r  seconds between requests of each client (default 10)
+ *   -x  run that many times faster than real time, e.g. 1000.
+ *       Default is 0, as fast as possible.
+ *   -f  replay measurements from a file instead of synthetic ones.
+ *       Anything with four numbers per measurement (ts, co2, temp,
+ *       hum) works, e.g. a CSV or what /history returns.
+ *   -m  fail if the median latency of any request type in the last
+ *       week is more than this many times that of the first week */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "aggregates.h"
+#include "history.h"
+#include "hostos.h"
+#include "pages.h"
+#include "render.h"
+#include "respbuf.h"
+#include "sampling.h"
+#include "scd30proto.h"
+#include "scd30sim.h"
+#include "snapshot.h"
+
+/* Wall clock at the (simulated) boot */
+#define SOAK_BOOTTS 1700000000
+#define SOAK_WEEK (7 * 86400)
+
+/***** Heap accounting: malloc and friends are wrapped (see
+ ***** CMakeLists.txt), so we see every allocation made by the
+ ***** firmware code under test and by us - but not those inside
+ ***** libc. */
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t n, size_t size);
+void * __real_realloc(void * p, size_t size);
+void __real_free(void * p);
+
+/* In front of every block, keeping the alignment malloc guarantees. */
+#define HEAPHDR 16
+
+static int64_t heapinuse = 0;
+static int64_t heappeak = 0;
+static int64_t heapallocs = 0;
+
+static void heap_account(int64_t delta)
+{
+    int64_t now = __atomic_add_fetch(&heapinuse, delta, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&heappeak, __ATOMIC_RELAXED);
+    while ((now > peak)
+        && !__atomic_compare_exchange_n(&heappeak, &peak, now, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      /* peak was updated, try again */
+    }
+}
+
+void * __wrap_malloc(size_t size)
+{
+    uint8_t * p = __real_malloc(size + HEAPHDR);
+    if (p == NULL) return NULL;
+    *(size_t *)p = size;
+    heap_account(size);
+    __atomic_add_fetch(&heapallocs, 1, __ATOMIC_RELAXED);
+    return p + HEAPHDR;
+}
+
+void __wrap_free(void * p)
+{
+    if (p == NULL) return;
+    uint8_t * b = (uint8_t *)p - HEAPHDR;
+    heap_account(-(int64_t)*(size_t *)b);
+    __real_free(b);
+}
+
+void * __wrap_calloc(size_t n, size_t size)
+{
+    void * p = __wrap_malloc(n * size);
+    if (p != NULL) memset(p, 0, n * size);
+    return p;
+}
+
+void * __wrap_realloc(void * p, size_t size)
+{
+    if (p == NULL) return __wrap_malloc(size);
+    uint8_t * b = (uint8_t *)p - HEAPHDR;
+    size_t old = *(size_t *)b;
+    uint8_t * nb = __real_realloc(b, size + HEAPHDR);
+    if (nb == NULL) return NULL;
+    *(size_t *)nb = size;
+    heap_account((int64_t)size - (int64_t)old);
+    return nb + HEAPHDR;
+}
+
+/***** Settings and shared state *****/
+
+static int soakdays = 90;
+static int soakclients = 4;
+static int soakreqint = 10;
+static double soakspeedup = 0.0;
+static uint32_t soakseed = 1;
+static double soakmaxdrift = 0.0;
+static const char * soakfile = NULL;
+
+/* Replayed measurements: co2, temp, hum */
+static float * replay = NULL;
+static size_t replaylen = 0;
+
+/* Virtual time in seconds since boot that the sensor thread has
+ * reached. Clients handle all their requests up to it, then report
+ * back in their donets, and only then the sensor moves on. */
+static volatile int64_t simnow = 0;
+static volatile int simdone = 0;
+static int nweeks;
+
+/* The network, as the clients see it */
+static volatile int netup = 1;
+
+/* There is only one httpd task on the device, so only one request
+ * is handled at a time. */
+static pthread_mutex_t httpdlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The request types we time, live_push included */
+enum reqtype {
+  RQ_START, RQ_JSON, RQ_JSONAGG, RQ_CBOR, RQ_HISTRECENT, RQ_HISTFULL,
+  RQ_LIVESUB, RQ_LIVEPUSH, RQ_NUMTYPES
+};
+static const char * reqnames[RQ_NUMTYPES] = {
+  "/", "/json", "json?agg", "cbor", "hist?since", "/history", "livesub", "livepush"
+};
+
+/* Latencies go into histograms with 8 buckets per power of two,
+ * from 1 ns to about 4 s. One set per simulated week. */
+#define LATBUCKETS 256
+static uint32_t * lathist = NULL; /* [week][type][bucket] */
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int latbucket(double ns)
+{
+    if (ns < 1.0) return 0;
+    int b = (int)(8.0 * log2(ns));
+    return (b >= LATBUCKETS) ? (LATBUCKETS - 1) : b;
+}
+
+static uint32_t * lathist_at(uint32_t * h, int week, int type)
+{
+    return &h[((week * RQ_NUMTYPES) + type) * LATBUCKETS];
+}
+
+/* Returns the latency (upper bound of the bucket) at quantile q. */
+static double lathist_quantile(const uint32_t * h, double q)
+{
+    uint64_t total = 0, sum = 0;
+    for (int b = 0; b < LATBUCKETS; b++) total += h[b];
+    if (total == 0) return NAN;
+    for (int b = 0; b < LATBUCKETS; b++) {
+      sum += h[b];
+      if (sum >= (uint64_t)ceil(q * total)) return exp2((b + 1) / 8.0);
+    }
+    return exp2(LATBUCKETS / 8.0);
+}
+
+/***** What the httpd and webserver.c do around pages.c *****/
+
+/* The measurement interval, as valueinterval in foxco2_2022_main.c.
+ * Only changed while holding httpdlock. */
+static uint16_t soakinterval = 55;
+
+static void rendercache_update(void)
+{
+    pages_update(hostos_time(), soakinterval);
+}
+
+/* One client with its connection to the webserver. */
+struct client {
+  pthread_t thread;
+  int idx;
+  uint32_t rng;
+  int64_t nextreq;     /* Virtual time of the next request */
+  volatile int64_t donets;
+  int fd;              /* Our "socket", changes with every connection */
+  volatile int cut;    /* The network went down, the connection breaks */
+  int connected;
+  struct livesess * live; /* Our /live session, if any */
+  time_t lasthist;     /* Newest history entry we have seen */
+  uint32_t n;          /* Requests made */
+  /* Statistics */
+  uint64_t requests, bytes, cutoff, skipped, refused, reconnects;
+  uint32_t * lathist;
+};
+
+static int client_flush(void * ctx, const char * data, size_t len)
+{
+    struct client * c = (struct client *)ctx;
+    if (c->cut) return -1;
+    c->bytes += len;
+    return 0;
+}
+
+static int resp_begin(struct respbuf * rb, struct client * c)
+{
+    if (respbuf_init(rb, client_flush, c) != 0) {
+      c->refused++;
+      return -1;
+    }
+    return 0;
+}
+
+static void resp_end(struct respbuf * rb, struct client * c)
+{
+    if (rb->flushes == 0) {
+      client_flush(c, rb->buf, rb->len);
+      respbuf_release(rb);
+      return;
+    }
+    respbuf_finish(rb);
+}
+
+/* The handlers: the same as in webserver.c, minus the HTTP headers
+ * and conditional requests. */
+
+static void handle_start(struct client * c)
+{
+    struct respbuf rb;
+    rendercache_update();
+    if (resp_begin(&rb, c) != 0) return;
+    pages_startpage(&rb);
+    resp_end(&rb, c);
+}
+
+static void handle_json(struct client * c)
+{
+    rendercache_update();
+    client_flush(c, rcache.json, strlen(rcache.json));
+}
+
+static void handle_jsonagg(struct client * c)
+{
+    struct respbuf rb;
+    rendercache_update();
+    if (resp_begin(&rb, c) != 0) return;
+    pages_jsonagg(&rb);
+    resp_end(&rb, c);
+}
+
+static void handle_cbor(struct client * c)
+{
+    struct respbuf rb;
+    rendercache_update();
+    if (resp_begin(&rb, c) != 0) return;
+    pages_cbor(&rb);
+    resp_end(&rb, c);
+}
+
+static void handle_history(struct client * c, time_t since)
+{
+    struct respbuf rb;
+    if (resp_begin(&rb, c) != 0) return;
+    time_t newest = pages_history(&rb, since, 0);
+    if (newest > c->lasthist) c->lasthist = newest;
+    resp_end(&rb, c);
+}
+
+static void handle_livesub(struct client * c)
+{
+    struct respbuf rb;
+    struct livesess * ls;
+    int full;
+    if (c->live != NULL) {
+      /* Tab closed */
+      pages_liveclosed(c->live);
+      c->live = NULL;
+      return;
+    }
+    ls = pages_livenew(c->fd, &full);
+    if (ls == NULL) {
+      c->refused++;
+      return;
+    }
+    rendercache_update();
+    if (resp_begin(&rb, c) != 0) {
+      pages_liveclosed(ls);
+      return;
+    }
+    pages_livestart(&rb);
+    if (respbuf_finish(&rb) != 0) {
+      pages_liveclosed(ls);
+      return;
+    }
+    pages_liveactivate(ls);
+    c->live = ls;
+}
+
+/* Sends rb to all /live subscribers. As in webserver.c, a failed send
+ * only triggers the close, the session goes away later. */
+static void live_sendall(struct respbuf * rb, struct client * clients)
+{
+    respbuf_str(rb, "\r\n");
+    if (rb->err) return;
+    for (int i = 0; i < soakclients; i++) {
+      struct client * c = &clients[i];
+      if ((c->live == NULL) || (pages_livefd(c->live->slot) != c->fd)) continue;
+      if (!c->cut) c->bytes += rb->len;
+    }
+}
+
+static void live_push(struct client * clients)
+{
+    struct respbuf rb;
+    rendercache_update();
+    if (respbuf_init(&rb, NULL, NULL) != 0) return;
+    pages_liveevent(&rb);
+    live_sendall(&rb, clients);
+    respbuf_release(&rb);
+    if (respbuf_init(&rb, NULL, NULL) != 0) return;
+    pages_liveaggevent(&rb);
+    live_sendall(&rb, clients);
+    respbuf_release(&rb);
+}
+
+/***** The clients *****/
+
+static uint32_t xorshift(uint32_t * s)
+{
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *s = x;
+    return x;
+}
+
+static void client_request(struct client * c, int64_t now)
+{
+    enum reqtype t;
+    uint32_t k = c->n++ % 100;
+    if (!c->connected) {
+      /* Like a browser after an outage: reconnect, reload the page
+       * and get the history we missed. */
+      c->connected = 1;
+      c->fd += PAGES_LIVEMAXSUBS * 16; /* sockets get reused, but not right away */
+      c->reconnects++;
+      t = (c->lasthist > 0) ? RQ_HISTRECENT : RQ_START;
+    } else if (k == 99) {
+      t = RQ_LIVESUB;
+    } else if (k == 50) {
+      t = RQ_HISTFULL;
+    } else if ((k % 10) == 5) {
+      t = RQ_HISTRECENT;
+    } else if ((k % 10) == 7) {
+      t = RQ_START;
+    } else if ((k % 5) == 1) {
+      t = RQ_JSONAGG;
+    } else if ((k % 5) == 3) {
+      t = RQ_CBOR;
+    } else {
+      t = RQ_JSON;
+    }
+    double start = now_ns();
+    pthread_mutex_lock(&httpdlock);
+    switch (t) {
+    case RQ_START: handle_start(c); break;
+    case RQ_JSON: handle_json(c); break;
+    case RQ_JSONAGG: handle_jsonagg(c); break;
+    case RQ_CBOR: handle_cbor(c); break;
+    case RQ_HISTRECENT: handle_history(c, c->lasthist); break;
+    case RQ_HISTFULL: handle_history(c, 0); break;
+    case RQ_LIVESUB: handle_livesub(c); break;
+    default: break;
+    }
+    pthread_mutex_unlock(&httpdlock);
+    double lat = now_ns() - start;
+    int week = now / SOAK_WEEK;
+    if (week >= nweeks) week = nweeks - 1;
+    lathist_at(c->lathist, week, t)[latbucket(lat)]++;
+    c->requests++;
+}
+
+static void * client_main(void * arg)
+{
+    struct client * c = (struct client *)arg;
+    for (;;) {
+      int64_t now = __atomic_load_n(&simnow, __ATOMIC_ACQUIRE);
+      int done = __atomic_load_n(&simdone, __ATOMIC_ACQUIRE);
+      if (c->cut) {
+        /* The network just went down: whatever we were receiving
+         * breaks off, and our /live session gets closed. */
+        if (c->live != NULL) {
+          pthread_mutex_lock(&httpdlock);
+          pages_liveclosed(c->live);
+          pthread_mutex_unlock(&httpdlock);
+          c->live = NULL;
+        }
+        if (c->connected && (c->nextreq <= now)) {
+          client_request(c, now);
+          c->cutoff++;
+          c->nextreq += soakreqint / 2 + (xorshift(&c->rng) % (soakreqint + 1));
+        }
+        c->connected = 0;
+        c->cut = 0;
+      }
+      while (c->nextreq <= now) {
+        if (!netup) {
+          c->skipped++;
+        } else {
+          client_request(c, now);
+        }
+        c->nextreq += soakreqint / 2 + (xorshift(&c->rng) % (soakreqint + 1));
+      }
+      __atomic_store_n(&c->donets, now, __ATOMIC_RELEASE);
+      if (done) break;
+      while ((__atomic_load_n(&simnow, __ATOMIC_ACQUIRE) == now)
+          && !__atomic_load_n(&simdone, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+      }
+    }
+    return NULL;
+}
+
+/***** The sensor side, see foxco2_2022_main.c *****/
+
+/* Synthetic data: an office. CO2 rises towards 1400 ppm while people
+ * are there on workdays, and falls back to outside levels otherwise,
+ * with a time constant of half an hour. Temperature and humidity
+ * follow the day a bit. */
+static void synthetic(int64_t t, uint32_t * rng, float * co2, float * temp, float * hum)
+{
+    static float c = 420.0;
+    static int64_t lastt = 0;
+    double hour = fmod(t / 3600.0, 24.0);
+    int workday = ((t / 86400) % 7) < 5;
+    float noise = ((xorshift(rng) % 1000) / 1000.0) - 0.5;
+    float target = 420.0;
+    if (workday && (hour >= 8.0) && (hour < 17.0) && ((int)hour != 12)) {
+      target = 1400.0;
+    }
+    c += (target - c) * (1.0 - exp(-(t - lastt) / 1800.0));
+    lastt = t;
+    *co2 = c + 10.0 * noise;
+    *temp = 20.5 + 1.5 * sin((hour - 9.0) * M_PI / 12.0) + 0.1 * noise;
+    *hum = 45.0 + 8.0 * sin((hour - 3.0) * M_PI / 12.0) + noise;
+}
+
+static int load_replay(const char * fn)
+{
+    FILE * f = fopen(fn, "r");
+    if (f == NULL) return -1;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char * data = malloc(len + 1);
+    if (fread(data, 1, len, f) != (size_t)len) len = 0;
+    data[len] = 0;
+    fclose(f);
+    /* Every number in there, in groups of four. */
+    double v[4];
+    int nv = 0;
+    size_t cap = 0;
+    char * p = data;
+    while (*p) {
+      char * e;
+      if ((*p == '-') || ((*p >= '0') && (*p <= '9'))) {
+        v[nv++] = strtod(p, &e);
+        p = e;
+        if (nv == 4) {
+          nv = 0;
+          if (replaylen >= cap) {
+            cap = (cap == 0) ? 1024 : (cap * 2);
+            replay = realloc(replay, cap * 3 * sizeof(float));
+          }
+          replay[replaylen * 3 + 0] = v[1];
+          replay[replaylen * 3 + 1] = v[2];
+          replay[replaylen * 3 + 2] = v[3];
+          replaylen++;
+        }
+      } else {
+        p++;
+      }
+    }
+    free(data);
+    return (replaylen > 0) ? 0 : -1;
+}
+
+struct sensorstats {
+  uint64_t measurements, ok, crcfail, insane, iofail;
+  uint64_t outages, outagesecs;
+};
+
+int main(int argc, char ** argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "d:c:r:x:f:s:m:")) != -1) {
+      switch (opt) {
+      case 'd': soakdays = atoi(optarg); break;
+      case 'c': soakclients = atoi(optarg); break;
+      case 'r': soakreqint = atoi(optarg); break;
+      case 'x': soakspeedup = atof(optarg); break;
+      case 'f': soakfile = optarg; break;
+      case 's': soakseed = strtoul(optarg, NULL, 0); break;
+      case 'm': soakmaxdrift = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-d days] [-c clients] [-r seconds] [-x speedup]"
+                        " [-f file] [-s seed] [-m maxdrift]\n", argv[0]);
+        return 2;
+      }
+    }
+    if ((soakdays < 1) || (soakclients < 1) || (soakreqint < 1) || (soakseed == 0)) {
+      fprintf(stderr, "Invalid arguments.\n");
+      return 2;
+    }
+    if ((soakfile != NULL) && (load_replay(soakfile) != 0)) {
+      fprintf(stderr, "Could not read any measurements from %s.\n", soakfile);
+      return 2;
+    }
+    nweeks = (soakdays + 6) / 7;
+
+    /* Everything we need is allocated up front, so what is in use
+     * after that is our baseline. */
+    hostos_setboottime(SOAK_BOOTTS);
+    hostos_setuptime(0);
+    rcache.bootid = soakseed;
+    history_init();
+    aggregates_init();
+    struct client * clients = calloc(soakclients, sizeof(struct client));
+    lathist = calloc(nweeks * RQ_NUMTYPES * LATBUCKETS, sizeof(uint32_t));
+    uint32_t * pushhist = lathist; /* live_push is timed directly into it */
+    for (int i = 0; i < soakclients; i++) {
+      clients[i].idx = i;
+      clients[i].rng = soakseed * 7919 + i;
+      clients[i].fd = 100 + i;
+      clients[i].connected = 1;
+      clients[i].nextreq = 1 + i;
+      clients[i].lathist = calloc(nweeks * RQ_NUMTYPES * LATBUCKETS, sizeof(uint32_t));
+    }
+    struct scd30sim sim;
+    struct scd30transport tp;
+    scd30sim_init(&sim, soakseed);
+    scd30sim_transport(&sim, &tp);
+    sim.crcrate = 2;
+    sim.nanrate = 1;
+    sim.timeoutrate = 2;
+    uint8_t cmd[SCD30_MAXCMDLEN];
+    tp.write(tp.ctx, cmd, scd30proto_buildcmd(cmd, 0x0010, 1, 0));
+    int64_t heapbase = heapinuse;
+    int64_t heapweek[nweeks + 1];
+    memset(heapweek, 0, sizeof(heapweek));
+
+    for (int i = 0; i < soakclients; i++) {
+      pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+    }
+
+    struct sensorstats ss;
+    memset(&ss, 0, sizeof(ss));
+    uint32_t rng = soakseed;
+    uint16_t interval = sampling_levels[SAMPLING_STARTLEVEL];
+    int64_t t = 0;
+    int64_t end = (int64_t)soakdays * 86400;
+    int64_t outageend = 0;
+    size_t replaypos = 0;
+    double realstart = now_ns();
+    while (t < end) {
+      t += interval;
+      hostos_setuptime(t * 1000000LL);
+      /* WiFi: on average one outage every two days, between a few
+       * seconds and half an hour long. */
+      if (netup && ((xorshift(&rng) % (2 * 86400)) < interval)) {
+        netup = 0;
+        outageend = t + (int64_t)exp2(1.5 + (xorshift(&rng) % 1000) / 1000.0 * 9.3);
+        ss.outages++;
+        for (int i = 0; i < soakclients; i++) clients[i].cut = 1;
+      } else if (!netup && (t >= outageend)) {
+        netup = 1;
+      }
+      if (!netup) ss.outagesecs += interval;
+      /* The sensor */
+      float co2, temp, hum;
+      if (replay != NULL) {
+        co2 = replay[replaypos * 3 + 0];
+        temp = replay[replaypos * 3 + 1];
+        hum = replay[replaypos * 3 + 2];
+        replaypos = (replaypos + 1) % replaylen;
+      } else {
+        synthetic(t, &rng, &co2, &temp, &hum);
+      }
+      scd30sim_measure(&sim, co2, temp, hum);
+      struct scd30data d;
+      int badword;
+      int res = scd30sim_fetch(&tp, &d, &badword);
+      ss.measurements++;
+      if (res == SCD30_DECODE_OK) {
+        ss.ok++;
+        /* scd30result */
+        interval = sampling_add(d.co2);
+        /* consume_live, and the live_push it queues in the httpd */
+        time_t ts = hostos_time();
+        snapshot_publish(ts, d.co2, d.temp, d.hum);
+        aggregates_add(d.co2, d.temp, d.hum);
+        history_add(ts, d.co2, d.temp, d.hum);
+        double start = now_ns();
+        pthread_mutex_lock(&httpdlock);
+        soakinterval = interval;
+        live_push(clients);
+        pthread_mutex_unlock(&httpdlock);
+        int week = t / SOAK_WEEK;
+        if (week >= nweeks) week = nweeks - 1;
+        lathist_at(pushhist, week, RQ_LIVEPUSH)[latbucket(now_ns() - start)]++;
+      } else if (res == SCD30_DECODE_CRCFAIL) {
+        ss.crcfail++;
+      } else if (res == SCD30_DECODE_INSANE) {
+        ss.insane++;
+      } else {
+        ss.iofail++;
+      }
+      /* Let the clients catch up */
+      __atomic_store_n(&simnow, t, __ATOMIC_RELEASE);
+      for (int i = 0; i < soakclients; i++) {
+        while (__atomic_load_n(&clients[i].donets, __ATOMIC_ACQUIRE) < t) sched_yield();
+      }
+      heapweek[t / SOAK_WEEK] = heapinuse;
+      if (soakspeedup > 0.0) {
+        double ahead = (t * 1e9 / soakspeedup) - (now_ns() - realstart);
+        if (ahead > 0) usleep(ahead / 1000);
+      }
+    }
+    __atomic_store_n(&simdone, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < soakclients; i++) {
+      pthread_join(clients[i].thread, NULL);
+    }
+    double realsecs = (now_ns() - realstart) / 1e9;
+    /* Close what is still open, so we can compare with the baseline. */
+    for (int i = 0; i < soakclients; i++) {
+      if (clients[i].live != NULL) {
+        pages_liveclosed(clients[i].live);
+        clients[i].live = NULL;
+      }
+    }
+    int64_t heapend = heapinuse;
+
+    /***** Report *****/
+    struct client tot;
+    memset(&tot, 0, sizeof(tot));
+    for (int i = 0; i < soakclients; i++) {
+      struct client * c = &clients[i];
+      tot.requests += c->requests; tot.bytes += c->bytes;
+      tot.cutoff += c->cutoff; tot.skipped += c->skipped;
+      tot.refused += c->refused; tot.reconnects += c->reconnects;
+      for (int j = 0; j < nweeks * RQ_NUMTYPES * LATBUCKETS; j++) {
+        lathist[j] += c->lathist[j];
+      }
+    }
+    printf("Simulated %d days in %.1f s (%.0fx real time), %d clients\n",
+           soakdays, realsecs, end / realsecs, soakclients);
+    printf("Sensor: %llu measurements, %llu ok, %llu CRC errors, %llu implausible, %llu failed reads\n",
+           (unsigned long long)ss.measurements, (unsigned long long)ss.ok,
+           (unsigned long long)ss.crcfail, (unsigned long long)ss.insane,
+           (unsigned long long)ss.iofail);
+    struct samplingstatus smp;
+    sampling_getstatus(&smp);
+    printf("Adaptive interval: %u changes, now %u s\n", smp.changes, smp.interval);
+    printf("WiFi: %llu outages, %.1f hours down in total\n",
+           (unsigned long long)ss.outages, ss.outagesecs / 3600.0);
+    printf("Requests: %llu, %.1f MB sent, %llu cut off by outages, %llu not made while down, "
+           "%llu reconnects, %llu refused\n",
+           (unsigned long long)tot.requests, tot.bytes / 1048576.0,
+           (unsigned long long)tot.cutoff, (unsigned long long)tot.skipped,
+           (unsigned long long)tot.reconnects, (unsigned long long)tot.refused);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("Heap of the code under test: %lld bytes after setup, %lld at the end (%+lld), "
+           "peak %lld, %lld allocations; max RSS %ld KB\n",
+           (long long)heapbase, (long long)heapend, (long long)(heapend - heapbase),
+           (long long)heappeak, (long long)heapallocs, ru.ru_maxrss);
+    printf("\nLatency in microseconds, p50/p99, per simulated week:\n");
+    printf("week %9s", "heap");
+    for (int r = 0; r < RQ_NUMTYPES; r++) printf(" %13s", reqnames[r]);
+    printf("\n");
+    for (int w = 0; w < nweeks; w++) {
+      printf("%4d %9lld", w + 1, (long long)heapweek[w]);
+      for (int r = 0; r < RQ_NUMTYPES; r++) {
+        const uint32_t * h = lathist_at(lathist, w, r);
+        printf("  %5.1f/%6.1f", lathist_quantile(h, 0.5) / 1000.0,
+               lathist_quantile(h, 0.99) / 1000.0);
+      }
+      printf("\n");
+    }
+    printf("drift    ");
+    double maxdrift = 0.0;
+    for (int r = 0; r < RQ_NUMTYPES; r++) {
+      double first = lathist_quantile(lathist_at(lathist, 0, r), 0.5);
+      double last = lathist_quantile(lathist_at(lathist, nweeks - 1, r), 0.5);
+      double drift = last / first;
+      if (isnan(drift)) {
+        printf(" %13s", "-");
+        continue;
+      }
+      if (drift > maxdrift) maxdrift = drift;
+      printf(" %12.2fx", drift);
+    }
+    printf("\n\n");
+
+    /***** Checks *****/
+    int fail = 0;
+    if (heapend != heapbase) {
+      printf("FAIL: %lld bytes of heap leaked\n", (long long)(heapend - heapbase));
+      fail = 1;
+    }
+    struct respbuf rb1, rb2;
+    if ((respbuf_init(&rb1, NULL, NULL) != 0) || (respbuf_init(&rb2, NULL, NULL) != 0)) {
+      printf("FAIL: respbuf pool leaked a buffer\n");
+      fail = 1;
+    }
+    if (tot.refused > 0) {
+      printf("FAIL: %llu requests refused for lack of response buffers or /live slots\n",
+             (unsigned long long)tot.refused);
+      fail = 1;
+    }
+    for (int i = 0; i < PAGES_LIVEMAXSUBS; i++) {
+      if (pages_livefd(i) >= 0) {
+        printf("FAIL: /live slot %d still taken after all sessions closed\n", i);
+        fail = 1;
+      }
+    }
+    struct histcursor hc;
+    struct histentry he[16];
+    int n, hn = 0;
+    time_t hlast = 0;
+    history_cursorinit(&hc, 0);
+    while ((n = history_read(&hc, he, 16)) > 0) {
+      hn += n;
+      hlast = he[n - 1].ts;
+    }
+    if ((hn == 0) || ((hostos_time() - hlast) > 3600)) {
+      printf("FAIL: history has %d entries, the newest from %ld\n", hn, (long)hlast);
+      fail = 1;
+    }
+    struct aggresult aggres[AGG_NUMWINDOWS];
+    aggregates_get(aggres);
+    if (aggres[AGG_NUMWINDOWS - 1].count == 0) {
+      printf("FAIL: no measurements in the %s aggregates\n", aggres[AGG_NUMWINDOWS - 1].name);
+      fail = 1;
+    }
+    if ((soakmaxdrift > 0.0) && (maxdrift > soakmaxdrift)) {
+      printf("FAIL: latency drifted by %.2fx, more than %.2fx\n", maxdrift, soakmaxdrift);
+      fail = 1;
+    }
+    printf("soak test %s\n", (fail ? "FAILED" : "passed"));
+    return fail;
+}
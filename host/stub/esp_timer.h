@@ -0,0 +1,12 @@
+
+/* Host stand-in for esp_timer.h: The uptime comes from the virtual
+ * clock of the simulation, see hostos.c. */
+
+#ifndef _HOST_ESP_TIMER_H_
+#define _HOST_ESP_TIMER_H_
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
+
+#endif /* _HOST_ESP_TIMER_H_ */
@@ -0,0 +1,26 @@
+
+/* Just enough of FreeRTOS for the host build, see hostos.c.
+ * Mutexes and critical sections are pthread mutexes, and time is the
+ * virtual clock of the simulation. */
+
+#ifndef _HOST_FREERTOS_H_
+#define _HOST_FREERTOS_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY ((TickType_t)0xffffffff)
+#define configTICK_RATE_HZ 100
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+
+typedef pthread_mutex_t portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED PTHREAD_MUTEX_INITIALIZER
+#define portENTER_CRITICAL(m) pthread_mutex_lock(m)
+#define portEXIT_CRITICAL(m) pthread_mutex_unlock(m)
+
+#endif /* _HOST_FREERTOS_H_ */
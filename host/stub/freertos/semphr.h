@@ -0,0 +1,15 @@
+
+/* Host stand-in for freertos/semphr.h: only mutexes, see hostos.c. */
+
+#ifndef _HOST_SEMPHR_H_
+#define _HOST_SEMPHR_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef pthread_mutex_t * SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s);
+
+#endif /* _HOST_SEMPHR_H_ */
@@ -0,0 +1,12 @@
+
+/* Host stand-in for freertos/task.h, see hostos.c. */
+
+#ifndef _HOST_TASK_H_
+#define _HOST_TASK_H_
+
+#include "freertos/FreeRTOS.h"
+
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+
+#endif /* _HOST_TASK_H_ */
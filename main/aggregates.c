@@ -0,0 +1,214 @@
+
+/* Rolling aggregates (min/max/mean/EWMA) of the measurements
+ * over several time windows.
+ * Every window is split into AGGBUCKETS buckets, each holding sum,
+ * count, min and max of the measurements that fell into it. Only the
+ * newest bucket gets updated, and whenever time moves on, the oldest
+ * bucket drops out of the window. We keep the sum and count over the
+ * whole window up to date as buckets come and go, and for min and max
+ * a monotonic deque of buckets: For max, the deque holds the buckets
+ * whose max is larger than that of all newer buckets, so the front of
+ * the deque is always the maximum of the window. Everything is O(1)
+ * (amortized) per measurement, no matter how long the window is.
+ * Because of the buckets, a window covers between (1 - 1/AGGBUCKETS)
+ * and 1 times its nominal length.
+ * We use the uptime and not the wall clock, so NTP adjusting the
+ * clock cannot mess things up. */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <esp_timer.h>
+#include <string.h>
+#include <math.h>
+#include "aggregates.h"
+
+#define AGGBUCKETS 12
+
+struct aggbucket {
+  uint32_t num;   /* Absolute bucket number (uptime / bucket length) */
+  uint32_t count;
+  int64_t sum[AGG_NUMVALS];
+  int32_t min[AGG_NUMVALS];
+  int32_t max[AGG_NUMVALS];
+};
+
+/* Deque of bucket numbers, as a ring */
+struct aggdeque {
+  uint32_t nums[AGGBUCKETS];
+  uint8_t head;
+  uint8_t len;
+};
+
+struct aggwindow {
+  const char * name;
+  uint32_t length;     /* in seconds */
+  uint32_t bucketlen;  /* length / AGGBUCKETS */
+  uint32_t cur;        /* Number of the newest bucket */
+  struct aggbucket b[AGGBUCKETS]; /* Bucket n is in b[n % AGGBUCKETS] */
+  uint32_t count;      /* Sum of count over all buckets in the window */
+  int64_t sum[AGG_NUMVALS];
+  struct aggdeque mindq[AGG_NUMVALS];
+  struct aggdeque maxdq[AGG_NUMVALS];
+  float ewma[AGG_NUMVALS];
+  uint32_t ewmats;     /* Uptime of the last update of ewma, 0 = none */
+};
+
+static struct aggwindow aggwindows[AGG_NUMWINDOWS] = {
+  { .name = "1m",  .length = 60 },
+  { .name = "5m",  .length = 300 },
+  { .name = "1h",  .length = 3600 },
+  { .name = "24h", .length = 86400 }
+};
+static SemaphoreHandle_t aggmutex = NULL;
+
+static uint32_t aggregates_uptime(void)
+{
+    /* +1 so that 0 never is a valid time. */
+    return (esp_timer_get_time() / 1000000) + 1;
+}
+
+static uint32_t aggdq_front(const struct aggdeque * dq)
+{
+    return dq->nums[dq->head];
+}
+
+static uint32_t aggdq_back(const struct aggdeque * dq)
+{
+    return dq->nums[(dq->head + dq->len - 1) % AGGBUCKETS];
+}
+
+static void aggdq_popfront(struct aggdeque * dq)
+{
+    dq->head = (dq->head + 1) % AGGBUCKETS;
+    dq->len--;
+}
+
+static void aggdq_popback(struct aggdeque * dq)
+{
+    dq->len--;
+}
+
+static void aggdq_pushback(struct aggdeque * dq, uint32_t num)
+{
+    dq->nums[(dq->head + dq->len) % AGGBUCKETS] = num;
+    dq->len++;
+}
+
+/* Moves the window forward to the bucket for time now, dropping
+ * buckets that fall out of the window. */
+static void aggregates_advance(struct aggwindow * w, uint32_t now)
+{
+    uint32_t newcur = now / w->bucketlen;
+    if (newcur == w->cur) return;
+    uint32_t steps = newcur - w->cur;
+    if (steps > AGGBUCKETS) steps = AGGBUCKETS;
+    for (uint32_t n = newcur - steps + 1; n <= newcur; n++) {
+      struct aggbucket * b = &w->b[n % AGGBUCKETS];
+      w->count -= b->count;
+      for (int v = 0; v < AGG_NUMVALS; v++) {
+        w->sum[v] -= b->sum[v];
+      }
+      memset(b, 0, sizeof(struct aggbucket));
+      b->num = n;
+    }
+    w->cur = newcur;
+    /* Everything that is not one of the last AGGBUCKETS buckets
+     * has left the window. */
+    for (int v = 0; v < AGG_NUMVALS; v++) {
+      while ((w->mindq[v].len > 0) && ((w->cur - aggdq_front(&w->mindq[v])) >= AGGBUCKETS)) {
+        aggdq_popfront(&w->mindq[v]);
+      }
+      while ((w->maxdq[v].len > 0) && ((w->cur - aggdq_front(&w->maxdq[v])) >= AGGBUCKETS)) {
+        aggdq_popfront(&w->maxdq[v]);
+      }
+    }
+}
+
+void aggregates_init(void)
+{
+    uint32_t now = aggregates_uptime();
+    for (int i = 0; i < AGG_NUMWINDOWS; i++) {
+      struct aggwindow * w = &aggwindows[i];
+      w->bucketlen = w->length / AGGBUCKETS;
+      w->cur = now / w->bucketlen;
+      memset(w->b, 0, sizeof(w->b));
+      for (int n = 0; n < AGGBUCKETS; n++) {
+        w->b[n].num = 0xffffffff;
+      }
+      w->b[w->cur % AGGBUCKETS].num = w->cur;
+      w->count = 0;
+      memset(w->sum, 0, sizeof(w->sum));
+      memset(w->mindq, 0, sizeof(w->mindq));
+      memset(w->maxdq, 0, sizeof(w->maxdq));
+      w->ewmats = 0;
+    }
+    aggmutex = xSemaphoreCreateMutex();
+}
+
+void aggregates_add(float co2, float temp, float hum)
+{
+    int32_t vals[AGG_NUMVALS];
+    vals[AGG_CO2] = lroundf(co2);
+    vals[AGG_TEMP] = lroundf(temp * 100.0);
+    vals[AGG_HUM] = lroundf(hum * 10.0);
+    uint32_t now = aggregates_uptime();
+    xSemaphoreTake(aggmutex, portMAX_DELAY);
+    for (int i = 0; i < AGG_NUMWINDOWS; i++) {
+      struct aggwindow * w = &aggwindows[i];
+      aggregates_advance(w, now);
+      struct aggbucket * b = &w->b[w->cur % AGGBUCKETS];
+      float alpha = 1.0;
+      if (w->ewmats != 0) {
+        alpha = 1.0 - expf(-(float)(now - w->ewmats) / (float)w->length);
+      }
+      w->ewmats = now;
+      for (int v = 0; v < AGG_NUMVALS; v++) {
+        if ((b->count == 0) || (vals[v] < b->min[v])) b->min[v] = vals[v];
+        if ((b->count == 0) || (vals[v] > b->max[v])) b->max[v] = vals[v];
+        b->sum[v] += vals[v];
+        w->sum[v] += vals[v];
+        /* The current bucket is always the newest one, so it is (or
+         * becomes) the back of the deque. Everything before it that is
+         * not smaller (larger for max) can never be the result again. */
+        struct aggdeque * dq = &w->mindq[v];
+        while ((dq->len > 0) && (w->b[aggdq_back(dq) % AGGBUCKETS].min[v] >= b->min[v])) {
+          aggdq_popback(dq);
+        }
+        aggdq_pushback(dq, w->cur);
+        dq = &w->maxdq[v];
+        while ((dq->len > 0) && (w->b[aggdq_back(dq) % AGGBUCKETS].max[v] <= b->max[v])) {
+          aggdq_popback(dq);
+        }
+        aggdq_pushback(dq, w->cur);
+        w->ewma[v] += alpha * ((float)vals[v] - w->ewma[v]);
+      }
+      b->count++;
+      w->count++;
+    }
+    xSemaphoreGive(aggmutex);
+}
+
+void aggregates_get(struct aggresult res[AGG_NUMWINDOWS])
+{
+    uint32_t now = aggregates_uptime();
+    xSemaphoreTake(aggmutex, portMAX_DELAY);
+    for (int i = 0; i < AGG_NUMWINDOWS; i++) {
+      struct aggwindow * w = &aggwindows[i];
+      struct aggresult * r = &res[i];
+      aggregates_advance(w, now);
+      memset(r, 0, sizeof(struct aggresult));
+      r->name = w->name;
+      r->length = w->length;
+      r->count = w->count;
+      for (int v = 0; v < AGG_NUMVALS; v++) {
+        if (w->count > 0) {
+          r->min[v] = w->b[aggdq_front(&w->mindq[v]) % AGGBUCKETS].min[v];
+          r->max[v] = w->b[aggdq_front(&w->maxdq[v]) % AGGBUCKETS].max[v];
+          r->mean[v] = lroundf((float)w->sum[v] / (float)w->count);
+        }
+        r->ewma[v] = lroundf(w->ewma[v]);
+      }
+    }
+    xSemaphoreGive(aggmutex);
+}
+
@@ -0,0 +1,42 @@
+
+/* Rolling aggregates (min/max/mean/EWMA) of the measurements
+ * over several time windows. */
+
+#ifndef _AGGREGATES_H_
+#define _AGGREGATES_H_
+
+#include <stdint.h>
+
+/* The windows are 1 minute, 5 minutes, 1 hour and 24 hours. */
+#define AGG_NUMWINDOWS 4
+/* The values we aggregate, in this order: CO2 in ppm, temperature in
+ * 1/100 degrees, humidity in 1/10 percent (as everywhere else). */
+#define AGG_NUMVALS 3
+#define AGG_CO2  0
+#define AGG_TEMP 1
+#define AGG_HUM  2
+
+struct aggresult {
+  const char * name;  /* e.g. "5m" */
+  uint32_t length;    /* Length of the window in seconds */
+  uint32_t count;     /* Number of measurements in the window */
+  /* The following are only meaningful if count > 0. */
+  int32_t min[AGG_NUMVALS];
+  int32_t max[AGG_NUMVALS];
+  int32_t mean[AGG_NUMVALS];
+  /* Exponentially weighted moving average, with the window length
+   * as time constant. This also includes older measurements. */
+  int32_t ewma[AGG_NUMVALS];
+};
+
+/* Needs to be called before anything else. */
+void aggregates_init(void);
+
+/* Add a measurement to all windows. */
+void aggregates_add(float co2, float temp, float hum);
+
+/* Get the aggregates for all windows, shortest window first. */
+void aggregates_get(struct aggresult res[AGG_NUMWINDOWS]);
+
+#endif /* _AGGREGATES_H_ */
+
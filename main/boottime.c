@@ -0,0 +1,50 @@
+
+/* Timestamps of the interesting points during boot.
+ * Every phase is logged once when it is reached, and can be queried
+ * later, e.g. for /metrics. Times are from esp_timer, i.e.
+ * microseconds since the app started, so they don't include the
+ * bootloader. */
+
+#include "freertos/FreeRTOS.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "boottime.h"
+
+const char * boottime_names[BOOT_NUMPHASES] = {
+  "sensors", "webserver", "wificonnected", "gotip",
+  "timesync", "firstreading", "firstrequest"
+};
+
+static int64_t bootmarks[BOOT_NUMPHASES];
+/* One bit per phase that has been reached */
+static uint32_t bootreached = 0;
+static portMUX_TYPE bootmarkslock = portMUX_INITIALIZER_UNLOCKED;
+
+void boottime_mark(enum bootphase p)
+{
+    /* Cheap check first, this is called for every request. */
+    if (__atomic_load_n(&bootreached, __ATOMIC_RELAXED) & (1U << p)) return;
+    int64_t now = esp_timer_get_time();
+    int isfirst = 0;
+    portENTER_CRITICAL(&bootmarkslock);
+    if (bootmarks[p] == 0) {
+      bootmarks[p] = now;
+      __atomic_or_fetch(&bootreached, (1U << p), __ATOMIC_RELAXED);
+      isfirst = 1;
+    }
+    portEXIT_CRITICAL(&bootmarkslock);
+    if (isfirst) {
+      ESP_LOGI("boottime.c", "Boot phase '%s' reached after %u ms",
+               boottime_names[p], (uint32_t)(now / 1000));
+    }
+}
+
+int64_t boottime_get(enum bootphase p)
+{
+    int64_t res;
+    portENTER_CRITICAL(&bootmarkslock);
+    res = bootmarks[p];
+    portEXIT_CRITICAL(&bootmarkslock);
+    return res;
+}
+
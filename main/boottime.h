@@ -0,0 +1,35 @@
+
+/* Timestamps of the interesting points during boot, so we can
+ * compare how long it takes until the first measurement or the first
+ * answered request between firmware versions. */
+
+#ifndef _BOOTTIME_H_
+#define _BOOTTIME_H_
+
+#include <stdint.h>
+
+enum bootphase {
+  BOOT_SENSORSUP,     /* Sensorbus task started */
+  BOOT_WEBSERVERUP,   /* Webserver listening */
+  BOOT_WIFICONNECTED, /* Associated with the AP */
+  BOOT_GOTIP,         /* Got an IP address */
+  BOOT_TIMESYNC,      /* Clock set by SNTP */
+  BOOT_FIRSTREADING,  /* First valid measurement */
+  BOOT_FIRSTREQUEST,  /* First HTTP request answered */
+  BOOT_NUMPHASES
+};
+
+/* Names of the phases, for logs and /metrics */
+extern const char * boottime_names[BOOT_NUMPHASES];
+
+/* Records that phase p has been reached. Only the first call for
+ * every phase counts, so this can be called from hot paths.
+ * Safe to call from any task. */
+void boottime_mark(enum bootphase p);
+
+/* Microseconds since boot at which phase p was reached, or 0 if it
+ * has not been reached yet. */
+int64_t boottime_get(enum bootphase p);
+
+#endif /* _BOOTTIME_H_ */
+
@@ -0,0 +1,96 @@
+
+/* A minimal CBOR (RFC 8949) encoder, writing straight into a respbuf.
+ * Every item starts with a head: 3 bits major type, 5 bits that are
+ * either the argument itself (< 24) or say how many bytes of argument
+ * follow, big endian. */
+
+#include <string.h>
+#include "cbor.h"
+
+#define CBOR_MT_UINT   0
+#define CBOR_MT_NEGINT 1
+#define CBOR_MT_TEXT   3
+#define CBOR_MT_ARRAY  4
+#define CBOR_MT_MAP    5
+#define CBOR_MT_SIMPLE 7
+
+static void cbor_head(struct respbuf * rb, uint8_t mt, uint64_t v)
+{
+    uint8_t h[9];
+    int len;
+    mt <<= 5;
+    if (v < 24) {
+      h[0] = mt | v;
+      len = 1;
+    } else if (v <= 0xff) {
+      h[0] = mt | 24;
+      len = 2;
+    } else if (v <= 0xffff) {
+      h[0] = mt | 25;
+      len = 3;
+    } else if (v <= 0xffffffffULL) {
+      h[0] = mt | 26;
+      len = 5;
+    } else {
+      h[0] = mt | 27;
+      len = 9;
+    }
+    for (int i = len - 1; i > 0; i--) {
+      h[i] = v & 0xff;
+      v >>= 8;
+    }
+    respbuf_mem(rb, h, len);
+}
+
+void cbor_uint(struct respbuf * rb, uint64_t v)
+{
+    cbor_head(rb, CBOR_MT_UINT, v);
+}
+
+void cbor_int(struct respbuf * rb, int64_t v)
+{
+    if (v >= 0) {
+      cbor_head(rb, CBOR_MT_UINT, v);
+    } else {
+      /* -1 is encoded as 0, -2 as 1, ... */
+      cbor_head(rb, CBOR_MT_NEGINT, (uint64_t)(-(v + 1)));
+    }
+}
+
+void cbor_text(struct respbuf * rb, const char * s)
+{
+    size_t len = strlen(s);
+    cbor_head(rb, CBOR_MT_TEXT, len);
+    respbuf_mem(rb, s, len);
+}
+
+void cbor_array(struct respbuf * rb, uint64_t n)
+{
+    cbor_head(rb, CBOR_MT_ARRAY, n);
+}
+
+void cbor_map(struct respbuf * rb, uint64_t n)
+{
+    cbor_head(rb, CBOR_MT_MAP, n);
+}
+
+void cbor_indefarray(struct respbuf * rb)
+{
+    respbuf_char(rb, (CBOR_MT_ARRAY << 5) | 31);
+}
+
+void cbor_break(struct respbuf * rb)
+{
+    respbuf_char(rb, (CBOR_MT_SIMPLE << 5) | 31);
+}
+
+void cbor_bool(struct respbuf * rb, int b)
+{
+    respbuf_char(rb, (CBOR_MT_SIMPLE << 5) | (b ? 21 : 20));
+}
+
+void cbor_null(struct respbuf * rb)
+{
+    respbuf_char(rb, (CBOR_MT_SIMPLE << 5) | 22);
+}
+
@@ -0,0 +1,28 @@
+
+/* A minimal CBOR (RFC 8949) encoder, writing straight into a respbuf.
+ * It only does what we need: integers, text strings, arrays, maps,
+ * booleans and null. Nothing in here depends on the ESP-IDF. */
+
+#ifndef _CBOR_H_
+#define _CBOR_H_
+
+#include <stdint.h>
+#include "respbuf.h"
+
+void cbor_uint(struct respbuf * rb, uint64_t v);
+void cbor_int(struct respbuf * rb, int64_t v);
+/* A text string. s must be valid UTF-8. */
+void cbor_text(struct respbuf * rb, const char * s);
+/* Start an array / map with n elements (n pairs for a map). The
+ * elements follow as separate calls. */
+void cbor_array(struct respbuf * rb, uint64_t n);
+void cbor_map(struct respbuf * rb, uint64_t n);
+/* Start an array of unknown length, for streaming. Needs to be
+ * terminated with cbor_break. */
+void cbor_indefarray(struct respbuf * rb);
+void cbor_break(struct respbuf * rb);
+void cbor_bool(struct respbuf * rb, int b);
+void cbor_null(struct respbuf * rb);
+
+#endif /* _CBOR_H_ */
+
@@ -0,0 +1,201 @@
+
+/* Pushing measurements to an InfluxDB (or anything else that
+ * understands the InfluxDB line protocol over HTTP).
+ * Measurements are put into a queue, and a separate task sends
+ * everything that is in the queue whenever we have network. During a
+ * WiFi outage the queue just fills up, and once we're connected again
+ * it is sent in large batches. */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_http_client.h>
+#include <esp_crt_bundle.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "exporter.h"
+#include "network.h"
+#include "secrets.h"
+
+/* 1024 measurements are more than 15 hours at one per 55 seconds. */
+#define EXPQUEUESIZE 1024
+/* Maximum number of measurements sent in one POST */
+#define EXPBATCHSIZE 100
+/* Maximum length of one line in line protocol */
+#define EXPMAXLINELEN 96
+
+struct expentry {
+  uint32_t ts;
+  uint16_t co2;  /* ppm */
+  int16_t temp;  /* 1/100 degrees */
+  uint16_t hum;  /* 1/10 percent */
+};
+
+#ifdef FCO2_INFLUXURL
+
+/* Only built in when configured, it is 12 KB of RAM. */
+static struct expentry expqueue[EXPQUEUESIZE];
+static uint32_t expqhead = 0; /* Index of the oldest entry */
+static uint32_t expqlen = 0;
+static struct exporterstats expstats;
+static SemaphoreHandle_t expmutex = NULL;
+static TaskHandle_t exptaskhandle = NULL;
+
+void exporter_add(time_t ts, float co2, float temp, float hum)
+{
+    if (exptaskhandle == NULL) return; /* Exporter is not running */
+    /* Without a proper time, the measurement is useless for InfluxDB. */
+    if (ts < 1600000000) return;
+    xSemaphoreTake(expmutex, portMAX_DELAY);
+    if (expqlen >= EXPQUEUESIZE) {
+      /* Queue full, drop the oldest entry. */
+      expqhead = (expqhead + 1) % EXPQUEUESIZE;
+      expqlen--;
+      expstats.dropped++;
+    }
+    struct expentry * e = &expqueue[(expqhead + expqlen) % EXPQUEUESIZE];
+    e->ts = ts;
+    e->co2 = lroundf(co2);
+    e->temp = lroundf(temp * 100.0);
+    e->hum = lroundf(hum * 10.0);
+    expqlen++;
+    xSemaphoreGive(expmutex);
+    xTaskNotifyGive(exptaskhandle);
+}
+
+void exporter_getstats(struct exporterstats * s)
+{
+    if (expmutex == NULL) {
+      memset(s, 0, sizeof(struct exporterstats));
+      return;
+    }
+    xSemaphoreTake(expmutex, portMAX_DELAY);
+    memcpy(s, &expstats, sizeof(struct exporterstats));
+    s->queuedepth = expqlen;
+    s->queuesize = EXPQUEUESIZE;
+    xSemaphoreGive(expmutex);
+}
+
+static char expsensorid[16];
+/* expstats.dropped at the time we formatted the last batch */
+static uint32_t expbatchdropped;
+
+/* Formats up to EXPBATCHSIZE of the oldest entries in the queue into
+ * buf. They are NOT removed from the queue. Returns the number of
+ * entries formatted. */
+static int exporter_formatbatch(char * buf)
+{
+    char * pfp = buf;
+    int n = 0;
+    xSemaphoreTake(expmutex, portMAX_DELAY);
+    while ((n < expqlen) && (n < EXPBATCHSIZE)) {
+      struct expentry * e = &expqueue[(expqhead + n) % EXPQUEUESIZE];
+      int t = (e->temp < 0) ? -e->temp : e->temp;
+      pfp += sprintf(pfp, "co2,sensor=%s co2=%ui,temp=%s%d.%02d,hum=%u.%u %u\n",
+                     expsensorid, e->co2,
+                     (e->temp < 0) ? "-" : "", t / 100, t % 100,
+                     e->hum / 10, e->hum % 10, e->ts);
+      n++;
+    }
+    expbatchdropped = expstats.dropped;
+    xSemaphoreGive(expmutex);
+    return n;
+}
+
+/* Removes n entries from the head of the queue after they were sent. */
+static void exporter_consume(int n)
+{
+    xSemaphoreTake(expmutex, portMAX_DELAY);
+    expstats.sent += n;
+    expstats.postsok++;
+    /* The queue might have overflowed while we were sending, in which
+     * case some of what we sent has already been dropped. */
+    uint32_t gone = expstats.dropped - expbatchdropped;
+    n = (n > gone) ? (n - gone) : 0;
+    if (n > expqlen) n = expqlen;
+    expqhead = (expqhead + n) % EXPQUEUESIZE;
+    expqlen -= n;
+    xSemaphoreGive(expmutex);
+}
+
+static void exportertask(void * pvParameters)
+{
+    char * batch = malloc(EXPBATCHSIZE * EXPMAXLINELEN);
+    if (batch == NULL) {
+      ESP_LOGE("exporter.c", "Could not allocate batch buffer, exporter not running.");
+      exptaskhandle = NULL;
+      vTaskDelete(NULL);
+      return;
+    }
+    while (1) {
+      /* Wait for new data, but also retry every now and then in case
+       * the last attempt failed for some reason. */
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(60000));
+      xEventGroupWaitBits(network_event_group, NETWORK_CONNECTED_BIT,
+                          pdFALSE, pdTRUE, portMAX_DELAY);
+      esp_http_client_config_t httpccfg = {
+        .url = FCO2_INFLUXURL,
+        .method = HTTP_METHOD_POST,
+        .timeout_ms = 10000,
+        .keep_alive_enable = true,
+        .crt_bundle_attach = esp_crt_bundle_attach
+      };
+      esp_http_client_handle_t hc = esp_http_client_init(&httpccfg);
+      if (hc == NULL) continue;
+      esp_http_client_set_header(hc, "Content-Type", "text/plain; charset=utf-8");
+#ifdef FCO2_INFLUXTOKEN
+      esp_http_client_set_header(hc, "Authorization", "Token " FCO2_INFLUXTOKEN);
+#endif
+      /* Send batches until the queue is empty or something fails.
+       * After an outage, this is the backfill. */
+      int n;
+      while ((n = exporter_formatbatch(batch)) > 0) {
+        esp_http_client_set_post_field(hc, batch, strlen(batch));
+        esp_err_t err = esp_http_client_perform(hc);
+        int status = esp_http_client_get_status_code(hc);
+        if ((err != ESP_OK) || (status < 200) || (status > 299)) {
+          ESP_LOGW("exporter.c", "Pushing %d measurements failed: %s, HTTP status %d",
+                   n, esp_err_to_name(err), status);
+          xSemaphoreTake(expmutex, portMAX_DELAY);
+          expstats.postsfailed++;
+          xSemaphoreGive(expmutex);
+          break;
+        }
+        exporter_consume(n);
+      }
+      esp_http_client_cleanup(hc);
+    }
+}
+
+void exporter_init(void)
+{
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    sprintf(expsensorid, "foxco2-%02x%02x%02x", mac[3], mac[4], mac[5]);
+    expmutex = xSemaphoreCreateMutex();
+    /* If the URL is https, TLS needs quite a bit of stack. */
+    xTaskCreate(exportertask, "exporter", 8192, NULL, 3, &exptaskhandle);
+}
+
+#else /* FCO2_INFLUXURL */
+
+void exporter_init(void)
+{
+    /* Nothing configured, nothing to do. */
+}
+
+void exporter_add(time_t ts, float co2, float temp, float hum)
+{
+}
+
+void exporter_getstats(struct exporterstats * s)
+{
+    memset(s, 0, sizeof(struct exporterstats));
+}
+
+#endif /* FCO2_INFLUXURL */
+
@@ -0,0 +1,32 @@
+
+/* Pushing measurements to an InfluxDB (or anything else that
+ * understands the InfluxDB line protocol over HTTP). */
+
+#ifndef _EXPORTER_H_
+#define _EXPORTER_H_
+
+#include <stdint.h>
+#include <time.h>
+
+struct exporterstats {
+  uint32_t queuedepth; /* Measurements waiting to be sent */
+  uint32_t queuesize;  /* Maximum number of measurements we can queue */
+  uint32_t sent;       /* Measurements successfully sent */
+  uint32_t dropped;    /* Measurements dropped because the queue was full */
+  uint32_t postsok;    /* Successful HTTP POSTs */
+  uint32_t postsfailed; /* Failed HTTP POSTs */
+};
+
+/* Starts the exporter task - but only if an URL to push to
+ * has been configured in secrets.h (FCO2_INFLUXURL). */
+void exporter_init(void);
+
+/* Queue a measurement for sending. If the queue is full (because we
+ * could not send for a long time), the oldest measurement is dropped. */
+void exporter_add(time_t ts, float co2, float temp, float hum);
+
+/* Get a copy of the statistics. */
+void exporter_getstats(struct exporterstats * s);
+
+#endif /* _EXPORTER_H_ */
+
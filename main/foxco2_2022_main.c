@@ -2,6 +2,7 @@
  */
 #include "sdkconfig.h"
 #include <stdio.h>
+#include <string.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <esp_system.h>
@@ -13,14 +14,34 @@
 #include <esp_sntp.h>
 #include <nvs_flash.h>
 #include <esp_ota_ops.h>
+#include "aggregates.h"
+#include "boottime.h"
+#include "exporter.h"
+#include "fwupdate.h"
+#include "history.h"
+#include "mcast.h"
+#include "measlog.h"
 #include "network.h"
+#include "perf.h"
+#include "pipeline.h"
+#include "sampling.h"
 #include "scd30.h"
+#include "sensorbus.h"
+#include "snapshot.h"
 #include "webserver.h"
 
-float lastco2 = -999;
-float lasttemp = -999.99;
-float lasthum = -999.9;
-time_t lastvaluets = 0;
+/* The GPIO the RDY pin of the SCD30 is connected to. If it isn't
+ * connected (-1), we ask the sensor via I2C whether it has new data. */
+#define SCD30RDYGPIO -1
+
+/* How many seconds we expect between new values.
+ * This is also the measurement interval we configure on the SCD30.
+ * It is adjusted to how fast the CO2 concentration changes, see
+ * sampling.c. */
+uint16_t valueinterval = 55;
+
+/* Our id for the SCD30 on the sensorbus */
+static int scd30busid = -1;
 
 void i2cport_init(void)
 {
@@ -51,6 +72,134 @@ void i2cport_init(void)
     i2c_set_timeout(0, I2C_TIME_OUT_REG_V);
 }
 
+#if (SCD30RDYGPIO >= 0)
+static void IRAM_ATTR scd30rdy_isr(void * arg)
+{
+    sensorbus_kickfromisr(scd30busid);
+}
+#endif
+
+/* Called by the SCD30 driver (in the sensorbus task) with every
+ * measurement it read. This only does what has to happen right away,
+ * everything else is done by the consumers below, in their own tasks. */
+static void scd30result(const struct scd30data * d)
+{
+    struct sample s;
+    memset(&s, 0, sizeof(s));
+    s.ts = time(NULL);
+    s.valid = d->valid;
+    s.co2raw = d->co2raw;
+    s.tempraw = d->tempraw;
+    s.humraw = d->humraw;
+    s.co2 = d->co2;
+    s.temp = d->temp;
+    s.hum = d->hum;
+    if (d->valid) {
+      boottime_mark(BOOT_FIRSTREADING);
+      uint16_t newinterval = sampling_add(d->co2);
+      if (newinterval != valueinterval) {
+        valueinterval = newinterval;
+        scd30_setinterval(newinterval);
+      }
+    }
+    s.interval = valueinterval;
+    pipeline_publish(&s);
+}
+
+/* The consumers of the measurements. */
+
+/* Logging to the serial console. Printing floats is slow, and so is
+ * the console, so this has the lowest priority, and if it cannot keep
+ * up, only the newest values are logged. */
+static void consume_log(const struct sample * s)
+{
+    ESP_LOGI("main.c", "Read values: valid = %d; CO2 raw 0x%x = %.0f ppm; temp raw 0x%x = %.2f deg; hum raw = 0x%x = %.2f%%",
+                       s->valid, s->co2raw, s->co2, s->tempraw, s->temp, s->humraw, s->hum);
+    fflush(stdout);
+}
+
+/* Everything the webserver shows. For the current values only the
+ * newest one matters. */
+static void consume_live(const struct sample * s)
+{
+    if (!s->valid) return;
+    snapshot_publish(s->ts, s->co2, s->temp, s->hum);
+    aggregates_add(s->co2, s->temp, s->hum);
+    history_add(s->ts, s->co2, s->temp, s->hum);
+    webserver_newdata();
+}
+
+/* The persistent log in flash. Erasing a sector can take a while. */
+static void consume_store(const struct sample * s)
+{
+    if (!s->valid) return;
+    measlog_add(s->ts, s->co2, s->temp, s->hum);
+}
+
+/* Pushing to the outside world. Both have their own queue or are
+ * fire-and-forget, so this is quick unless the network stack blocks. */
+static void consume_export(const struct sample * s)
+{
+    if (!s->valid) return;
+    exporter_add(s->ts, s->co2, s->temp, s->hum);
+    mcast_send(s->seq, s->ts, s->co2, s->temp, s->hum, s->interval);
+}
+
+static void pipeline_setup(void)
+{
+    /* name, function, queue length, policy, priority, stack size.
+     * pipe_log formats floats through printf, which needs a lot more
+     * stack than anything else here. */
+    pipeline_subscribe("pipe_live", consume_live, 2, PIPELINE_DROPOLDEST, 6, 3072);
+    pipeline_subscribe("pipe_store", consume_store, 16, PIPELINE_DROPNEWEST, 4, 3072);
+    pipeline_subscribe("pipe_export", consume_export, 8, PIPELINE_DROPOLDEST, 3, 3072);
+    pipeline_subscribe("pipe_log", consume_log, 4, PIPELINE_DROPOLDEST, 1, 4096);
+}
+
+/* Registers all sensors with the sensorbus and starts it. */
+static void sensors_start(void)
+{
+    scd30busid = sensorbus_add(scd30_driver(scd30result, (SCD30RDYGPIO >= 0)));
+#if (SCD30RDYGPIO >= 0)
+    gpio_config_t rdyconf = {
+      .pin_bit_mask = (1ULL << SCD30RDYGPIO),
+      .mode = GPIO_MODE_INPUT,
+      .pull_up_en = GPIO_PULLUP_DISABLE,
+      .pull_down_en = GPIO_PULLDOWN_ENABLE,
+      .intr_type = GPIO_INTR_POSEDGE,
+    };
+    gpio_config(&rdyconf);
+    gpio_install_isr_service(0);
+    gpio_isr_handler_add(SCD30RDYGPIO, scd30rdy_isr, NULL);
+#endif
+    /* Other sensors on the same bus would be added here. A pressure
+     * sensor would call scd30_setpressure() with what it measured. */
+    sensorbus_start();
+    boottime_mark(BOOT_SENSORSUP);
+}
+
+static void timesync_cb(struct timeval * tv)
+{
+    boottime_mark(BOOT_TIMESYNC);
+}
+
+/* In case we were OTA-updating, we mark this image as good once we
+ * managed to connect to the network with it. */
+static void ota_markvalid(void)
+{
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t ota_state;
+    if (esp_ota_get_state_partition(running, &ota_state) == ESP_OK) {
+      if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
+        if (esp_ota_mark_app_valid_cancel_rollback() == ESP_OK) {
+          ESP_LOGI("main.c", "OTA-Update: App marked as good.");
+        } else {
+          ESP_LOGE("main.c", "OTA-Update: Failed to cancel rollback");
+        }
+      }
+    }
+}
+
 void app_main(void)
 {
     /* This is in all OTA-Update examples, so I consider it mandatory. */
@@ -61,56 +210,41 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(err);
 
+    perf_start();
+    history_init();
+    aggregates_init();
+    measlog_init();
     i2cport_init();
-    scd30_init(55);
+    valueinterval = sampling_levels[SAMPLING_STARTLEVEL];
+    scd30_init(valueinterval);
+    /* The sensor does not need the network, so start reading it right
+     * away, while WiFi is still connecting. */
+    pipeline_setup();
+    sensors_start();
     network_prepare();
     network_on(); /* We just stay connected */
-    /* Wait for up to 7 seconds to connect to WiFi and get an IP */
+    /* None of these need the network to be up already, they all just
+     * start working once it is. */
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_setservername(0, "ntp2.fau.de");
+    sntp_setservername(1, "ntp3.fau.de");
+    sntp_set_time_sync_notification_cb(timesync_cb);
+    sntp_init();
+    webserver_start();
+    exporter_init();
+    mcast_init();
+    fwupdate_init();
+    /* Everything is running now, so waiting here does not hold up
+     * anything. Wait for up to 7 seconds to connect to WiFi and get
+     * an IP. */
     EventBits_t eb = xEventGroupWaitBits(network_event_group,
                                          NETWORK_CONNECTED_BIT,
                                          pdFALSE, pdFALSE,
                                          (7000 / portTICK_PERIOD_MS));
     if ((eb & NETWORK_CONNECTED_BIT) == NETWORK_CONNECTED_BIT) {
       ESP_LOGI("main.c", "Successfully connected to network.");
-      /* In case we were OTA-updating, we mark this image as good now. */
-      const esp_partition_t *running = esp_ota_get_running_partition();
-      esp_ota_img_states_t ota_state;
-      if (esp_ota_get_state_partition(running, &ota_state) == ESP_OK) {
-        if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
-          if (esp_ota_mark_app_valid_cancel_rollback() == ESP_OK) {
-            ESP_LOGI("main.c", "OTA-Update: App marked as good.");
-          } else {
-            ESP_LOGE("main.c", "OTA-Update: Failed to cancel rollback");
-          }
-        }
-      }
+      ota_markvalid();
     } else {
       ESP_LOGW("main.c", "Warning: Could not connect to WiFi. This is probably not good.");
     }
-    sntp_setoperatingmode(SNTP_OPMODE_POLL);
-    sntp_setservername(0, "ntp2.fau.de");
-    sntp_setservername(1, "ntp3.fau.de");
-    sntp_init();
-    webserver_start();
-    time_t lastread = time(NULL);
-    while (1) {
-      time_t curts = time(NULL);
-      if (((curts - lastread) >= 60) || (lastread > curts)) {
-        lastread = curts;
-        ESP_LOGI("main.c", "Reading CO2 sensor...");
-        struct scd30data d;
-        scd30_read(&d);
-        ESP_LOGI("main.c", "Read values: valid = %d; CO2 raw 0x%x = %.0f ppm; temp raw 0x%x = %.2f deg; hum raw = 0x%x = %.2f%%",
-                           d.valid, d.co2raw, d.co2, d.tempraw, d.temp, d.humraw, d.hum);
-        fflush(stdout);
-        if (d.valid) { /* Update our global variables, so the webserver can export them */
-          lastco2 = d.co2;
-          lasttemp = d.temp;
-          lasthum = d.hum;
-          lastvaluets = time(NULL);
-        }
-      }
-      vTaskDelay(20 * (1000 / portTICK_PERIOD_MS));
-    }
 }
-
@@ -0,0 +1,391 @@
+
+/* Firmware updates (OTA) in the background.
+ * The update used to run right inside the webservers request handler,
+ * which blocked the webserver for as long as the download took. Now
+ * the handler just starts a task that does the download in small
+ * steps, so we can report progress, and everything else keeps running
+ * normally until we reboot into the new firmware.
+ * Some of our sensors sit at the edge of WiFi coverage, where a
+ * download of the whole image in one go often never succeeds. So we
+ * write the image straight into the OTA partition ourselves, remember
+ * in NVS how far we got, and after a failed connection (or even a
+ * reboot) continue from there with a HTTP Range request. Once the
+ * image is complete, we calculate its SHA256 (and compare it to the
+ * expected one, if we were given one), and then leave verifying the
+ * image itself to esp_ota_set_boot_partition. */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_partition.h>
+#include <esp_ota_ops.h>
+#include <esp_http_client.h>
+#include <esp_crt_bundle.h>
+#include <mbedtls/sha256.h>
+#include <nvs.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "fwupdate.h"
+#include "measlog.h"
+#include "network.h"
+
+#define FWUPMAXURLLEN 600
+#define FWUPBUFSIZE 4096
+/* We save our progress to NVS every this many bytes. This needs to be
+ * a multiple of the flash sector size. */
+#define FWUPSAVEEVERY (64 * 1024)
+/* Give up after this many attempts in a row that made no progress. */
+#define FWUPMAXFAILS 20
+#define FWUPNVSNS "fwupdate"
+
+static char fwupurl[FWUPMAXURLLEN];
+static uint8_t fwupexpsha[32];
+static int fwuphaveexpsha = 0;
+static const esp_partition_t * fwuppart = NULL;
+static uint32_t fwupoffset; /* How much of the image is in flash */
+static uint32_t fwupsize;   /* Total size of the image, 0 = not known yet */
+static struct fwupstatus fwupst = { .state = FWUP_IDLE, .imagesize = -1 };
+static int64_t fwupstarttime;
+static uint32_t fwupstartoffset; /* fwupoffset at fwupstarttime */
+static portMUX_TYPE fwupmux = portMUX_INITIALIZER_UNLOCKED;
+/* Start of the range the server claims to send, from Content-Range */
+static long fwuprangestart;
+
+static void fwupdate_setprogress(int state)
+{
+    uint32_t elapsedms = (esp_timer_get_time() - fwupstarttime) / 1000;
+    portENTER_CRITICAL(&fwupmux);
+    fwupst.state = state;
+    fwupst.written = fwupoffset;
+    fwupst.imagesize = (fwupsize > 0) ? (int32_t)fwupsize : -1;
+    fwupst.elapsedms = elapsedms;
+    /* Only count what we downloaded since we (re)started the task,
+     * not what was already there from before a reboot. */
+    fwupst.bytespersec = (elapsedms > 0)
+                       ? (uint32_t)(((uint64_t)(fwupoffset - fwupstartoffset) * 1000) / elapsedms)
+                       : 0;
+    portEXIT_CRITICAL(&fwupmux);
+}
+
+/* Saves how far we got to NVS, so we can continue after a reboot.
+ * With offset == 0xffffffff, the saved state is deleted instead. */
+static void fwupdate_savestate(uint32_t offset)
+{
+    nvs_handle_t nvh;
+    if (nvs_open(FWUPNVSNS, NVS_READWRITE, &nvh) != ESP_OK) {
+      ESP_LOGE("fwupdate.c", "Could not open NVS to save update state.");
+      return;
+    }
+    if (offset == 0xffffffff) {
+      nvs_erase_key(nvh, "url");
+    } else {
+      nvs_set_str(nvh, "url", fwupurl);
+      nvs_set_u32(nvh, "part", fwuppart->address);
+      nvs_set_u32(nvh, "offset", offset);
+      nvs_set_u32(nvh, "size", fwupsize);
+      if (fwuphaveexpsha) {
+        nvs_set_blob(nvh, "sha", fwupexpsha, sizeof(fwupexpsha));
+      } else {
+        nvs_erase_key(nvh, "sha");
+      }
+    }
+    nvs_commit(nvh);
+    nvs_close(nvh);
+}
+
+/* Restores the state of an unfinished update from NVS.
+ * Returns 1 if there is one. */
+static int fwupdate_loadstate(void)
+{
+    nvs_handle_t nvh;
+    uint32_t partaddr;
+    size_t len;
+    if (nvs_open(FWUPNVSNS, NVS_READONLY, &nvh) != ESP_OK) return 0;
+    len = sizeof(fwupurl);
+    int ok = (nvs_get_str(nvh, "url", fwupurl, &len) == ESP_OK)
+          && (nvs_get_u32(nvh, "part", &partaddr) == ESP_OK)
+          && (nvs_get_u32(nvh, "offset", &fwupoffset) == ESP_OK)
+          && (nvs_get_u32(nvh, "size", &fwupsize) == ESP_OK);
+    len = sizeof(fwupexpsha);
+    fwuphaveexpsha = (nvs_get_blob(nvh, "sha", fwupexpsha, &len) == ESP_OK);
+    nvs_close(nvh);
+    if (!ok) return 0;
+    /* If we booted from a different partition since then, the one we
+     * were writing to might now be the one we're running from. */
+    fwuppart = esp_ota_get_next_update_partition(NULL);
+    if ((fwuppart == NULL) || (fwuppart->address != partaddr)) {
+      ESP_LOGW("fwupdate.c", "Update partition changed, not resuming the update.");
+      fwupdate_savestate(0xffffffff);
+      return 0;
+    }
+    return 1;
+}
+
+static esp_err_t fwupdate_httpevent(esp_http_client_event_t * evt)
+{
+    if ((evt->event_id == HTTP_EVENT_ON_HEADER)
+     && (strcasecmp(evt->header_key, "Content-Range") == 0)) {
+      /* Looks like "bytes 12345-67889/67890" */
+      const char * p = strchr(evt->header_value, ' ');
+      if (p != NULL) {
+        fwuprangestart = strtol(p + 1, NULL, 10);
+      }
+    }
+    return ESP_OK;
+}
+
+/* Does one attempt at downloading the rest of the image, starting at
+ * fwupoffset. Returns ESP_OK once the whole image is in flash. */
+static esp_err_t fwupdate_download(char * buf)
+{
+    esp_http_client_config_t httpccfg = {
+      .url = fwupurl,
+      .timeout_ms = 20000,
+      .keep_alive_enable = true,
+      .event_handler = fwupdate_httpevent,
+      .crt_bundle_attach = esp_crt_bundle_attach
+    };
+    esp_http_client_handle_t hc = esp_http_client_init(&httpccfg);
+    if (hc == NULL) return ESP_FAIL;
+    /* Start again at the beginning of the flash sector we were in.
+     * That sector then simply gets erased and written again. */
+    fwupoffset -= (fwupoffset % SPI_FLASH_SEC_SIZE);
+    if (fwupoffset > 0) {
+      char rh[32];
+      sprintf(rh, "bytes=%u-", fwupoffset);
+      esp_http_client_set_header(hc, "Range", rh);
+    }
+    fwuprangestart = -1;
+    esp_err_t err = esp_http_client_open(hc, 0);
+    if (err != ESP_OK) {
+      ESP_LOGW("fwupdate.c", "Could not connect: %s", esp_err_to_name(err));
+      esp_http_client_cleanup(hc);
+      return err;
+    }
+    int contlen = esp_http_client_fetch_headers(hc);
+    int status = esp_http_client_get_status_code(hc);
+    err = ESP_FAIL;
+    if ((status == 206) && (fwuprangestart == (long)fwupoffset) && (contlen > 0)) {
+      ESP_LOGI("fwupdate.c", "Resuming download at byte %u", fwupoffset);
+      if ((fwupsize > 0) && (fwupsize != (fwupoffset + contlen))) {
+        ESP_LOGE("fwupdate.c", "Image size changed on the server, starting over.");
+        fwupoffset = 0;
+        fwupsize = 0;
+        goto out;
+      }
+      fwupsize = fwupoffset + contlen;
+    } else if ((status == 200) && (contlen > 0)) {
+      /* Either a fresh start, or the server does not support ranges. */
+      if (fwupoffset > 0) {
+        ESP_LOGW("fwupdate.c", "Server ignored our Range request, starting over.");
+      }
+      fwupoffset = 0;
+      fwupsize = contlen;
+    } else {
+      ESP_LOGE("fwupdate.c", "Unexpected reply from server: HTTP status %d, length %d",
+               status, contlen);
+      goto out;
+    }
+    if (fwupsize > fwuppart->size) {
+      ESP_LOGE("fwupdate.c", "Image (%u bytes) is larger than the OTA partition.", fwupsize);
+      fwupsize = 0;
+      err = ESP_ERR_INVALID_SIZE;
+      goto out;
+    }
+    while (fwupoffset < fwupsize) {
+      int toread = fwupsize - fwupoffset;
+      /* Never read across a sector boundary, so that we can erase
+       * each sector right before we write to it. */
+      int secleft = SPI_FLASH_SEC_SIZE - (fwupoffset % SPI_FLASH_SEC_SIZE);
+      if (toread > secleft) toread = secleft;
+      if (toread > FWUPBUFSIZE) toread = FWUPBUFSIZE;
+      int rl = esp_http_client_read(hc, buf, toread);
+      if (rl <= 0) {
+        ESP_LOGW("fwupdate.c", "Download interrupted at byte %u of %u", fwupoffset, fwupsize);
+        goto out;
+      }
+      if ((fwupoffset % SPI_FLASH_SEC_SIZE) == 0) {
+        if (esp_partition_erase_range(fwuppart, fwupoffset, SPI_FLASH_SEC_SIZE) != ESP_OK) {
+          ESP_LOGE("fwupdate.c", "Erasing flash at %u failed.", fwupoffset);
+          goto out;
+        }
+      }
+      if (esp_partition_write(fwuppart, fwupoffset, buf, rl) != ESP_OK) {
+        ESP_LOGE("fwupdate.c", "Writing flash at %u failed.", fwupoffset);
+        goto out;
+      }
+      fwupoffset += rl;
+      if ((fwupoffset % FWUPSAVEEVERY) == 0) {
+        fwupdate_savestate(fwupoffset);
+      }
+      fwupdate_setprogress(FWUP_RUNNING);
+    }
+    err = ESP_OK;
+out:
+    esp_http_client_close(hc);
+    esp_http_client_cleanup(hc);
+    return err;
+}
+
+/* Calculates the SHA256 over the downloaded image, reading it back
+ * from flash. We cannot do this while downloading, because with
+ * resuming we might see parts of the image twice, or not at all. */
+static int fwupdate_checksha(char * buf)
+{
+    mbedtls_sha256_context shactx;
+    uint8_t sha[32];
+    char shahex[65];
+    mbedtls_sha256_init(&shactx);
+    mbedtls_sha256_starts_ret(&shactx, 0);
+    for (uint32_t o = 0; o < fwupsize; o += FWUPBUFSIZE) {
+      uint32_t l = ((fwupsize - o) > FWUPBUFSIZE) ? FWUPBUFSIZE : (fwupsize - o);
+      if (esp_partition_read(fwuppart, o, buf, l) != ESP_OK) {
+        mbedtls_sha256_free(&shactx);
+        return 0;
+      }
+      mbedtls_sha256_update_ret(&shactx, (const unsigned char *)buf, l);
+    }
+    mbedtls_sha256_finish_ret(&shactx, sha);
+    mbedtls_sha256_free(&shactx);
+    for (int i = 0; i < 32; i++) {
+      sprintf(&shahex[i * 2], "%02x", sha[i]);
+    }
+    ESP_LOGI("fwupdate.c", "SHA256 of downloaded image: %s", shahex);
+    if (fwuphaveexpsha && (memcmp(sha, fwupexpsha, sizeof(sha)) != 0)) {
+      ESP_LOGE("fwupdate.c", "That is NOT the expected SHA256.");
+      return 0;
+    }
+    return 1;
+}
+
+static void fwupdatetask(void * pvParameters)
+{
+    char * buf = malloc(FWUPBUFSIZE);
+    int fails = 0;
+    esp_err_t err = ESP_FAIL;
+    ESP_LOGI("fwupdate.c", "Updating firmware from %s into partition %s",
+             fwupurl, fwuppart->label);
+    while ((buf != NULL) && (fails < FWUPMAXFAILS)) {
+      xEventGroupWaitBits(network_event_group, NETWORK_CONNECTED_BIT,
+                          pdFALSE, pdTRUE, portMAX_DELAY);
+      uint32_t before = fwupoffset;
+      err = fwupdate_download(buf);
+      fwupdate_savestate(fwupoffset);
+      if ((err == ESP_OK) || (err == ESP_ERR_INVALID_SIZE)) break;
+      if (fwupoffset > before) {
+        fails = 0;
+      } else {
+        fails++;
+      }
+      /* Wait a bit longer after every failure in a row. */
+      vTaskDelay(pdMS_TO_TICKS(2000 * ((fails < 15) ? (fails + 1) : 15)));
+    }
+    if (err == ESP_OK) {
+      if (!fwupdate_checksha(buf)) {
+        err = ESP_ERR_INVALID_CRC;
+      } else {
+        /* This also verifies the image. */
+        err = esp_ota_set_boot_partition(fwuppart);
+      }
+    }
+    free(buf);
+    if (err != ESP_OK) {
+      ESP_LOGE("fwupdate.c", "Firmware update failed: %s", esp_err_to_name(err));
+      /* A broken image is not worth resuming. After just running out
+       * of attempts, we keep the state, the next reboot will resume. */
+      if (err != ESP_FAIL) fwupdate_savestate(0xffffffff);
+      fwupdate_setprogress(FWUP_FAILED);
+      vTaskDelete(NULL);
+      return;
+    }
+    fwupdate_savestate(0xffffffff);
+    fwupdate_setprogress(FWUP_DONE);
+    ESP_LOGI("fwupdate.c", "Firmware update successful, rebooting...");
+    measlog_flush();
+    /* Give whoever is watching the status a chance to see that. */
+    vTaskDelay(pdMS_TO_TICKS(3000));
+    esp_restart();
+}
+
+/* Marks the update as running and starts the task doing it. */
+static void fwupdate_starttask(void)
+{
+    fwupstarttime = esp_timer_get_time();
+    fwupstartoffset = fwupoffset;
+    fwupdate_setprogress(FWUP_RUNNING);
+    /* TLS needs a lot of stack. The priority is lower than everything
+     * else that matters, so the download only gets what's left over. */
+    if (xTaskCreate(fwupdatetask, "fwupdate", 8192, NULL, 2, NULL) != pdPASS) {
+      ESP_LOGE("fwupdate.c", "Could not create firmware update task.");
+      fwupdate_setprogress(FWUP_FAILED);
+    }
+}
+
+/* Parses 64 hex digits into the 32 bytes of a SHA256.
+ * Returns 0 on success, -1 if that is not what we got. */
+static int fwupdate_parsesha(const char * hex, uint8_t * sha)
+{
+    if (strlen(hex) != 64) return -1;
+    for (int i = 0; i < 64; i++) {
+      if (!isxdigit((unsigned char)hex[i])) return -1;
+    }
+    for (int i = 0; i < 32; i++) {
+      char hb[3] = { hex[i * 2], hex[i * 2 + 1], 0 };
+      sha[i] = strtol(hb, NULL, 16);
+    }
+    return 0;
+}
+
+int fwupdate_start(const char * url, const char * sha256hex)
+{
+    uint8_t expsha[32];
+    if ((sha256hex != NULL) && (fwupdate_parsesha(sha256hex, expsha) != 0)) {
+      return -2;
+    }
+    portENTER_CRITICAL(&fwupmux);
+    if ((fwupst.state == FWUP_RUNNING) || (fwupst.state == FWUP_DONE)) {
+      portEXIT_CRITICAL(&fwupmux);
+      return -1;
+    }
+    fwupst.state = FWUP_RUNNING;
+    portEXIT_CRITICAL(&fwupmux);
+    fwuppart = esp_ota_get_next_update_partition(NULL);
+    if (fwuppart == NULL) {
+      ESP_LOGE("fwupdate.c", "No OTA partition to update into.");
+      fwupdate_setprogress(FWUP_FAILED);
+      return 0;
+    }
+    strncpy(fwupurl, url, sizeof(fwupurl) - 1);
+    fwupurl[sizeof(fwupurl) - 1] = 0;
+    fwuphaveexpsha = (sha256hex != NULL);
+    if (fwuphaveexpsha) memcpy(fwupexpsha, expsha, sizeof(fwupexpsha));
+    fwupoffset = 0;
+    fwupsize = 0;
+    fwupdate_savestate(0);
+    fwupdate_starttask();
+    return 0;
+}
+
+void fwupdate_init(void)
+{
+    if (!fwupdate_loadstate()) return;
+    ESP_LOGI("fwupdate.c", "Resuming unfinished firmware update at byte %u of %u",
+             fwupoffset, fwupsize);
+    fwupdate_starttask();
+}
+
+void fwupdate_getstatus(struct fwupstatus * s)
+{
+    portENTER_CRITICAL(&fwupmux);
+    memcpy(s, &fwupst, sizeof(struct fwupstatus));
+    portEXIT_CRITICAL(&fwupmux);
+    if (s->state == FWUP_RUNNING) {
+      s->elapsedms = (esp_timer_get_time() - fwupstarttime) / 1000;
+    }
+}
+
@@ -0,0 +1,39 @@
+
+/* Firmware updates (OTA) in the background. */
+
+#ifndef _FWUPDATE_H_
+#define _FWUPDATE_H_
+
+#include <stdint.h>
+
+#define FWUP_IDLE     0 /* No update was started since boot */
+#define FWUP_RUNNING  1
+#define FWUP_DONE     2 /* Update successful, reboot is imminent */
+#define FWUP_FAILED   3
+
+struct fwupstatus {
+  int state;          /* One of the FWUP_* values above */
+  uint32_t written;   /* Bytes of the image written to flash so far,
+                       * including those from before a reboot */
+  int32_t imagesize;  /* Total size of the image, -1 if not known yet */
+  uint32_t elapsedms; /* How long the update has been running */
+  uint32_t bytespersec; /* Average download speed since (re)start */
+};
+
+/* Resumes an update that was interrupted by a reboot, if there is
+ * one. Call once at startup, after NVS has been initialized. */
+void fwupdate_init(void);
+
+/* Starts a firmware update from url in a separate task. If sha256hex
+ * is not NULL, it is the expected SHA256 of the image as 64 hex
+ * digits, and the update is only installed if that matches.
+ * Returns 0 if the update was started, -1 if one is already running,
+ * -2 if sha256hex is not 64 hex digits (nothing is started then).
+ * When the update succeeds, the ESP reboots into the new firmware. */
+int fwupdate_start(const char * url, const char * sha256hex);
+
+/* Get the state and progress of the current (or last) update. */
+void fwupdate_getstatus(struct fwupstatus * s);
+
+#endif /* _FWUPDATE_H_ */
+
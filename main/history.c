@@ -0,0 +1,170 @@
+
+/* Compact in-RAM history of measurements.
+ * The history is a ring of fixed-size blocks. Inside a block, every
+ * entry is stored as the difference to the previous entry, encoded as
+ * (zigzag-)varints. For the first entry in a block the "previous entry"
+ * is all zeroes, so every block can be decoded on its own, and dropping
+ * the oldest block when we run out of space is trivial.
+ * With one measurement per minute an entry usually needs 4-5 bytes,
+ * so the default 16 x 512 bytes hold more than 24 hours. */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <string.h>
+#include <math.h>
+#include "history.h"
+
+#define HISTBLOCKS 16
+#define HISTBLOCKSIZE 512
+/* Maximum length of one encoded entry: 4 varints of at most 5 bytes. */
+#define HISTMAXENTLEN 20
+
+struct histblock {
+  uint32_t ser;  /* Serial number of this block. 0 = unused */
+  uint16_t used; /* Number of bytes used in data */
+  time_t lastts; /* Timestamp of the last entry in the block */
+  uint8_t data[HISTBLOCKSIZE];
+};
+
+static struct histblock histblocks[HISTBLOCKS];
+static uint32_t histnextser = 1;
+static struct histentry histlastadded;
+static SemaphoreHandle_t histmutex = NULL;
+
+static struct histblock * history_blockbyser(uint32_t ser)
+{
+    return &histblocks[(ser - 1) % HISTBLOCKS];
+}
+
+static uint32_t history_oldestser(void)
+{
+    if (histnextser <= (HISTBLOCKS + 1)) return 1;
+    return histnextser - HISTBLOCKS;
+}
+
+static uint8_t * putvarint(uint8_t * p, uint32_t v)
+{
+    while (v >= 0x80) {
+      *p++ = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static const uint8_t * getvarint(const uint8_t * p, uint32_t * v)
+{
+    uint32_t res = 0;
+    int shift = 0;
+    do {
+      res |= (uint32_t)(*p & 0x7f) << shift;
+      shift += 7;
+    } while ((*p++ & 0x80) && (shift < 35));
+    *v = res;
+    return p;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+void history_init(void)
+{
+    memset(histblocks, 0, sizeof(histblocks));
+    memset(&histlastadded, 0, sizeof(histlastadded));
+    histnextser = 1;
+    histmutex = xSemaphoreCreateMutex();
+}
+
+void history_add(time_t ts, float co2, float temp, float hum)
+{
+    struct histentry e;
+    /* Don't bother storing anything while our clock has not been set
+     * by NTP yet, the timestamps would be garbage. */
+    if (ts < 1600000000) return;
+    e.ts = ts;
+    e.co2 = lroundf(co2);
+    e.temp = lroundf(temp * 100.0);
+    e.hum = lroundf(hum * 10.0);
+    xSemaphoreTake(histmutex, portMAX_DELAY);
+    struct histblock * b = NULL;
+    if (histnextser > 1) {
+      b = history_blockbyser(histnextser - 1);
+    }
+    if ((b == NULL)
+     || ((b->used + HISTMAXENTLEN) > HISTBLOCKSIZE)
+     || (e.ts < histlastadded.ts)) {
+      /* Need to start a new block. This will overwrite the oldest one
+       * if all are in use. */
+      b = history_blockbyser(histnextser);
+      b->ser = histnextser;
+      b->used = 0;
+      histnextser++;
+      memset(&histlastadded, 0, sizeof(histlastadded));
+    }
+    uint8_t * p = &b->data[b->used];
+    p = putvarint(p, (uint32_t)(e.ts - histlastadded.ts));
+    p = putvarint(p, zigzag(e.co2 - histlastadded.co2));
+    p = putvarint(p, zigzag(e.temp - histlastadded.temp));
+    p = putvarint(p, zigzag(e.hum - histlastadded.hum));
+    b->used = p - b->data;
+    b->lastts = e.ts;
+    histlastadded = e;
+    xSemaphoreGive(histmutex);
+}
+
+void history_cursorinit(struct histcursor * c, time_t since)
+{
+    memset(c, 0, sizeof(struct histcursor));
+    c->since = since;
+    /* blockser 0 means "start at the oldest block". */
+    c->blockser = 0;
+}
+
+int history_read(struct histcursor * c, struct histentry * out, int maxent)
+{
+    int n = 0;
+    xSemaphoreTake(histmutex, portMAX_DELAY);
+    while (n < maxent) {
+      if (c->blockser >= histnextser) break; /* Nothing there (yet) */
+      if (c->blockser < history_oldestser()) {
+        /* Either a fresh cursor, or that block was overwritten
+         * since the last call. Start at the oldest block. */
+        c->blockser = history_oldestser();
+        c->pos = 0;
+        memset(&c->last, 0, sizeof(c->last));
+      }
+      struct histblock * b = history_blockbyser(c->blockser);
+      int iscurrent = (c->blockser == (histnextser - 1));
+      if ((c->pos >= b->used)
+       || ((c->pos == 0) && (b->lastts <= c->since) && !iscurrent)) {
+        /* We're through with this block, or there is nothing in it
+         * that could interest us. */
+        if (iscurrent) break;
+        c->blockser++;
+        c->pos = 0;
+        memset(&c->last, 0, sizeof(c->last));
+        continue;
+      }
+      const uint8_t * p = &b->data[c->pos];
+      uint32_t v;
+      p = getvarint(p, &v); c->last.ts += v;
+      p = getvarint(p, &v); c->last.co2 += unzigzag(v);
+      p = getvarint(p, &v); c->last.temp += unzigzag(v);
+      p = getvarint(p, &v); c->last.hum += unzigzag(v);
+      c->pos = p - b->data;
+      if (c->last.ts > c->since) {
+        out[n] = c->last;
+        n++;
+      }
+    }
+    xSemaphoreGive(histmutex);
+    return n;
+}
+
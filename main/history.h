@@ -0,0 +1,46 @@
+
+/* Compact in-RAM history of measurements. */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/* One decoded entry from the history.
+ * Values are stored as integers in the precision we display them:
+ * CO2 in ppm, temperature in 1/100 degrees, humidity in 1/10 percent. */
+struct histentry {
+  time_t ts;
+  int32_t co2;
+  int32_t temp;
+  int32_t hum;
+};
+
+/* Keeps track of where a reader is in the history. Initialize
+ * with history_cursorinit and then call history_read repeatedly. */
+struct histcursor {
+  uint32_t blockser; /* Serial number of the block we're in */
+  uint16_t pos;      /* Read position (bytes) inside that block */
+  time_t since;      /* Only return entries newer than this */
+  struct histentry last; /* last decoded entry, needed for delta decoding */
+};
+
+/* Initialize the history. Needs to be called before anything else. */
+void history_init(void);
+
+/* Add a measurement to the history. If the history is full,
+ * the oldest entries will be dropped. */
+void history_add(time_t ts, float co2, float temp, float hum);
+
+/* Prepare a cursor for reading all entries newer than 'since'. */
+void history_cursorinit(struct histcursor * c, time_t since);
+
+/* Reads up to maxent entries into out, advancing the cursor.
+ * Returns the number of entries read, 0 means there is nothing more.
+ * If the writer overtook the reader in between calls, the entries
+ * that were dropped in the meantime are silently skipped. */
+int history_read(struct histcursor * c, struct histentry * out, int maxent);
+
+#endif /* _HISTORY_H_ */
+
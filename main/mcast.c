@@ -0,0 +1,124 @@
+
+/* Sending every measurement as one small UDP datagram to a multicast
+ * group. See mcast.h for the format, and tools/mcastlisten.py for a
+ * receiver. */
+
+#include "freertos/FreeRTOS.h"
+#include <esp_log.h>
+#include <esp_system.h>
+#include <lwip/sockets.h>
+#include <string.h>
+#include <math.h>
+#include "mcast.h"
+#include "network.h"
+#include "secrets.h"
+
+static struct mcaststats mcstats;
+static portMUX_TYPE mcstatslock = portMUX_INITIALIZER_UNLOCKED;
+
+void mcast_getstats(struct mcaststats * s)
+{
+    portENTER_CRITICAL(&mcstatslock);
+    *s = mcstats;
+    portEXIT_CRITICAL(&mcstatslock);
+}
+
+#ifdef FCO2_MCASTGROUP
+
+#ifndef FCO2_MCASTPORT
+#define FCO2_MCASTPORT 5612
+#endif
+#ifndef FCO2_MCASTTTL
+#define FCO2_MCASTTTL 1
+#endif
+
+static int mcsock = -1;
+static struct sockaddr_in mcdest;
+static uint8_t mcmac[6];
+static uint32_t mcbootid;
+
+static uint8_t * put16(uint8_t * p, uint16_t v)
+{
+    *p++ = v >> 8;
+    *p++ = v;
+    return p;
+}
+
+static uint8_t * put32(uint8_t * p, uint32_t v)
+{
+    p = put16(p, v >> 16);
+    return put16(p, v);
+}
+
+void mcast_init(void)
+{
+    memset(&mcdest, 0, sizeof(mcdest));
+    mcdest.sin_family = AF_INET;
+    mcdest.sin_port = htons(FCO2_MCASTPORT);
+    if (inet_aton(FCO2_MCASTGROUP, &mcdest.sin_addr) == 0) {
+      ESP_LOGE("mcast.c", "Invalid multicast group '%s', not sending anything.",
+               FCO2_MCASTGROUP);
+      return;
+    }
+    mcsock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (mcsock < 0) {
+      ESP_LOGE("mcast.c", "Could not create socket, not sending anything.");
+      return;
+    }
+    uint8_t ttl = FCO2_MCASTTTL;
+    setsockopt(mcsock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    esp_read_mac(mcmac, ESP_MAC_WIFI_STA);
+    mcbootid = esp_random();
+    ESP_LOGI("mcast.c", "Sending measurements to %s port %d",
+             FCO2_MCASTGROUP, FCO2_MCASTPORT);
+}
+
+void mcast_send(uint32_t seq, time_t ts, float co2, float temp, float hum,
+                uint16_t interval)
+{
+    uint8_t dg[MCAST_LEN];
+    uint8_t * p = dg;
+    if (mcsock < 0) return;
+    if ((xEventGroupGetBits(network_event_group) & NETWORK_CONNECTED_BIT) == 0) {
+      portENTER_CRITICAL(&mcstatslock);
+      mcstats.skipped++;
+      portEXIT_CRITICAL(&mcstatslock);
+      return;
+    }
+    memcpy(p, MCAST_MAGIC, 4); p += 4;
+    *p++ = MCAST_VERSION;
+    /* Same check as everywhere else for "has NTP set our clock". */
+    *p++ = (ts >= 1600000000) ? 0x01 : 0x00;
+    memcpy(p, mcmac, 6); p += 6;
+    p = put32(p, mcbootid);
+    p = put32(p, seq);
+    p = put32(p, ts);
+    p = put16(p, lroundf(co2));
+    p = put16(p, (int16_t)lroundf(temp * 100.0));
+    p = put16(p, lroundf(hum * 10.0));
+    p = put16(p, interval);
+    int res = sendto(mcsock, dg, sizeof(dg), MSG_DONTWAIT,
+                     (struct sockaddr *)&mcdest, sizeof(mcdest));
+    portENTER_CRITICAL(&mcstatslock);
+    if (res == sizeof(dg)) {
+      mcstats.sent++;
+    } else {
+      mcstats.failed++;
+    }
+    portEXIT_CRITICAL(&mcstatslock);
+}
+
+#else /* FCO2_MCASTGROUP */
+
+void mcast_init(void)
+{
+    /* Nothing configured, nothing to do. */
+}
+
+void mcast_send(uint32_t seq, time_t ts, float co2, float temp, float hum,
+                uint16_t interval)
+{
+}
+
+#endif /* FCO2_MCASTGROUP */
+
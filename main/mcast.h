@@ -0,0 +1,57 @@
+
+/* Sending every measurement as one small UDP datagram to a multicast
+ * group, so a collector can just listen instead of polling every
+ * sensor. Only active if FCO2_MCASTGROUP is set in secrets.h. */
+
+#ifndef _MCAST_H_
+#define _MCAST_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/* The datagram, version 1. All fields are big endian (network byte
+ * order), 32 bytes in total:
+ *  0  4 bytes  magic "FCO2"
+ *  4  uint8    version, 1
+ *  5  uint8    flags: bit 0 = clock was set (ts is valid)
+ *  6  6 bytes  MAC address of the sensor (WiFi station)
+ * 12  uint32   boot id, random, changes with every boot
+ * 16  uint32   sequence number: that of the measurement in the
+ *              pipeline (struct sample), i.e. +1 for every reading
+ *              from the sensor since boot, starting at 1. Readings
+ *              that were not sent - because they failed, were dropped
+ *              inside the sensor when it was busy, or because WiFi was
+ *              down - still use up a number, so gaps show everything
+ *              the collector missed.
+ * 20  uint32   timestamp (unix time)
+ * 24  uint16   CO2 in ppm
+ * 26  int16    temperature in 1/100 degrees celsius
+ * 28  uint16   relative humidity in 1/10 percent
+ * 30  uint16   measurement interval in seconds, i.e. when to expect
+ *              the next datagram
+ * Later versions may append fields, so receivers should accept
+ * longer datagrams and ignore what they do not know. */
+#define MCAST_MAGIC "FCO2"
+#define MCAST_VERSION 1
+#define MCAST_LEN 32
+
+struct mcaststats {
+  uint32_t sent;    /* Datagrams sent */
+  uint32_t skipped; /* Measurements not sent because we had no network */
+  uint32_t failed;  /* sendto() failed */
+};
+
+/* Creates the socket. Call after network_prepare(). Does nothing
+ * unless FCO2_MCASTGROUP is set. */
+void mcast_init(void);
+
+/* Sends one measurement. seq is its sequence number from the
+ * pipeline. Never blocks. */
+void mcast_send(uint32_t seq, time_t ts, float co2, float temp, float hum,
+                uint16_t interval);
+
+/* Get a copy of the statistics. */
+void mcast_getstats(struct mcaststats * s);
+
+#endif /* _MCAST_H_ */
+
@@ -0,0 +1,259 @@
+
+/* Persistent log of measurements in a flash partition.
+ * The partition is used as one big ring of 4 KB sectors. The first
+ * 16 bytes of every sector are a header with a magic and a sequence
+ * number, the rest holds 255 records. We always append to the newest
+ * sector, and when that is full, the oldest sector is erased and
+ * becomes the newest. That way every sector gets erased equally
+ * often, which is all the wear leveling we need: with 960 KB and one
+ * record a minute, every sector is erased about once every 6 weeks.
+ * For every sector we remember the timestamp of its first record in
+ * RAM, so a query for a time range can jump straight to the right
+ * sector. */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <string.h>
+#include <math.h>
+#include "measlog.h"
+
+#define MEASLOG_PARTSUBTYPE 0x40
+#define MEASLOG_MAGIC 0x474c4346 /* "FCLG" */
+#define MEASLOG_SECSIZE 4096
+#define MEASLOG_PAGESIZE 256
+#define MEASLOG_RECSPERPAGE (MEASLOG_PAGESIZE / sizeof(struct measlogrec))
+/* Slot 0 of every sector is taken by the header */
+#define MEASLOG_SLOTSPERSEC (MEASLOG_SECSIZE / sizeof(struct measlogrec))
+#define MEASLOG_MAXSECTORS 256
+
+struct measloghdr {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t reserved[2];
+};
+
+static const esp_partition_t * mlpart = NULL;
+static const uint8_t * mlmap = NULL;
+static spi_flash_mmap_handle_t mlmaphandle;
+static uint32_t mlnumsecs;
+static uint32_t mlcursec;  /* The sector we're currently writing to */
+static uint32_t mlcurseq;  /* ...and its sequence number */
+static uint32_t mlnextslot; /* Next free slot in the current sector */
+/* Timestamp of the first record in each sector. 0 = sector unused */
+static uint32_t mlsecfirstts[MEASLOG_MAXSECTORS];
+/* The flash page we're currently filling, starting at slot mlpagestart.
+ * All slots before mlflushed are in flash, the ones from there to
+ * mlnextslot are only in RAM. */
+static struct measlogrec mlpage[MEASLOG_RECSPERPAGE];
+static uint32_t mlpagestart;
+static uint32_t mlflushed;
+/* The sector measlog_query is currently sending, or -1. The webserver
+ * is single threaded, so there is at most one query at a time. */
+static int32_t mlreadsec = -1;
+static SemaphoreHandle_t mlmutex = NULL;
+
+uint32_t measlog_check(const struct measlogrec * r)
+{
+    return r->ts ^ (((uint32_t)r->co2 << 16) | (uint16_t)r->temp)
+         ^ (((uint32_t)r->hum << 16) | r->reserved) ^ 0xa5a5a5a5;
+}
+
+static const struct measlogrec * measlog_slot(uint32_t sec, uint32_t slot)
+{
+    return (const struct measlogrec *)(mlmap + (sec * MEASLOG_SECSIZE)
+                                       + (slot * sizeof(struct measlogrec)));
+}
+
+/* Writes all records in the current page that are only in RAM. */
+static void measlog_flushpage(void)
+{
+    if (mlflushed >= mlnextslot) return; /* Nothing to do */
+    esp_err_t e = esp_partition_write(mlpart,
+                    (mlcursec * MEASLOG_SECSIZE) + (mlflushed * sizeof(struct measlogrec)),
+                    &mlpage[mlflushed - mlpagestart],
+                    (mlnextslot - mlflushed) * sizeof(struct measlogrec));
+    if (e != ESP_OK) {
+      ESP_LOGE("measlog.c", "Writing to flash failed: %s", esp_err_to_name(e));
+    }
+    mlflushed = mlnextslot;
+}
+
+/* Erases the oldest sector and makes it the current one. */
+static void measlog_newsector(void)
+{
+    uint32_t newsec = (mlcursec + 1) % mlnumsecs;
+    /* If a query is just sending that sector, give it a bit of time
+     * to finish before we pull the rug from under it. */
+    for (int i = 0; (i < 50) && (mlreadsec == (int32_t)newsec); i++) {
+      xSemaphoreGive(mlmutex);
+      vTaskDelay(pdMS_TO_TICKS(100));
+      xSemaphoreTake(mlmutex, portMAX_DELAY);
+    }
+    mlsecfirstts[newsec] = 0;
+    esp_err_t e = esp_partition_erase_range(mlpart, newsec * MEASLOG_SECSIZE, MEASLOG_SECSIZE);
+    if (e != ESP_OK) {
+      ESP_LOGE("measlog.c", "Erasing flash sector %u failed: %s", newsec, esp_err_to_name(e));
+    }
+    struct measloghdr hdr = { .magic = MEASLOG_MAGIC, .seq = mlcurseq + 1,
+                              .reserved = { 0xffffffff, 0xffffffff } };
+    e = esp_partition_write(mlpart, newsec * MEASLOG_SECSIZE, &hdr, sizeof(hdr));
+    if (e != ESP_OK) {
+      ESP_LOGE("measlog.c", "Writing sector header failed: %s", esp_err_to_name(e));
+    }
+    mlcursec = newsec;
+    mlcurseq++;
+    mlnextslot = 1;
+    mlpagestart = 0;
+    mlflushed = 1; /* The header */
+}
+
+void measlog_init(void)
+{
+    mlpart = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                      MEASLOG_PARTSUBTYPE, "measlog");
+    if (mlpart == NULL) {
+      ESP_LOGW("measlog.c", "No measlog partition found, persistent measurement log disabled.");
+      return;
+    }
+    mlnumsecs = mlpart->size / MEASLOG_SECSIZE;
+    if (mlnumsecs > MEASLOG_MAXSECTORS) mlnumsecs = MEASLOG_MAXSECTORS;
+    if (esp_partition_mmap(mlpart, 0, mlnumsecs * MEASLOG_SECSIZE,
+                           ESP_PARTITION_MMAP_DATA,
+                           (const void **)&mlmap, &mlmaphandle) != ESP_OK) {
+      ESP_LOGE("measlog.c", "Could not mmap measlog partition, persistent measurement log disabled.");
+      mlpart = NULL;
+      return;
+    }
+    mlmutex = xSemaphoreCreateMutex();
+    /* Find the newest sector, and build our index of sectors. */
+    int32_t newest = -1;
+    for (uint32_t s = 0; s < mlnumsecs; s++) {
+      const struct measloghdr * hdr = (const struct measloghdr *)(mlmap + (s * MEASLOG_SECSIZE));
+      mlsecfirstts[s] = 0;
+      if (hdr->magic != MEASLOG_MAGIC) continue;
+      const struct measlogrec * r = measlog_slot(s, 1);
+      if ((r->ts != 0xffffffff) && (measlog_check(r) == r->check)) {
+        mlsecfirstts[s] = r->ts;
+      }
+      if ((newest < 0) || ((int32_t)(hdr->seq - mlcurseq) > 0)) {
+        newest = s;
+        mlcurseq = hdr->seq;
+      }
+    }
+    if (newest < 0) {
+      ESP_LOGI("measlog.c", "measlog partition is empty, starting a new log.");
+      mlcursec = mlnumsecs - 1;
+      mlcurseq = 0;
+      measlog_newsector();
+      return;
+    }
+    mlcursec = newest;
+    for (mlnextslot = 1; mlnextslot < MEASLOG_SLOTSPERSEC; mlnextslot++) {
+      if (measlog_slot(mlcursec, mlnextslot)->ts == 0xffffffff) break;
+    }
+    mlpagestart = mlnextslot - (mlnextslot % MEASLOG_RECSPERPAGE);
+    mlflushed = mlnextslot;
+    ESP_LOGI("measlog.c", "Continuing measurement log in sector %u slot %u",
+             mlcursec, mlnextslot);
+}
+
+void measlog_add(time_t ts, float co2, float temp, float hum)
+{
+    if (mlpart == NULL) return;
+    /* Don't log anything while our clock has not been set by NTP. */
+    if (ts < 1600000000) return;
+    xSemaphoreTake(mlmutex, portMAX_DELAY);
+    if (mlnextslot >= MEASLOG_SLOTSPERSEC) {
+      measlog_newsector();
+    }
+    struct measlogrec * r = &mlpage[mlnextslot - mlpagestart];
+    r->ts = ts;
+    r->co2 = lroundf(co2);
+    r->temp = lroundf(temp * 100.0);
+    r->hum = lroundf(hum * 10.0);
+    r->reserved = 0xffff;
+    r->check = measlog_check(r);
+    if (mlnextslot == 1) {
+      mlsecfirstts[mlcursec] = r->ts;
+    }
+    mlnextslot++;
+    if ((mlnextslot - mlpagestart) >= MEASLOG_RECSPERPAGE) {
+      /* Page is full, write it to flash. */
+      measlog_flushpage();
+      mlpagestart = mlnextslot;
+    }
+    xSemaphoreGive(mlmutex);
+}
+
+void measlog_flush(void)
+{
+    if (mlpart == NULL) return;
+    xSemaphoreTake(mlmutex, portMAX_DELAY);
+    measlog_flushpage();
+    xSemaphoreGive(mlmutex);
+}
+
+int measlog_query(time_t from, time_t to, measlog_sendfn sendfn, void * ctx)
+{
+    if (mlpart == NULL) return 0;
+    uint32_t ufrom = (from < 0) ? 0 : from;
+    uint32_t uto = (to < 0) ? 0 : to;
+    xSemaphoreTake(mlmutex, portMAX_DELAY);
+    /* Walk the sectors from oldest to newest. Unused sectors can only
+     * be at the start of that order, so skip those, and then binary
+     * search for the last sector starting before 'from'.
+     * The current sector is the newest one, but until the first
+     * record in it gets flushed (e.g. right after a reboot), its first
+     * timestamp is still 0. In the search it has to count as newer
+     * than everything, otherwise we would skip the sector before it. */
+    uint32_t oldest = (mlcursec + 1) % mlnumsecs;
+    uint32_t lo = 0;
+    while ((lo < mlnumsecs) && (mlsecfirstts[(oldest + lo) % mlnumsecs] == 0)) lo++;
+    uint32_t hi = mlnumsecs;
+    while ((hi - lo) > 1) {
+      uint32_t mid = lo + ((hi - lo) / 2);
+      uint32_t midts = mlsecfirstts[(oldest + mid) % mlnumsecs];
+      if ((midts != 0) && (midts <= ufrom)) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    int res = 0;
+    for (uint32_t i = lo; (i < mlnumsecs) && (res == 0); i++) {
+      uint32_t s = (oldest + i) % mlnumsecs;
+      if (mlsecfirstts[s] == 0) continue;
+      if (mlsecfirstts[s] > uto) break;
+      /* Find the range of matching records in this sector. For the
+       * current sector, only look at what is actually in flash. */
+      uint32_t end = (s == mlcursec) ? mlflushed : MEASLOG_SLOTSPERSEC;
+      uint32_t first = 1;
+      while ((first < end) && (measlog_slot(s, first)->ts < ufrom)) first++;
+      uint32_t last = first;
+      while ((last < end) && (measlog_slot(s, last)->ts <= uto)) last++;
+      if (first == last) continue;
+      mlreadsec = s;
+      xSemaphoreGive(mlmutex);
+      res = sendfn(ctx, measlog_slot(s, first), (last - first) * sizeof(struct measlogrec));
+      xSemaphoreTake(mlmutex, portMAX_DELAY);
+      mlreadsec = -1;
+    }
+    /* Finally, whatever is not in flash yet. */
+    struct measlogrec pending[MEASLOG_RECSPERPAGE];
+    int n = 0;
+    for (uint32_t i = mlflushed; (res == 0) && (i < mlnextslot); i++) {
+      const struct measlogrec * r = &mlpage[i - mlpagestart];
+      if ((r->ts >= ufrom) && (r->ts <= uto)) {
+        pending[n++] = *r;
+      }
+    }
+    xSemaphoreGive(mlmutex);
+    if (n > 0) {
+      res = sendfn(ctx, pending, n * sizeof(struct measlogrec));
+    }
+    return res;
+}
+
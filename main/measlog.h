@@ -0,0 +1,52 @@
+
+/* Persistent log of measurements in a flash partition. */
+
+#ifndef _MEASLOG_H_
+#define _MEASLOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* One record in the log, exactly as it is stored in flash (and as
+ * it is served by the webserver under /log): 16 bytes, little endian.
+ * Values are in the precision we display them: CO2 in ppm,
+ * temperature in 1/100 degrees, humidity in 1/10 percent.
+ * check is measlog_check() over the record and can be used to
+ * detect broken records. */
+struct measlogrec {
+  uint32_t ts;
+  uint16_t co2;
+  int16_t temp;
+  uint16_t hum;
+  uint16_t reserved; /* Always 0xffff for now */
+  uint32_t check;
+};
+
+/* Function that receives data from measlog_query. Returns 0 on
+ * success, anything else aborts the query. */
+typedef int (*measlog_sendfn)(void * ctx, const void * data, size_t len);
+
+/* Find and map the log partition, and find out where we stopped
+ * writing before the last reboot. If there is no log partition,
+ * all other functions just do nothing. */
+void measlog_init(void);
+
+/* Append a measurement to the log. To save flash, records are
+ * collected in RAM and only written once a flash page (256 bytes)
+ * is full. */
+void measlog_add(time_t ts, float co2, float temp, float hum);
+
+/* Write out whatever is still only in RAM, e.g. before a reboot. */
+void measlog_flush(void);
+
+/* Calls sendfn with all records with from <= ts <= to, oldest first.
+ * Records that are in flash are passed straight from the memory
+ * mapped partition, without copying them. Returns 0 on success. */
+int measlog_query(time_t from, time_t to, measlog_sendfn sendfn, void * ctx);
+
+/* Calculates the check value for a record. */
+uint32_t measlog_check(const struct measlogrec * r);
+
+#endif /* _MEASLOG_H_ */
+
@@ -4,15 +4,172 @@
 #include <esp_netif.h>
 #include <esp_wifi.h>
 #include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
+#include <nvs.h>
+#include <string.h>
 #include <time.h>
 #include "sdkconfig.h"
+#include "boottime.h"
 #include "secrets.h"
 
 EventGroupHandle_t network_event_group;
 
+/* The AP we were last connected to. We keep that in NVS, so after a
+ * reboot we can connect straight to it instead of scanning all
+ * channels first, which saves a second or two. */
+struct apcache {
+  uint8_t bssid[6];
+  uint8_t channel;
+};
+static struct apcache apcache;
+/* Is our config currently pinned to the cached AP? */
+static int apcacheinuse = 0;
+
+static void apcache_load(void)
+{
+    nvs_handle_t nvh;
+    size_t len = sizeof(apcache);
+    memset(&apcache, 0, sizeof(apcache));
+    if (nvs_open("network", NVS_READONLY, &nvh) != ESP_OK) return;
+    if ((nvs_get_blob(nvh, "apcache", &apcache, &len) != ESP_OK)
+     || (len != sizeof(apcache))) {
+      memset(&apcache, 0, sizeof(apcache));
+    }
+    nvs_close(nvh);
+}
+
+static void apcache_save(const uint8_t * bssid, uint8_t channel)
+{
+    nvs_handle_t nvh;
+    /* Only write when something changed, to spare the flash. */
+    if ((memcmp(apcache.bssid, bssid, 6) == 0) && (apcache.channel == channel)) return;
+    memcpy(apcache.bssid, bssid, 6);
+    apcache.channel = channel;
+    if (nvs_open("network", NVS_READWRITE, &nvh) != ESP_OK) return;
+    nvs_set_blob(nvh, "apcache", &apcache, sizeof(apcache));
+    nvs_commit(nvh);
+    nvs_close(nvh);
+}
+
+/* Forget about the cached AP for this connection attempt, and go back
+ * to scanning for our SSID. */
+static void apcache_giveup(void)
+{
+    wifi_config_t wccfg;
+    apcacheinuse = 0;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wccfg) != ESP_OK) return;
+    wccfg.sta.bssid_set = false;
+    wccfg.sta.channel = 0;
+    esp_wifi_set_config(WIFI_IF_STA, &wccfg);
+}
+
+/* Reconnecting: Whenever we lose the connection, or a connection
+ * attempt fails, the next attempt is scheduled through a timer, with
+ * an exponential backoff from NETBACKOFFMIN to NETBACKOFFMAX. The
+ * actual delay is randomly picked from the upper half of that, so a
+ * room full of sensors does not hammer a rebooting AP all in sync. */
+#define NETBACKOFFMIN 1000   /* ms */
+#define NETBACKOFFMAX 60000  /* ms */
+/* If we are associated but DHCP does not give us an address within
+ * this time, we disconnect and start over. */
+#define NETDHCPTIMEOUT 30000 /* ms */
+
+const uint32_t network_outagebounds[NETWORK_OUTAGEBUCKETS - 1] = {
+  2, 5, 10, 30, 60, 300, 900
+};
+
+static esp_timer_handle_t netretrytimer;
+static int netwanted = 0; /* Do we want to be connected at all? */
+static enum netstate netstate = NETST_OFF;
+static uint32_t netfailures = 0; /* Failed attempts in a row */
+static int64_t netoutagestart = 0; /* When we lost the connection, 0 = not lost */
+static struct networkstats netstats;
+static portMUX_TYPE netstatslock = portMUX_INITIALIZER_UNLOCKED;
+
+static void network_setstate(enum netstate st)
+{
+    portENTER_CRITICAL(&netstatslock);
+    netstate = st;
+    portEXIT_CRITICAL(&netstatslock);
+}
+
+static void network_countreason(uint8_t reason)
+{
+    portENTER_CRITICAL(&netstatslock);
+    netstats.disconnects++;
+    int i;
+    for (i = 0; i < NETWORK_REASONSLOTS; i++) {
+      if ((netstats.reasons[i] == reason) || (netstats.reasoncounts[i] == 0)) {
+        netstats.reasons[i] = reason;
+        netstats.reasoncounts[i]++;
+        break;
+      }
+    }
+    if (i >= NETWORK_REASONSLOTS) netstats.reasonother++;
+    portEXIT_CRITICAL(&netstatslock);
+}
+
+static void network_countoutage(int64_t durus)
+{
+    uint32_t secs = durus / 1000000;
+    int b = 0;
+    while ((b < (NETWORK_OUTAGEBUCKETS - 1)) && (secs >= network_outagebounds[b])) b++;
+    portENTER_CRITICAL(&netstatslock);
+    netstats.outages++;
+    netstats.outagebuckets[b]++;
+    netstats.outagesumms += durus / 1000;
+    netstats.lastoutagems = durus / 1000;
+    portEXIT_CRITICAL(&netstatslock);
+}
+
+/* Schedules the next connection attempt. */
+static void network_backoff(void)
+{
+    uint32_t delay = NETBACKOFFMAX;
+    if (netfailures < 16) {
+      delay = NETBACKOFFMIN << netfailures;
+      if (delay > NETBACKOFFMAX) delay = NETBACKOFFMAX;
+    }
+    delay = (delay / 2) + (esp_random() % ((delay / 2) + 1));
+    netfailures++;
+    ESP_LOGI("network.c", "Next WiFi connection attempt in %u ms (attempt %u)",
+             delay, netfailures);
+    network_setstate(NETST_BACKOFF);
+    esp_timer_stop(netretrytimer); /* in case it is still running */
+    esp_timer_start_once(netretrytimer, (uint64_t)delay * 1000);
+}
+
+static void network_connect(void)
+{
+    network_setstate(NETST_CONNECTING);
+    portENTER_CRITICAL(&netstatslock);
+    netstats.connectattempts++;
+    portEXIT_CRITICAL(&netstatslock);
+    esp_err_t e = esp_wifi_connect();
+    if (e != ESP_OK) {
+      /* We won't get an event for this, so we need to retry ourselves. */
+      ESP_LOGW("network.c", "esp_wifi_connect failed: %s", esp_err_to_name(e));
+      network_backoff();
+    }
+}
+
+/* Runs in the esp_timer task when the backoff is over, or when DHCP
+ * took too long. */
+static void netretry_cb(void * arg)
+{
+    if (!netwanted) return;
+    if (netstate == NETST_BACKOFF) {
+      network_connect();
+    } else if (netstate == NETST_ASSOCIATED) {
+      ESP_LOGW("network.c", "No IP address from DHCP, reconnecting");
+      /* That gets us a disconnect event, which schedules the retry. */
+      esp_wifi_disconnect();
+    }
+}
+
 /** Event handler for WiFi events */
-static time_t lastwifireconnect = 0;
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data)
 {
@@ -23,17 +180,36 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
             ESP_LOGI("network.c", "WiFi Connected: channel %u bssid %02x%02x%02x%02x%02x%02x",
                            ev_co->channel, ev_co->bssid[0], ev_co->bssid[1], ev_co->bssid[2],
                            ev_co->bssid[3], ev_co->bssid[4], ev_co->bssid[5]);
+            boottime_mark(BOOT_WIFICONNECTED);
+            apcache_save(ev_co->bssid, ev_co->channel);
+            network_setstate(NETST_ASSOCIATED);
+            esp_timer_stop(netretrytimer);
+            esp_timer_start_once(netretrytimer, (uint64_t)NETDHCPTIMEOUT * 1000);
             break;
         case WIFI_EVENT_STA_DISCONNECTED:
             ESP_LOGI("network.c", "WiFi Disconnected: reason %u", ev_dc->reason);
-            if (ev_dc->reason == WIFI_REASON_ASSOC_LEAVE) break; /* This was an explicit call to disconnect() */
-            if ((lastwifireconnect == 0)
-             || ((time(NULL) - lastwifireconnect) > 5)) {
-              /* Last reconnect attempt more than 5 seconds ago - try it again */
-              ESP_LOGI("network.c", "Attempting WiFi reconnect");
-              lastwifireconnect = time(NULL);
-              esp_wifi_connect();
+            xEventGroupClearBits(network_event_group, NETWORK_CONNECTED_BIT);
+            esp_timer_stop(netretrytimer);
+            if (!netwanted) { /* This was an explicit call to network_off() */
+              network_setstate(NETST_OFF);
+              break;
+            }
+            network_countreason(ev_dc->reason);
+            if ((netstate == NETST_UP) && (netoutagestart == 0)) {
+              netoutagestart = esp_timer_get_time();
             }
+            if (apcacheinuse) {
+              /* Either the AP we remembered is gone or has moved to
+               * another channel, or we lost a connection made through
+               * the cache. Either way, scan properly from now on, so
+               * we can also roam to another AP with our SSID, and do
+               * that right away. */
+              ESP_LOGI("network.c", "Unpinning cached AP, scanning for our SSID");
+              apcache_giveup();
+              network_connect();
+              break;
+            }
+            network_backoff();
             break;
         default: break;
     }
@@ -52,9 +228,32 @@ static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
     ESP_LOGI("network.c", "NETMASK:" IPSTR, IP2STR(&ip_info->netmask));
     ESP_LOGI("network.c", "GW:     " IPSTR, IP2STR(&ip_info->gw));
     ESP_LOGI("network.c", "~~~~~~~~~~~");
+    boottime_mark(BOOT_GOTIP);
+    esp_timer_stop(netretrytimer);
+    network_setstate(NETST_UP);
+    if (netoutagestart != 0) {
+      int64_t dur = esp_timer_get_time() - netoutagestart;
+      ESP_LOGI("network.c", "Network back after %u ms and %u attempts",
+               (uint32_t)(dur / 1000), netfailures);
+      network_countoutage(dur);
+      netoutagestart = 0;
+    }
+    netfailures = 0;
     xEventGroupSetBits(network_event_group, NETWORK_CONNECTED_BIT);
 }
 
+void network_getstats(struct networkstats * s)
+{
+    portENTER_CRITICAL(&netstatslock);
+    *s = netstats;
+    s->state = netstate;
+    s->curoutagems = 0;
+    if (netoutagestart != 0) {
+      s->curoutagems = (esp_timer_get_time() - netoutagestart) / 1000;
+    }
+    portEXIT_CRITICAL(&netstatslock);
+}
+
 void network_prepare(void)
 {
     /* WiFi does not work without this because... who knows, who cares. */
@@ -70,6 +269,11 @@ void network_prepare(void)
     // Register user defined event handers
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip_event_handler, NULL));
+    esp_timer_create_args_t tca = {
+      .callback = netretry_cb,
+      .name = "wifiretry"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&tca, &netretrytimer));
 
     wifi_config_t wccfg = {
       .sta = {
@@ -78,19 +282,34 @@ void network_prepare(void)
         .threshold.authmode = WIFI_AUTH_WPA2_PSK
       }
     };
+    apcache_load();
+    if ((apcache.channel >= 1) && (apcache.channel <= 14)) {
+      ESP_LOGI("network.c", "Trying cached AP %02x%02x%02x%02x%02x%02x on channel %u first",
+               apcache.bssid[0], apcache.bssid[1], apcache.bssid[2],
+               apcache.bssid[3], apcache.bssid[4], apcache.bssid[5], apcache.channel);
+      wccfg.sta.bssid_set = true;
+      memcpy(wccfg.sta.bssid, apcache.bssid, 6);
+      wccfg.sta.channel = apcache.channel;
+      apcacheinuse = 1;
+    }
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wccfg));
 }
 
 void network_on(void)
 {
+    netwanted = 1;
+    netfailures = 0;
     ESP_ERROR_CHECK(esp_wifi_start());
-    ESP_ERROR_CHECK(esp_wifi_connect());
+    network_connect();
 }
 
 void network_off(void)
 {
+    netwanted = 0;
+    esp_timer_stop(netretrytimer);
     xEventGroupClearBits(network_event_group, NETWORK_CONNECTED_BIT);
     ESP_ERROR_CHECK(esp_wifi_stop());
+    network_setstate(NETST_OFF);
 }
 
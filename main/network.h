@@ -2,6 +2,7 @@
 #ifndef _NETWORK_H_
 #define _NETWORK_H_
 
+#include <stdint.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "esp_event.h"
@@ -13,6 +14,40 @@
  * bits like the NETWORK_CONNECTED_BIT are set */ 
 extern EventGroupHandle_t network_event_group;
 
+/* State of the connection, see network.c */
+enum netstate {
+  NETST_OFF,        /* network_off() or not started yet */
+  NETST_CONNECTING, /* Connection attempt running */
+  NETST_ASSOCIATED, /* Connected to the AP, waiting for DHCP */
+  NETST_UP,         /* We have an IP */
+  NETST_BACKOFF     /* Waiting before the next attempt */
+};
+
+/* Disconnect reasons are counted in a small table: the first
+ * NETWORK_REASONSLOTS different reasons get their own counter,
+ * everything after that ends up in reasonother. */
+#define NETWORK_REASONSLOTS 12
+/* Outage durations are counted in buckets, see network_outagebounds */
+#define NETWORK_OUTAGEBUCKETS 8
+
+struct networkstats {
+  uint32_t state;           /* enum netstate */
+  uint32_t disconnects;     /* Unwanted disconnects and failed attempts */
+  uint32_t connectattempts;
+  uint8_t reasons[NETWORK_REASONSLOTS]; /* WIFI_REASON_* */
+  uint32_t reasoncounts[NETWORK_REASONSLOTS];
+  uint32_t reasonother;
+  /* An outage is the time from losing our IP to having one again */
+  uint32_t outages;
+  uint32_t outagebuckets[NETWORK_OUTAGEBUCKETS];
+  uint64_t outagesumms;
+  uint32_t lastoutagems;    /* Duration of the last finished outage */
+  uint32_t curoutagems;     /* Duration of the current outage, 0 if none */
+};
+
+/* Upper bounds (in seconds) of all but the last outage bucket */
+extern const uint32_t network_outagebounds[NETWORK_OUTAGEBUCKETS - 1];
+
 /* network_prepare inits the network stack and prepares
  * a connection. Should be called ONLY ONCE. */
 void network_prepare(void);
@@ -20,6 +55,8 @@ void network_prepare(void);
 void network_on(void);
 /* Disconnect from the network. */
 void network_off(void);
+/* Get a copy of the connection statistics. */
+void network_getstats(struct networkstats * s);
 
 #endif /* _NETWORK_H_ */
 
@@ -0,0 +1,211 @@
+
+/* The content of the webservers pages, see pages.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aggregates.h"
+#include "history.h"
+#include "pages.h"
+
+struct rendercache rcache;
+static int livefds[PAGES_LIVEMAXSUBS] = { -1, -1, -1, -1 };
+
+static const char startp_p1[] = R"EOSP1(
+<!DOCTYPE html>
+
+<html><head><title>FoxCO2-2022</title>
+)EOSP1";
+
+static const char startp_p2[] = R"EOSP2(
+</head><body>
+<h1>FoxCO2-2022</h1>
+<noscript>Because you have JavaScript disabled, this cannot
+ automatically update, you'll have to reload the page.<br></noscript>
+<h2>Currently measured values:</h2>
+)EOSP2";
+
+static const char startp_aggh[] = R"EOSPA(
+<h2>Summary</h2>
+Minimum / average / maximum over the last minute, 5 minutes, hour and day:
+)EOSPA";
+
+static const char startp_p3[] = R"EOSP3(
+<br>For querying this data in scripts, you can use
+ <a href="/json">the JSON output under /json</a>.
+<h2>Firmware-Update:</h2>
+Current firmware version:
+)EOSP3";
+
+static const char startp_p4[] = R"EOSP4(
+<br><form action="/firmwareupdate" method="POST">
+Update from URL:
+<input type="text" name="updateurl" value="https://www.poempelfox.de/espfw/foxco2-2022.bin">
+Admin-Password:
+<input type="text" name="updatepw">
+<br>SHA256 of the image (optional):
+<input type="text" name="sha256" size="64">
+<input type="submit" name="su" value="Flash Update">
+</form>
+The update runs in the background, you can watch its progress under
+<a href="/firmwareupdate/status">/firmwareupdate/status</a>.
+If the download gets interrupted, it continues where it stopped.
+</body></html>
+)EOSP4";
+
+int pages_stale(const struct snapshot * sn, time_t now)
+{
+    return ((sn->seq == 0) || ((now - sn->ts) > 300));
+}
+
+void pages_update(time_t now, uint16_t interval)
+{
+    struct snapshot sn;
+    snapshot_get(&sn);
+    int stale = pages_stale(&sn, now);
+    uint32_t version = (sn.seq << 1) | (stale ? 1 : 0);
+    /* Let clients cache until we expect the next value. */
+    long maxage = (long)(sn.ts + interval - now);
+    if ((maxage < 1) || (maxage > interval)) maxage = (stale ? 10 : 1);
+    sprintf(rcache.cachecontrol, "public, max-age=%ld", maxage);
+    if ((rcache.valid) && (rcache.version == version)) return;
+    render_htmltable(rcache.htmltable, &sn, stale);
+    render_json(rcache.json, &sn, stale);
+    rcache.sn = sn;
+    sprintf(rcache.etag, "\"%08x-%x\"", (unsigned int)rcache.bootid, (unsigned int)version);
+    sprintf(rcache.etagcbor, "\"%08x-%x-c\"", (unsigned int)rcache.bootid, (unsigned int)version);
+    rcache.version = version;
+    rcache.valid = 1;
+}
+
+void pages_startpage(struct respbuf * rb)
+{
+    struct aggresult aggres[AGG_NUMWINDOWS];
+    /* The static parts are large enough to mostly go straight from
+     * flash, without being copied into the buffer. */
+    respbuf_mem(rb, startp_p1, sizeof(startp_p1) - 1);
+    respbuf_str(rb, rcache.assethead);
+    respbuf_mem(rb, startp_p2, sizeof(startp_p2) - 1);
+    respbuf_str(rb, rcache.htmltable);
+    respbuf_mem(rb, startp_aggh, sizeof(startp_aggh) - 1);
+    aggregates_get(aggres);
+    render_agghtml(rb, aggres);
+    respbuf_mem(rb, startp_p3, sizeof(startp_p3) - 1);
+    respbuf_str(rb, rcache.fwversion);
+    respbuf_mem(rb, startp_p4, sizeof(startp_p4) - 1);
+}
+
+void pages_jsonagg(struct respbuf * rb)
+{
+    struct aggresult aggres[AGG_NUMWINDOWS];
+    aggregates_get(aggres);
+    /* That is the object from the cache, with the aggregates added
+     * as another member before its closing bracket. */
+    respbuf_mem(rb, rcache.json, strlen(rcache.json) - 1);
+    respbuf_str(rb, ",\"agg\":");
+    render_aggjson(rb, aggres);
+    respbuf_char(rb, '}');
+}
+
+void pages_cbor(struct respbuf * rb)
+{
+    /* Encoding is about as cheap as copying, so only the snapshot is
+     * in the rendercache - but we must encode that one, not a fresher
+     * one, or a client could cache a newer body under the ETag of an
+     * older one. */
+    render_cbor(rb, &rcache.sn, (rcache.version & 1));
+}
+
+time_t pages_history(struct respbuf * rb, time_t since, int cbor)
+{
+    struct histcursor hc;
+    struct histentry he[4];
+    int n;
+    int first = 1;
+    time_t newest = 0;
+    history_cursorinit(&hc, since);
+    if (cbor) {
+      render_histstartcbor(rb);
+    } else {
+      respbuf_str(rb, "{\"history\":[");
+    }
+    while ((n = history_read(&hc, he, 4)) > 0) {
+      for (int i = 0; i < n; i++) {
+        if (cbor) {
+          render_histentrycbor(rb, &he[i]);
+        } else {
+          render_histentry(rb, &he[i], first);
+        }
+        first = 0;
+      }
+      newest = he[n - 1].ts;
+      if (rb->err) break; /* Client went away */
+    }
+    if (cbor) {
+      render_histendcbor(rb);
+    } else {
+      respbuf_str(rb, "]}");
+    }
+    return newest;
+}
+
+struct livesess * pages_livenew(int fd, int * full)
+{
+    struct livesess * ls;
+    int slot;
+    for (slot = 0; slot < PAGES_LIVEMAXSUBS; slot++) {
+      if (livefds[slot] < 0) break;
+    }
+    *full = (slot >= PAGES_LIVEMAXSUBS);
+    if (*full) return NULL;
+    ls = malloc(sizeof(struct livesess));
+    if (ls == NULL) return NULL;
+    ls->slot = slot;
+    ls->fd = fd;
+    return ls;
+}
+
+void pages_liveactivate(struct livesess * ls)
+{
+    livefds[ls->slot] = ls->fd;
+}
+
+void pages_liveclosed(struct livesess * ls)
+{
+    if (livefds[ls->slot] == ls->fd) {
+      livefds[ls->slot] = -1;
+    }
+    free(ls);
+}
+
+int pages_livefd(int slot)
+{
+    return livefds[slot];
+}
+
+void pages_livestart(struct respbuf * rb)
+{
+    /* Tell the browser to reconnect after 10 seconds if we get
+     * disconnected, and send what we have right away. */
+    respbuf_str(rb, "retry: 10000\n");
+    pages_liveevent(rb);
+    pages_liveaggevent(rb);
+}
+
+void pages_liveevent(struct respbuf * rb)
+{
+    respbuf_str(rb, "id: ");
+    respbuf_uint(rb, rcache.version >> 1);
+    respbuf_str(rb, "\ndata: ");
+    respbuf_str(rb, rcache.json);
+    respbuf_str(rb, "\n\n");
+}
+
+void pages_liveaggevent(struct respbuf * rb)
+{
+    struct aggresult aggres[AGG_NUMWINDOWS];
+    aggregates_get(aggres);
+    respbuf_str(rb, "event: agg\ndata: ");
+    render_aggjson(rb, aggres);
+    respbuf_str(rb, "\n\n");
+}
@@ -0,0 +1,103 @@
+
+/* The content of the webservers pages: everything the handlers in
+ * webserver.c send, minus the HTTP. Nothing in here depends on the
+ * ESP-IDF, so the soak test on the build host runs the same code.
+ * All of this is only ever used from the httpd task, so there is no
+ * locking. */
+
+#ifndef _PAGES_H_
+#define _PAGES_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "render.h"
+#include "respbuf.h"
+#include "snapshot.h"
+
+/* The dynamic parts of / and /json only change when there is a new
+ * measurement (or when the last one gets too old), so we render them
+ * only then and serve them from this cache in between. */
+struct rendercache {
+  uint8_t valid;
+  uint32_t version;    /* (snapshot seq << 1) | stale */
+  uint32_t bootid;     /* Random, so ETags from before a reboot never
+                        * match again. Set before the first update. */
+  char etag[32];
+  char etagcbor[32];   /* The CBOR version of /json needs its own */
+  struct snapshot sn;  /* What all of this was rendered from */
+  char cachecontrol[32];
+  char json[RENDER_JSONMAXLEN];
+  char htmltable[RENDER_HTMLTABLEMAXLEN];
+  /* These never change without a reboot, the webserver sets them
+   * once at startup. */
+  char assetkey[12];   /* Changes with every firmware, see /static */
+  char assethead[200]; /* Tags pulling in CSS and JS, for <head> */
+  char fwversion[160];
+};
+extern struct rendercache rcache;
+
+/* Returns 1 if we have no usable values: either we never got any,
+ * or the last one is too old. */
+int pages_stale(const struct snapshot * sn, time_t now);
+
+/* Brings the rendercache up to date. interval is the current
+ * measurement interval, for how long clients may cache. */
+void pages_update(time_t now, uint16_t interval);
+
+/* The following append the body of a page to rb. Call pages_update
+ * first, they use what is in the rendercache. */
+
+/* The startpage / */
+void pages_startpage(struct respbuf * rb);
+
+/* /json?agg=1: the cached JSON with the rolling aggregates added */
+void pages_jsonagg(struct respbuf * rb);
+
+/* The values from /json, as CBOR */
+void pages_cbor(struct respbuf * rb);
+
+/* /history from since on, as JSON or CBOR. Stops early if sending
+ * fails. Returns the timestamp of the newest entry, 0 if none. */
+time_t pages_history(struct respbuf * rb, time_t since, int cbor);
+
+/* /live is a stream of Server-Sent Events. The connections stay open,
+ * and there is one slot for each. */
+#define PAGES_LIVEMAXSUBS 4
+
+/* The session of a /live connection: which slot it got, and its
+ * socket. */
+struct livesess {
+  int slot;
+  int fd;
+};
+
+/* Allocates the session for a new /live connection on socket fd.
+ * Returns NULL if all slots are taken (then *full is set to 1) or we
+ * are out of memory (*full = 0). The slot is only taken by
+ * pages_liveactivate, once the response has been started. */
+struct livesess * pages_livenew(int fd, int * full);
+
+/* Takes the slot of ls. */
+void pages_liveactivate(struct livesess * ls);
+
+/* Frees ls when its connection was closed. By then the fd may already
+ * have been reused by a new subscriber (possibly in another slot), so
+ * the slot is only cleared if it is still ours. */
+void pages_liveclosed(struct livesess * ls);
+
+/* The socket in a slot, -1 if the slot is free. */
+int pages_livefd(int slot);
+
+/* What a new subscriber gets first: the reconnect delay, and both of
+ * the events below. */
+void pages_livestart(struct respbuf * rb);
+
+/* The current values as an SSE event, same JSON as /json. */
+void pages_liveevent(struct respbuf * rb);
+
+/* The rolling aggregates as an SSE event of type "agg". It is sent
+ * separately, because together with the values it might not fit
+ * into one respbuf. */
+void pages_liveaggevent(struct respbuf * rb);
+
+#endif /* _PAGES_H_ */
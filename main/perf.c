@@ -0,0 +1,259 @@
+
+/* Runtime profiling: CPU usage and stack usage per task, and heap
+ * statistics.
+ * FreeRTOS counts the runtime of every task in a 32 bit counter in
+ * microseconds, which wraps after about 71 minutes. So instead of
+ * looking at those counters directly, we sample them every
+ * PERF_SAMPLEPERIOD seconds, and sum up the differences ourselves.
+ * The same sampling feeds the long term heap history. If the baseline
+ * of the free heap keeps going down over days, we have a leak, and if
+ * only the largest free block does, the heap gets fragmented. Both
+ * are logged with the summary, and /debug/perf shows the history. */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <string.h>
+#include "perf.h"
+
+/* Warn when the heap shrinks by more than this many bytes per day */
+#define PERF_LEAKWARN 1024
+
+struct perftaskstate {
+  UBaseType_t num;    /* xTaskNumber, 0 = slot unused */
+  uint32_t lastcount; /* ulRunTimeCounter at the last sample */
+  uint64_t total;     /* Runtime since we first saw the task */
+  int64_t firstseen;  /* esp_timer time when we first saw the task */
+  uint32_t seen;      /* Sample number we last saw the task in */
+  struct perftask pub;
+};
+
+static struct perftaskstate perftasks[PERF_MAXTASKS];
+static TaskStatus_t perfstatus[PERF_MAXTASKS];
+static uint32_t perfsamples = 0;
+static SemaphoreHandle_t perfmutex = NULL;
+
+/* The heap history, as rings. *next counts all entries ever added. */
+#define PERF_SAMPLESPERHOUR (3600 / PERF_SAMPLEPERIOD)
+static struct perfheapentry perfhourly[PERF_HOURS];
+static uint32_t perfhourlynext = 0;
+static struct perfheapentry perfdaily[PERF_DAYS];
+static uint32_t perfdailynext = 0;
+/* Minimums so far in the current hour and day */
+static struct perfheapentry perfcurhour = { UINT32_MAX, UINT32_MAX };
+static struct perfheapentry perfcurday = { UINT32_MAX, UINT32_MAX };
+
+static struct perftaskstate * perf_findtask(UBaseType_t num)
+{
+    struct perftaskstate * fr = NULL;
+    for (int i = 0; i < PERF_MAXTASKS; i++) {
+      if (perftasks[i].num == num) return &perftasks[i];
+      if ((fr == NULL) && (perftasks[i].num == 0)) fr = &perftasks[i];
+    }
+    return fr;
+}
+
+static void perf_heapmin(struct perfheapentry * e, const struct perfheap * h)
+{
+    if (h->free < e->minfree) e->minfree = h->free;
+    if (h->largest < e->minlargest) e->minlargest = h->largest;
+}
+
+/* Called with every sample, with perfmutex held. */
+static void perf_heapsample(void)
+{
+    struct perfheap h;
+    perf_getheap(&h);
+    perf_heapmin(&perfcurhour, &h);
+    if ((perfsamples % PERF_SAMPLESPERHOUR) != 0) return;
+    /* An hour is complete */
+    perfhourly[perfhourlynext % PERF_HOURS] = perfcurhour;
+    perfhourlynext++;
+    if (perfcurhour.minfree < perfcurday.minfree) perfcurday.minfree = perfcurhour.minfree;
+    if (perfcurhour.minlargest < perfcurday.minlargest) perfcurday.minlargest = perfcurhour.minlargest;
+    perfcurhour.minfree = UINT32_MAX;
+    perfcurhour.minlargest = UINT32_MAX;
+    if ((perfhourlynext % 24) != 0) return;
+    /* And so is a day */
+    perfdaily[perfdailynext % PERF_DAYS] = perfcurday;
+    perfdailynext++;
+    perfcurday.minfree = UINT32_MAX;
+    perfcurday.minlargest = UINT32_MAX;
+}
+
+/* Least squares fit over a ring, oldest first. perday is the number
+ * of entries per day. Called with perfmutex held. */
+static void perf_trend(const struct perfheapentry * ring, uint32_t size,
+                       uint32_t next, uint32_t perday, struct perfheaptrend * t)
+{
+    uint32_t n = (next < size) ? next : size;
+    double sx = 0.0, sxx = 0.0, sf = 0.0, sxf = 0.0, sl = 0.0, sxl = 0.0;
+    memset(t, 0, sizeof(struct perfheaptrend));
+    t->n = n;
+    if (n < 3) return;
+    for (uint32_t i = 0; i < n; i++) {
+      const struct perfheapentry * e = &ring[(next - n + i) % size];
+      double x = (double)i / perday;
+      sx += x;
+      sxx += x * x;
+      sf += e->minfree;
+      sxf += x * e->minfree;
+      sl += e->minlargest;
+      sxl += x * e->minlargest;
+    }
+    double d = (n * sxx) - (sx * sx);
+    t->freeslope = ((n * sxf) - (sx * sf)) / d;
+    t->largestslope = ((n * sxl) - (sx * sl)) / d;
+}
+
+int perf_getheaphistory(int daily, struct perfheapentry * out, int max)
+{
+    const struct perfheapentry * ring = daily ? perfdaily : perfhourly;
+    uint32_t size = daily ? PERF_DAYS : PERF_HOURS;
+    if (perfmutex == NULL) return 0;
+    xSemaphoreTake(perfmutex, portMAX_DELAY);
+    uint32_t next = daily ? perfdailynext : perfhourlynext;
+    uint32_t n = (next < size) ? next : size;
+    if (n > max) n = max;
+    for (uint32_t i = 0; i < n; i++) {
+      out[i] = ring[(next - n + i) % size];
+    }
+    xSemaphoreGive(perfmutex);
+    return n;
+}
+
+void perf_getheaptrend(struct perfheaptrend * hourly, struct perfheaptrend * daily)
+{
+    if (perfmutex == NULL) {
+      memset(hourly, 0, sizeof(struct perfheaptrend));
+      memset(daily, 0, sizeof(struct perfheaptrend));
+      return;
+    }
+    xSemaphoreTake(perfmutex, portMAX_DELAY);
+    perf_trend(perfhourly, PERF_HOURS, perfhourlynext, 24, hourly);
+    perf_trend(perfdaily, PERF_DAYS, perfdailynext, 1, daily);
+    xSemaphoreGive(perfmutex);
+}
+
+static void perf_sample(uint32_t periodus)
+{
+    uint32_t totalrt;
+    int64_t now = esp_timer_get_time();
+    UBaseType_t n = uxTaskGetSystemState(perfstatus, PERF_MAXTASKS, &totalrt);
+    if (n == 0) {
+      /* More tasks than PERF_MAXTASKS - we do not get anything then. */
+      ESP_LOGW("perf.c", "Too many tasks (%u), increase PERF_MAXTASKS",
+               uxTaskGetNumberOfTasks());
+      return;
+    }
+    xSemaphoreTake(perfmutex, portMAX_DELAY);
+    perfsamples++;
+    for (UBaseType_t i = 0; i < n; i++) {
+      TaskStatus_t * ts = &perfstatus[i];
+      struct perftaskstate * pt = perf_findtask(ts->xTaskNumber);
+      if (pt == NULL) continue; /* Table full */
+      if (pt->num != ts->xTaskNumber) { /* New task */
+        memset(pt, 0, sizeof(struct perftaskstate));
+        pt->num = ts->xTaskNumber;
+        pt->lastcount = ts->ulRunTimeCounter;
+        pt->firstseen = now;
+        strncpy(pt->pub.name, ts->pcTaskName, sizeof(pt->pub.name) - 1);
+      }
+      uint32_t delta = ts->ulRunTimeCounter - pt->lastcount;
+      pt->lastcount = ts->ulRunTimeCounter;
+      pt->total += delta;
+      pt->seen = perfsamples;
+      pt->pub.prio = ts->uxCurrentPriority;
+      /* On the ESP32, the stack is counted in bytes */
+      pt->pub.stackfree = ts->usStackHighWaterMark;
+      pt->pub.cpulast = ((uint64_t)delta * 1000) / periodus;
+      if (now > pt->firstseen) {
+        pt->pub.cpuavg = (pt->total * 1000) / (now - pt->firstseen);
+      }
+    }
+    perf_heapsample();
+    /* Forget tasks that no longer exist */
+    for (int i = 0; i < PERF_MAXTASKS; i++) {
+      if ((perftasks[i].num != 0) && (perftasks[i].seen != perfsamples)) {
+        perftasks[i].num = 0;
+      }
+    }
+    xSemaphoreGive(perfmutex);
+}
+
+static void perf_logsummary(void)
+{
+    struct perfheap h;
+    perf_getheap(&h);
+    struct perfheaptrend th, td;
+    ESP_LOGI("perf.c", "Heap: %u free, %u min free, %u largest block",
+             h.free, h.minfree, h.largest);
+    perf_getheaptrend(&th, &td);
+    /* A day of hourly values is the least we need to say anything,
+     * and a few hundred bytes per day can just be noise. */
+    if (th.n >= 24) {
+      ESP_LOGI("perf.c", "Heap trend over %u hours: free %d bytes/day, largest block %d bytes/day",
+               th.n, th.freeslope, th.largestslope);
+      if (th.freeslope < -PERF_LEAKWARN) {
+        ESP_LOGW("perf.c", "Free heap keeps shrinking - probably a memory leak.");
+      } else if (th.largestslope < -PERF_LEAKWARN) {
+        ESP_LOGW("perf.c", "Largest free block keeps shrinking - heap is getting fragmented.");
+      }
+    }
+    xSemaphoreTake(perfmutex, portMAX_DELAY);
+    for (int i = 0; i < PERF_MAXTASKS; i++) {
+      struct perftask * p = &perftasks[i].pub;
+      if (perftasks[i].num == 0) continue;
+      ESP_LOGI("perf.c", "Task %-16s prio %2u cpu %3u.%u%% (avg %3u.%u%%) stack free %u",
+               p->name, p->prio, p->cpulast / 10, p->cpulast % 10,
+               p->cpuavg / 10, p->cpuavg % 10, p->stackfree);
+    }
+    xSemaphoreGive(perfmutex);
+}
+
+static void perftask(void * pvParameters)
+{
+    TickType_t lastwake = xTaskGetTickCount();
+    int64_t lastsample = esp_timer_get_time();
+    perf_sample(1);
+    while (1) {
+      vTaskDelayUntil(&lastwake, pdMS_TO_TICKS(PERF_SAMPLEPERIOD * 1000));
+      int64_t now = esp_timer_get_time();
+      perf_sample(now - lastsample);
+      lastsample = now;
+      if ((perfsamples % PERF_LOGEVERY) == 0) {
+        perf_logsummary();
+      }
+    }
+}
+
+void perf_start(void)
+{
+    perfmutex = xSemaphoreCreateMutex();
+    xTaskCreate(perftask, "perf", 3072, NULL, 1, NULL);
+}
+
+int perf_gettasks(struct perftask * out, int max)
+{
+    int n = 0;
+    if (perfmutex == NULL) return 0;
+    xSemaphoreTake(perfmutex, portMAX_DELAY);
+    for (int i = 0; (i < PERF_MAXTASKS) && (n < max); i++) {
+      if (perftasks[i].num == 0) continue;
+      out[n] = perftasks[i].pub;
+      n++;
+    }
+    xSemaphoreGive(perfmutex);
+    return n;
+}
+
+void perf_getheap(struct perfheap * h)
+{
+    h->free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    h->minfree = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    h->largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+
@@ -0,0 +1,72 @@
+
+/* Runtime profiling: CPU usage and stack usage per task, and heap
+ * statistics. Needs CONFIG_FREERTOS_USE_TRACE_FACILITY and
+ * CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS in sdkconfig. */
+
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include <stdint.h>
+
+/* Maximum number of tasks we keep track of */
+#define PERF_MAXTASKS 24
+
+struct perftask {
+  char name[16];
+  uint32_t prio;
+  uint32_t stackfree; /* Minimum free stack ever, in bytes */
+  /* CPU usage in 1/10 percent of one core, so with two cores the
+   * total over all tasks (including the idle tasks) is 2000. */
+  uint32_t cpulast;   /* during the last sample period */
+  uint32_t cpuavg;    /* since we started sampling */
+};
+
+struct perfheap {
+  uint32_t free;      /* Free heap now */
+  uint32_t minfree;   /* Lowest free heap since boot */
+  uint32_t largest;   /* Largest free block, i.e. largest possible malloc */
+};
+
+/* Long term heap history, to spot leaks and fragmentation that only
+ * show after weeks. For every hour (and every day) we remember the
+ * lowest free heap and the smallest "largest free block" we sampled
+ * in it. Using the minimum filters out short spikes, e.g. while a
+ * request is being answered, so what remains is the baseline. */
+#define PERF_HOURS 168 /* one week */
+#define PERF_DAYS 90
+struct perfheapentry {
+  uint32_t minfree;
+  uint32_t minlargest;
+};
+/* Linear trend (least squares fit) over a heap history */
+struct perfheaptrend {
+  uint32_t n;           /* Entries the fit is over, at least 3 for a slope */
+  int32_t freeslope;    /* Bytes per day */
+  int32_t largestslope; /* Bytes per day */
+};
+
+/* Length of the sample period in seconds. The log summary is written
+ * every PERF_LOGEVERY sample periods. */
+#define PERF_SAMPLEPERIOD 10
+#define PERF_LOGEVERY 60
+
+/* Starts the task that samples the runtime counters. */
+void perf_start(void);
+
+/* Copies the stats of up to max tasks to out. Returns the number of
+ * tasks copied. Everything is from the last sample. */
+int perf_gettasks(struct perftask * out, int max);
+
+/* Current heap statistics. */
+void perf_getheap(struct perfheap * h);
+
+/* Copies up to max entries of the hourly (daily = 0) or daily heap
+ * history to out, oldest first. Only complete hours/days are in
+ * there. Returns the number of entries. */
+int perf_getheaphistory(int daily, struct perfheapentry * out, int max);
+
+/* Trend of the hourly and the daily heap history. */
+void perf_getheaptrend(struct perfheaptrend * hourly, struct perfheaptrend * daily);
+
+#endif /* _PERF_H_ */
+
@@ -0,0 +1,106 @@
+
+/* Distributing measurements from the sensorbus task to everyone who
+ * wants them: one queue and one task per consumer. Publishing never
+ * waits for a queue, what happens if one is full is up to the
+ * policy of that consumer. */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include <esp_log.h>
+#include <string.h>
+#include "pipeline.h"
+
+struct pipeconsumer {
+  QueueHandle_t queue;
+  pipeline_consumefn fn;
+  enum pipeline_policy policy;
+  struct pipelinestats stats;
+};
+
+static struct pipeconsumer pipeconsumers[PIPELINE_MAXCONSUMERS];
+static int pipenum = 0;
+static uint32_t pipeseq = 0;
+static portMUX_TYPE pipestatslock = portMUX_INITIALIZER_UNLOCKED;
+
+static void pipeconsumertask(void * pvParameters)
+{
+    struct pipeconsumer * pc = (struct pipeconsumer *)pvParameters;
+    struct sample s;
+    while (1) {
+      if (xQueueReceive(pc->queue, &s, portMAX_DELAY) == pdTRUE) {
+        pc->fn(&s);
+      }
+    }
+}
+
+int pipeline_subscribe(const char * name, pipeline_consumefn fn,
+                       uint32_t queuelen, enum pipeline_policy policy,
+                       uint32_t prio, uint32_t stacksize)
+{
+    if (pipenum >= PIPELINE_MAXCONSUMERS) {
+      ESP_LOGE("pipeline.c", "Too many consumers, ignoring %s", name);
+      return -1;
+    }
+    struct pipeconsumer * pc = &pipeconsumers[pipenum];
+    memset(pc, 0, sizeof(struct pipeconsumer));
+    pc->queue = xQueueCreate(queuelen, sizeof(struct sample));
+    if (pc->queue == NULL) {
+      ESP_LOGE("pipeline.c", "Could not create queue for %s", name);
+      return -1;
+    }
+    pc->fn = fn;
+    pc->policy = policy;
+    pc->stats.name = name;
+    pc->stats.queuelen = queuelen;
+    /* The task name is copied, but name is also used for the stats. */
+    if (xTaskCreate(pipeconsumertask, name, stacksize, pc, prio, NULL) != pdPASS) {
+      ESP_LOGE("pipeline.c", "Could not create task for %s", name);
+      return -1;
+    }
+    pipenum++;
+    return 0;
+}
+
+void pipeline_publish(struct sample * s)
+{
+    s->seq = ++pipeseq;
+    for (int i = 0; i < pipenum; i++) {
+      struct pipeconsumer * pc = &pipeconsumers[i];
+      uint32_t delivered = 0;
+      uint32_t dropped = 0;
+      if (xQueueSend(pc->queue, s, 0) == pdTRUE) {
+        delivered = 1;
+      } else if (pc->policy == PIPELINE_DROPOLDEST) {
+        struct sample old;
+        /* If the consumer just took one itself, this finds nothing
+         * to drop, and that is fine too. */
+        if (xQueueReceive(pc->queue, &old, 0) == pdTRUE) dropped++;
+        if (xQueueSend(pc->queue, s, 0) == pdTRUE) {
+          delivered = 1;
+        } else {
+          dropped++;
+        }
+      } else {
+        dropped = 1;
+      }
+      uint32_t depth = uxQueueMessagesWaiting(pc->queue);
+      portENTER_CRITICAL(&pipestatslock);
+      pc->stats.delivered += delivered;
+      pc->stats.dropped += dropped;
+      if (depth > pc->stats.maxdepth) pc->stats.maxdepth = depth;
+      portEXIT_CRITICAL(&pipestatslock);
+    }
+}
+
+int pipeline_getstats(struct pipelinestats * out, int max)
+{
+    int n = 0;
+    portENTER_CRITICAL(&pipestatslock);
+    for (n = 0; (n < pipenum) && (n < max); n++) {
+      out[n] = pipeconsumers[n].stats;
+    }
+    portEXIT_CRITICAL(&pipestatslock);
+    return n;
+}
+
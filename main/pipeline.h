@@ -0,0 +1,63 @@
+
+/* Distributing measurements from the sensorbus task to everyone who
+ * wants them. Every consumer gets its own queue and its own task, so
+ * a slow consumer (flash, network, logging to a slow serial port)
+ * can never delay reading the sensor, or the other consumers. */
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/* One measurement, as it is passed through the queues. It is copied
+ * into every queue, so consumers can never change what others see. */
+struct sample {
+  uint32_t seq;     /* +1 for every sample published */
+  time_t ts;        /* Wall clock when it was read (may be unset) */
+  uint8_t valid;
+  uint16_t interval; /* Measurement interval at the time, seconds */
+  uint32_t co2raw;
+  uint32_t tempraw;
+  uint32_t humraw;
+  float co2;        /* ppm */
+  float temp;       /* degrees celsius */
+  float hum;        /* percent */
+};
+
+/* What to do with a new sample if the queue of a consumer is full */
+enum pipeline_policy {
+  PIPELINE_DROPNEWEST, /* Throw away the new sample */
+  PIPELINE_DROPOLDEST  /* Throw away the oldest sample in the queue */
+};
+
+typedef void (*pipeline_consumefn)(const struct sample * s);
+
+/* Maximum number of consumers */
+#define PIPELINE_MAXCONSUMERS 6
+
+struct pipelinestats {
+  const char * name;
+  uint32_t queuelen;
+  uint32_t delivered; /* Samples put into the queue */
+  uint32_t dropped;   /* Samples lost because the queue was full */
+  uint32_t maxdepth;  /* Most samples ever waiting in the queue */
+};
+
+/* Adds a consumer: creates its queue with queuelen entries, and a
+ * task with the given priority and stack size, that calls fn for
+ * every sample. Only call this during startup, before the first
+ * sample is published. Returns 0 on success. */
+int pipeline_subscribe(const char * name, pipeline_consumefn fn,
+                       uint32_t queuelen, enum pipeline_policy policy,
+                       uint32_t prio, uint32_t stacksize);
+
+/* Hands a sample to all consumers. Never blocks. Fills in s->seq. */
+void pipeline_publish(struct sample * s);
+
+/* Copies the statistics of up to max consumers to out. Returns the
+ * number of consumers. */
+int pipeline_getstats(struct pipelinestats * out, int max);
+
+#endif /* _PIPELINE_H_ */
+
@@ -0,0 +1,203 @@
+
+/* Turning measurements into HTML, JSON and CBOR. */
+
+#include <stdio.h>
+#include <math.h>
+#include "render.h"
+
+int render_fixed(char * buf, int32_t v, int decimals)
+{
+    int32_t div = (decimals == 2) ? 100 : 10;
+    const char * sign = "";
+    if (v < 0) {
+      sign = "-";
+      v = -v;
+    }
+    return sprintf(buf, "%s%ld.%0*ld", sign, (long)(v / div), decimals, (long)(v % div));
+}
+
+/* The values from the snapshot in the precision we show them,
+ * as fixed point numbers. */
+static void render_snapvals(const struct snapshot * sn, int32_t * co2,
+                            int32_t * temp, int32_t * hum)
+{
+    *co2 = lroundf(sn->co2);
+    *temp = lroundf(sn->temp * 100.0);
+    *hum = lroundf(sn->hum * 10.0);
+}
+
+int render_json(char * buf, const struct snapshot * sn, int stale)
+{
+    char * pfp = buf;
+    pfp += sprintf(pfp, "{\"ts\":%ld,", (long)sn->ts);
+    if (stale) {
+      pfp += sprintf(pfp, "\"co2\":\"----\",");
+      pfp += sprintf(pfp, "\"temp\":\"--.--\",");
+      pfp += sprintf(pfp, "\"hum\":\"--.-\"}");
+    } else {
+      int32_t co2, temp, hum;
+      render_snapvals(sn, &co2, &temp, &hum);
+      pfp += sprintf(pfp, "\"co2\":\"%ld\",\"temp\":\"", (long)co2);
+      pfp += render_fixed(pfp, temp, 2);
+      pfp += sprintf(pfp, "\",\"hum\":\"");
+      pfp += render_fixed(pfp, hum, 1);
+      pfp += sprintf(pfp, "\"}");
+    }
+    return pfp - buf;
+}
+
+int render_htmltable(char * buf, const struct snapshot * sn, int stale)
+{
+    char * pfp = buf;
+    pfp += sprintf(pfp, "<table><tr><th>UpdateTS</th><td id=\"ts\">%ld</td></tr>", (long)sn->ts);
+    if (stale) {
+      pfp += sprintf(pfp, "<tr><th>CO2 (ppm)</th><td id=\"co2\">----</td></tr>");
+      pfp += sprintf(pfp, "<tr><th>Temperature (C)</th><td id=\"temp\">--.--</td></tr>");
+      pfp += sprintf(pfp, "<tr><th>Humidity (%%)</th><td id=\"hum\">--.-</td></tr></table>");
+    } else {
+      int32_t co2, temp, hum;
+      render_snapvals(sn, &co2, &temp, &hum);
+      pfp += sprintf(pfp, "<tr><th>CO2 (ppm)</th><td id=\"co2\">%ld</td></tr>", (long)co2);
+      pfp += sprintf(pfp, "<tr><th>Temperature (C)</th><td id=\"temp\">");
+      pfp += render_fixed(pfp, temp, 2);
+      pfp += sprintf(pfp, "</td></tr><tr><th>Humidity (%%)</th><td id=\"hum\">");
+      pfp += render_fixed(pfp, hum, 1);
+      pfp += sprintf(pfp, "</td></tr></table>");
+    }
+    return pfp - buf;
+}
+
+void render_histentry(struct respbuf * rb, const struct histentry * he, int first)
+{
+    respbuf_str(rb, (first ? "[" : ",["));
+    respbuf_int(rb, he->ts);
+    respbuf_char(rb, ',');
+    respbuf_int(rb, he->co2);
+    respbuf_char(rb, ',');
+    respbuf_fixed(rb, he->temp, 2);
+    respbuf_char(rb, ',');
+    respbuf_fixed(rb, he->hum, 1);
+    respbuf_char(rb, ']');
+}
+
+static const char * render_aggvalnames[AGG_NUMVALS] = { "co2", "temp", "hum" };
+/* Number of decimals of the fixed point values */
+static const int render_aggdecimals[AGG_NUMVALS] = { 0, 2, 1 };
+
+void render_aggjson(struct respbuf * rb, const struct aggresult res[AGG_NUMWINDOWS])
+{
+    respbuf_char(rb, '{');
+    for (int i = 0; i < AGG_NUMWINDOWS; i++) {
+      const struct aggresult * r = &res[i];
+      respbuf_str(rb, ((i > 0) ? ",\"" : "\""));
+      respbuf_str(rb, r->name);
+      respbuf_str(rb, "\":{\"n\":");
+      respbuf_uint(rb, r->count);
+      if (r->count > 0) {
+        for (int v = 0; v < AGG_NUMVALS; v++) {
+          int d = render_aggdecimals[v];
+          respbuf_str(rb, ",\"");
+          respbuf_str(rb, render_aggvalnames[v]);
+          respbuf_str(rb, "\":{\"min\":");
+          respbuf_fixed(rb, r->min[v], d);
+          respbuf_str(rb, ",\"max\":");
+          respbuf_fixed(rb, r->max[v], d);
+          respbuf_str(rb, ",\"mean\":");
+          respbuf_fixed(rb, r->mean[v], d);
+          respbuf_str(rb, ",\"ewma\":");
+          respbuf_fixed(rb, r->ewma[v], d);
+          respbuf_char(rb, '}');
+        }
+      }
+      respbuf_char(rb, '}');
+    }
+    respbuf_char(rb, '}');
+}
+
+void render_agghtml(struct respbuf * rb, const struct aggresult res[AGG_NUMWINDOWS])
+{
+    respbuf_str(rb, "<table><tr><th>Last</th><th>CO2 (ppm)</th>"
+                    "<th>Temperature (C)</th><th>Humidity (%)</th></tr>");
+    for (int i = 0; i < AGG_NUMWINDOWS; i++) {
+      const struct aggresult * r = &res[i];
+      respbuf_str(rb, "<tr><th>");
+      respbuf_str(rb, r->name);
+      respbuf_str(rb, "</th>");
+      for (int v = 0; v < AGG_NUMVALS; v++) {
+        int d = render_aggdecimals[v];
+        respbuf_str(rb, "<td id=\"agg_");
+        respbuf_str(rb, r->name);
+        respbuf_char(rb, '_');
+        respbuf_str(rb, render_aggvalnames[v]);
+        respbuf_str(rb, "\">");
+        if (r->count > 0) {
+          respbuf_fixed(rb, r->min[v], d);
+          respbuf_str(rb, " / ");
+          respbuf_fixed(rb, r->mean[v], d);
+          respbuf_str(rb, " / ");
+          respbuf_fixed(rb, r->max[v], d);
+        } else {
+          respbuf_char(rb, '-');
+        }
+        respbuf_str(rb, "</td>");
+      }
+      respbuf_str(rb, "</tr>");
+    }
+    respbuf_str(rb, "</table>");
+}
+
+void render_cbor(struct respbuf * rb, const struct snapshot * sn, int stale)
+{
+    cbor_map(rb, 6);
+    cbor_text(rb, "v");
+    cbor_uint(rb, RENDER_CBORVERSION);
+    cbor_text(rb, "ts");
+    if (sn->seq == 0) {
+      cbor_null(rb);
+    } else {
+      cbor_int(rb, sn->ts);
+    }
+    cbor_text(rb, "valid");
+    cbor_bool(rb, !stale);
+    if (stale) {
+      cbor_text(rb, "co2");
+      cbor_null(rb);
+      cbor_text(rb, "temp");
+      cbor_null(rb);
+      cbor_text(rb, "hum");
+      cbor_null(rb);
+    } else {
+      int32_t co2, temp, hum;
+      render_snapvals(sn, &co2, &temp, &hum);
+      cbor_text(rb, "co2");
+      cbor_int(rb, co2);
+      cbor_text(rb, "temp");
+      cbor_int(rb, temp);
+      cbor_text(rb, "hum");
+      cbor_int(rb, hum);
+    }
+}
+
+void render_histstartcbor(struct respbuf * rb)
+{
+    cbor_map(rb, 2);
+    cbor_text(rb, "v");
+    cbor_uint(rb, RENDER_CBORVERSION);
+    cbor_text(rb, "history");
+    cbor_indefarray(rb);
+}
+
+void render_histentrycbor(struct respbuf * rb, const struct histentry * he)
+{
+    cbor_array(rb, 4);
+    cbor_int(rb, he->ts);
+    cbor_int(rb, he->co2);
+    cbor_int(rb, he->temp);
+    cbor_int(rb, he->hum);
+}
+
+void render_histendcbor(struct respbuf * rb)
+{
+    cbor_break(rb);
+}
+
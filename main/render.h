@@ -0,0 +1,66 @@
+
+/* Turning measurements into HTML, JSON and CBOR.
+ * Nothing in here depends on the ESP-IDF. */
+
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include <stdint.h>
+#include "aggregates.h"
+#include "cbor.h"
+#include "history.h"
+#include "respbuf.h"
+#include "snapshot.h"
+
+/* Buffer sizes the render functions below need at most. */
+#define RENDER_JSONMAXLEN 160
+#define RENDER_HTMLTABLEMAXLEN 400
+
+/* Prints a fixed point number with 1 or 2 decimals, e.g.
+ * 2345 with 2 decimals as "23.45". Returns the number of chars written. */
+int render_fixed(char * buf, int32_t v, int decimals);
+
+/* Renders the values from sn as the JSON we serve under /json.
+ * If stale is set, placeholders are output instead of the values.
+ * Returns the number of chars written. */
+int render_json(char * buf, const struct snapshot * sn, int stale);
+
+/* Same, but as the HTML table on the startpage. */
+int render_htmltable(char * buf, const struct snapshot * sn, int stale);
+
+/* The following render straight into a respbuf. */
+
+/* Renders one history entry as a JSON array [ts,co2,temp,hum].
+ * If first is not set, a separating comma is prepended. */
+void render_histentry(struct respbuf * rb, const struct histentry * he, int first);
+
+/* Renders the rolling aggregates as a JSON object, with one member
+ * per window, e.g. {"1m":{"n":1,"co2":{"min":..,"max":..,"mean":..,
+ * "ewma":..},"temp":{..},"hum":{..}},"5m":...} */
+void render_aggjson(struct respbuf * rb, const struct aggresult res[AGG_NUMWINDOWS]);
+
+/* Same, but as a HTML table for the startpage, with min/mean/max. */
+void render_agghtml(struct respbuf * rb, const struct aggresult res[AGG_NUMWINDOWS]);
+
+/* CBOR versions of /json and /history. Values are integers in the
+ * precision we display them, just like in the measlog: CO2 in ppm,
+ * temperature in 1/100 degrees, humidity in 1/10 percent.
+ * /json is a map {"v":RENDER_CBORVERSION, "ts":..., "valid":true,
+ * "co2":..., "temp":..., "hum":...}, with the values (and ts, if we
+ * never had a measurement) null while valid is false.
+ * /history is {"v":..., "history":[_ [ts,co2,temp,hum], ...]}, where
+ * the history array has indefinite length, so it can be streamed.
+ * RENDER_CBORVERSION only changes if existing members change their
+ * meaning, new members may be added without bumping it. */
+#define RENDER_CBORVERSION 1
+
+void render_cbor(struct respbuf * rb, const struct snapshot * sn, int stale);
+/* Starts the /history map, up to and including the opening of the
+ * history array. Entries follow with render_histentrycbor, then it
+ * needs to be closed with render_histendcbor. */
+void render_histstartcbor(struct respbuf * rb);
+void render_histentrycbor(struct respbuf * rb, const struct histentry * he);
+void render_histendcbor(struct respbuf * rb);
+
+#endif /* _RENDER_H_ */
+
@@ -0,0 +1,143 @@
+
+/* Building (HTTP) responses piece by piece in a bounded buffer.
+ * This replaces assembling responses with sprintf in large arrays on
+ * the stack: The buffers come from a small static pool, everything is
+ * bounds checked, and when a buffer is full it is sent out (e.g. as a
+ * HTTP chunk) and reused. Numbers are formatted by hand, which is a
+ * lot cheaper than printf - especially for floats. */
+
+#include <string.h>
+#include "respbuf.h"
+
+static char respbufpool[RESPBUF_POOLSIZE][RESPBUF_SIZE];
+static volatile uint8_t respbufused[RESPBUF_POOLSIZE];
+
+int respbuf_init(struct respbuf * rb, respbuf_flushfn fn, void * ctx)
+{
+    memset(rb, 0, sizeof(struct respbuf));
+    for (int i = 0; i < RESPBUF_POOLSIZE; i++) {
+      if (__atomic_test_and_set(&respbufused[i], __ATOMIC_ACQUIRE) == 0) {
+        rb->buf = respbufpool[i];
+        rb->flushfn = fn;
+        rb->ctx = ctx;
+        return 0;
+      }
+    }
+    rb->err = 1;
+    return -1;
+}
+
+void respbuf_release(struct respbuf * rb)
+{
+    for (int i = 0; i < RESPBUF_POOLSIZE; i++) {
+      if (rb->buf == respbufpool[i]) {
+        __atomic_clear(&respbufused[i], __ATOMIC_RELEASE);
+      }
+    }
+    rb->buf = NULL;
+    rb->len = 0;
+}
+
+int respbuf_flush(struct respbuf * rb)
+{
+    if ((rb->len > 0) && (rb->err == 0) && (rb->flushfn != NULL)) {
+      rb->flushes++;
+      if (rb->flushfn(rb->ctx, rb->buf, rb->len) != 0) {
+        rb->err = 1;
+      }
+    }
+    if (rb->flushfn != NULL) rb->len = 0;
+    return rb->err;
+}
+
+int respbuf_finish(struct respbuf * rb)
+{
+    int res = respbuf_flush(rb);
+    respbuf_release(rb);
+    return res;
+}
+
+void respbuf_mem(struct respbuf * rb, const void * data, size_t len)
+{
+    const char * d = (const char *)data;
+    if (rb->err) return;
+    if ((rb->len + len) > RESPBUF_SIZE) {
+      if (rb->flushfn == NULL) {
+        /* Put in what fits, and remember we had to truncate. */
+        memcpy(rb->buf + rb->len, d, RESPBUF_SIZE - rb->len);
+        rb->len = RESPBUF_SIZE;
+        rb->err = 1;
+        return;
+      }
+      respbuf_flush(rb);
+      if (len >= RESPBUF_SIZE) {
+        /* No point in copying that, just send it. */
+        rb->flushes++;
+        if (rb->flushfn(rb->ctx, d, len) != 0) rb->err = 1;
+        return;
+      }
+    }
+    memcpy(rb->buf + rb->len, d, len);
+    rb->len += len;
+}
+
+void respbuf_str(struct respbuf * rb, const char * s)
+{
+    respbuf_mem(rb, s, strlen(s));
+}
+
+void respbuf_char(struct respbuf * rb, char c)
+{
+    if ((rb->len < RESPBUF_SIZE) && (rb->err == 0)) {
+      rb->buf[rb->len++] = c;
+    } else {
+      respbuf_mem(rb, &c, 1);
+    }
+}
+
+/* Formats v with at least mindigits digits (zero padded). */
+static void respbuf_digits(struct respbuf * rb, uint64_t v, int mindigits)
+{
+    char tmp[20];
+    int n = 0;
+    do {
+      tmp[sizeof(tmp) - 1 - n] = '0' + (v % 10);
+      v /= 10;
+      n++;
+    } while ((v > 0) || (n < mindigits));
+    respbuf_mem(rb, &tmp[sizeof(tmp) - n], n);
+}
+
+void respbuf_uint(struct respbuf * rb, uint64_t v)
+{
+    respbuf_digits(rb, v, 1);
+}
+
+void respbuf_int(struct respbuf * rb, int64_t v)
+{
+    if (v < 0) {
+      respbuf_char(rb, '-');
+      respbuf_digits(rb, -(uint64_t)v, 1);
+    } else {
+      respbuf_digits(rb, v, 1);
+    }
+}
+
+void respbuf_fixed(struct respbuf * rb, int64_t v, int decimals)
+{
+    uint64_t div = 1;
+    uint64_t av;
+    for (int i = 0; i < decimals; i++) div *= 10;
+    if (v < 0) {
+      respbuf_char(rb, '-');
+      av = -(uint64_t)v;
+    } else {
+      av = v;
+    }
+    respbuf_digits(rb, av / div, 1);
+    if (decimals > 0) {
+      respbuf_char(rb, '.');
+      respbuf_digits(rb, av % div, decimals);
+    }
+}
+
@@ -0,0 +1,57 @@
+
+/* Building (HTTP) responses piece by piece in a bounded buffer.
+ * Nothing in here depends on the ESP-IDF. */
+
+#ifndef _RESPBUF_H_
+#define _RESPBUF_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Size of one buffer, and how many of them there are. The webserver
+ * runs all handlers in one task, so it never needs more than one at a
+ * time - the second one is for whatever runs in between. */
+#define RESPBUF_SIZE 1024
+#define RESPBUF_POOLSIZE 2
+
+/* Called whenever the buffer is full (and by respbuf_flush) to send
+ * out its contents. Returns 0 on success. */
+typedef int (*respbuf_flushfn)(void * ctx, const char * data, size_t len);
+
+struct respbuf {
+  char * buf;
+  size_t len;         /* Bytes in buf */
+  respbuf_flushfn flushfn; /* NULL: Never flush, just truncate */
+  void * ctx;         /* passed to flushfn */
+  uint32_t flushes;   /* How often flushfn was called */
+  int err;            /* Set once flushfn failed or we had to truncate.
+                       * Everything appended after that is dropped. */
+};
+
+/* Gets a buffer from the pool. Returns 0 on success, -1 if the pool
+ * is exhausted. */
+int respbuf_init(struct respbuf * rb, respbuf_flushfn fn, void * ctx);
+
+/* Appending things. None of these ever fail, errors are only
+ * reported by respbuf_flush / respbuf_finish. */
+void respbuf_mem(struct respbuf * rb, const void * data, size_t len);
+void respbuf_str(struct respbuf * rb, const char * s);
+void respbuf_char(struct respbuf * rb, char c);
+void respbuf_uint(struct respbuf * rb, uint64_t v);
+void respbuf_int(struct respbuf * rb, int64_t v);
+/* A fixed point number, e.g. 2345 with 2 decimals as "23.45".
+ * decimals can be 0 to 9. */
+void respbuf_fixed(struct respbuf * rb, int64_t v, int decimals);
+
+/* Sends out whatever is in the buffer. Returns 0 on success. */
+int respbuf_flush(struct respbuf * rb);
+
+/* Returns the buffer to the pool without sending anything. */
+void respbuf_release(struct respbuf * rb);
+
+/* respbuf_flush and respbuf_release. Returns 0 if everything that
+ * was appended got sent. */
+int respbuf_finish(struct respbuf * rb);
+
+#endif /* _RESPBUF_H_ */
+
@@ -0,0 +1,118 @@
+
+/* Adaptive measurement interval.
+ * We estimate the current rate of change of the CO2 concentration
+ * with a least squares fit over the values from the last
+ * SAMPLINGWINDOW seconds (but at least the last 3 values). Then:
+ * - If the slope is steeper than SAMPLINGFAST (in either direction),
+ *   we switch to the next faster interval - that can happen with
+ *   every new value, so we speed up quickly.
+ * - If it is flatter than SAMPLINGCALM, and we have not changed the
+ *   interval for SAMPLINGHOLD seconds, we switch to the next slower
+ *   interval, so we only slow down gradually.
+ * - Anything in between keeps the current interval.
+ * The gap between the two thresholds plus the hold time are our
+ * hysteresis, so noise around one threshold cannot make us flip
+ * back and forth. We use the uptime, not the wall clock. */
+
+#include "freertos/FreeRTOS.h"
+#include <esp_timer.h>
+#include <string.h>
+#include "sampling.h"
+
+/* Thresholds in 1/10 ppm per minute */
+#define SAMPLINGFAST 200 /* 20 ppm/min: a room filling up or being aired */
+#define SAMPLINGCALM 50  /* 5 ppm/min: basically nothing happening */
+#define SAMPLINGHOLD 600 /* seconds */
+#define SAMPLINGWINDOW 300 /* seconds */
+/* Enough for SAMPLINGWINDOW at the fastest level */
+#define SAMPLINGHIST 24
+
+const uint16_t sampling_levels[SAMPLING_NUMLEVELS] = { 15, 30, 55, 120 };
+
+struct samplingval {
+  int64_t t;    /* uptime in ms - 32 bits would wrap after 49 days */
+  float co2;
+};
+
+static struct samplingval smphist[SAMPLINGHIST];
+static uint32_t smphistnext = 0; /* total number of values added */
+static int smplevel = SAMPLING_STARTLEVEL;
+static uint32_t smplastchange = 0; /* uptime in seconds */
+static struct samplingstatus smpstatus;
+static portMUX_TYPE smpstatuslock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Least squares slope over the recent values, in 1/10 ppm per
+ * minute. Returns 0 if there are not enough values. */
+static int smp_slope(int64_t now, int32_t * slope)
+{
+    uint32_t avail = (smphistnext < SAMPLINGHIST) ? smphistnext : SAMPLINGHIST;
+    uint32_t n = 0;
+    /* Times relative to the newest value, to keep the numbers small */
+    double st = 0.0, sc = 0.0, stt = 0.0, stc = 0.0;
+    for (uint32_t i = 0; i < avail; i++) {
+      const struct samplingval * v = &smphist[(smphistnext - 1 - i) % SAMPLINGHIST];
+      if ((n >= 3) && ((now - v->t) > (SAMPLINGWINDOW * 1000))) break;
+      double t = -((double)(now - v->t) / 60000.0); /* minutes */
+      st += t;
+      sc += v->co2;
+      stt += t * t;
+      stc += t * v->co2;
+      n++;
+    }
+    if (n < 3) return 0;
+    double d = (n * stt) - (st * st);
+    if (d < 1e-6) return 0; /* All at the same time?! */
+    *slope = (int32_t)((((n * stc) - (st * sc)) / d) * 10.0);
+    return 1;
+}
+
+uint16_t sampling_add(float co2)
+{
+    int64_t now = esp_timer_get_time() / 1000;
+    int32_t slope = 0;
+    smphist[smphistnext % SAMPLINGHIST].t = now;
+    smphist[smphistnext % SAMPLINGHIST].co2 = co2;
+    smphistnext++;
+    int valid = smp_slope(now, &slope);
+    int newlevel = smplevel;
+    int32_t absslope = (slope < 0) ? -slope : slope;
+    if (valid) {
+      if ((absslope >= SAMPLINGFAST) && (smplevel > 0)) {
+        newlevel = smplevel - 1;
+      } else if ((absslope <= SAMPLINGCALM) && (smplevel < (SAMPLING_NUMLEVELS - 1))
+              && (((now / 1000) - smplastchange) >= SAMPLINGHOLD)) {
+        newlevel = smplevel + 1;
+      }
+    }
+    portENTER_CRITICAL(&smpstatuslock);
+    smpstatus.slope = slope;
+    smpstatus.slopevalid = valid;
+    smpstatus.interval = sampling_levels[newlevel];
+    if (newlevel != smplevel) {
+      memmove(&smpstatus.decisions[1], &smpstatus.decisions[0],
+              (SAMPLING_DECISIONS - 1) * sizeof(struct samplingdecision));
+      smpstatus.decisions[0].uptime = now / 1000;
+      smpstatus.decisions[0].from = sampling_levels[smplevel];
+      smpstatus.decisions[0].to = sampling_levels[newlevel];
+      smpstatus.decisions[0].slope = slope;
+      if (smpstatus.ndecisions < SAMPLING_DECISIONS) smpstatus.ndecisions++;
+      smpstatus.changes++;
+    }
+    portEXIT_CRITICAL(&smpstatuslock);
+    if (newlevel != smplevel) {
+      smplevel = newlevel;
+      smplastchange = now / 1000;
+    }
+    return sampling_levels[smplevel];
+}
+
+void sampling_getstatus(struct samplingstatus * s)
+{
+    portENTER_CRITICAL(&smpstatuslock);
+    *s = smpstatus;
+    portEXIT_CRITICAL(&smpstatuslock);
+    if (s->interval == 0) { /* No value yet */
+      s->interval = sampling_levels[SAMPLING_STARTLEVEL];
+    }
+}
+
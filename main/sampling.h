@@ -0,0 +1,46 @@
+
+/* Adaptive measurement interval: measure more often while the CO2
+ * concentration changes quickly (e.g. a meeting room filling up), and
+ * less often while nothing happens (e.g. an empty room at night). */
+
+#ifndef _SAMPLING_H_
+#define _SAMPLING_H_
+
+#include <stdint.h>
+
+/* The intervals we switch between, in seconds, fastest first. We
+ * start at SAMPLING_STARTLEVEL, which is the fixed interval we always
+ * used before. */
+#define SAMPLING_NUMLEVELS 4
+extern const uint16_t sampling_levels[SAMPLING_NUMLEVELS];
+#define SAMPLING_STARTLEVEL 2
+
+/* How many of the last decisions we remember */
+#define SAMPLING_DECISIONS 8
+
+struct samplingdecision {
+  uint32_t uptime;  /* seconds */
+  uint16_t from;    /* old interval */
+  uint16_t to;      /* new interval */
+  int32_t slope;    /* CO2 slope that caused it, in 1/10 ppm per minute */
+};
+
+struct samplingstatus {
+  uint16_t interval;   /* current interval */
+  int32_t slope;       /* last calculated slope, 1/10 ppm per minute */
+  uint8_t slopevalid;  /* slope is 0 if we had too few values */
+  uint32_t changes;    /* number of interval changes since boot */
+  uint32_t ndecisions; /* valid entries in decisions */
+  /* newest first */
+  struct samplingdecision decisions[SAMPLING_DECISIONS];
+};
+
+/* Feed a new CO2 value. Returns the measurement interval that should
+ * be used from now on - usually the same as before. */
+uint16_t sampling_add(float co2);
+
+/* Get a copy of the current state, for the webserver. */
+void sampling_getstatus(struct samplingstatus * s);
+
+#endif /* _SAMPLING_H_ */
+
@@ -1,39 +1,106 @@
 /* Talking to SCD30 CO2 sensors */
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "scd30.h"
 #include "sdkconfig.h"
 #include <string.h>
-#include <math.h>
 
-#define SCD30ADDR 0x61
+#define SCD30DEFAULTADDR 0x61
 
 #define I2C_MASTER_TIMEOUT_MS 1000  /* Timeout for I2C communication (in millisec) */
 
-static i2c_port_t scd30i2cport = 0;
+const uint32_t scd30_latbounds[SCD30_LATBUCKETS - 1] = {
+  2000, 5000, 10000, 20000, 50000, 100000, 200000
+};
+static struct scd30stats scd30stats;
+static portMUX_TYPE scd30statsmux = portMUX_INITIALIZER_UNLOCKED;
 
-void scd30_init(uint16_t measinterval)
+/* Our default transport: The sensor on an I2C port of the ESP32.
+ * ctx points to a struct scd30i2cdev. */
+struct scd30i2cdev {
+  i2c_port_t port;
+  uint8_t addr;
+};
+static struct scd30i2cdev scd30i2cdev = { .port = 0, .addr = SCD30DEFAULTADDR };
+
+static int scd30_i2cwrite(void * ctx, const uint8_t * buf, size_t len)
 {
+    struct scd30i2cdev * dev = (struct scd30i2cdev *)ctx;
     esp_err_t ret;
-    /* Configure measurement interval */
-    uint8_t cmdmi[4] = { 0x46, 0x00, 0x00, 0x00 };
-    cmdmi[2] = ((measinterval >> 8) & 0xff);
-    cmdmi[3] = ((measinterval >> 0) & 0xff);
-    ret = i2c_master_write_to_device(scd30i2cport, SCD30ADDR,
-                                     cmdmi, sizeof(cmdmi),
+    ret = i2c_master_write_to_device(dev->port, dev->addr,
+                                     buf, len,
                                      I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-    if (ret != ESP_OK) {
+    return (ret == ESP_OK) ? 0 : ret;
+}
+
+static int scd30_i2cread(void * ctx, uint8_t * buf, size_t len)
+{
+    struct scd30i2cdev * dev = (struct scd30i2cdev *)ctx;
+    esp_err_t ret;
+    ret = i2c_master_read_from_device(dev->port, dev->addr,
+                                      buf, len,
+                                      I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    return (ret == ESP_OK) ? 0 : ret;
+}
+
+static const struct scd30transport scd30i2ctransport = {
+  .write = scd30_i2cwrite,
+  .read = scd30_i2cread,
+  .ctx = &scd30i2cdev
+};
+
+static const struct scd30transport * scd30tp = &scd30i2ctransport;
+
+void scd30_settransport(const struct scd30transport * t)
+{
+    scd30tp = t;
+}
+
+void scd30_seti2c(i2c_port_t port, uint8_t addr)
+{
+    scd30i2cdev.port = port;
+    scd30i2cdev.addr = addr;
+    scd30tp = &scd30i2ctransport;
+}
+
+/* Sends a command, with or without an argument, to the sensor. */
+static int scd30_sendcmd(uint16_t cmd, int hasarg, uint16_t arg)
+{
+    uint8_t buf[SCD30_MAXCMDLEN];
+    size_t len = scd30proto_buildcmd(buf, cmd, hasarg, arg);
+    return scd30tp->write(scd30tp->ctx, buf, len);
+}
+
+/* State of our driver for the sensorbus scheduler */
+#define SCD30PH_CHECKREADY  0 /* Asking whether there is new data */
+#define SCD30PH_READDATA    1 /* Reading the data */
+#define SCD30PH_SETPRESSURE 2 /* Restarting with new pressure compensation */
+#define SCD30PH_SETINTERVAL 3 /* Changing the measurement interval */
+static int scd30phase = SCD30PH_CHECKREADY;
+static uint16_t scd30interval = 2;
+static int scd30haverdy = 0;
+static scd30_resultfn scd30resultfn = NULL;
+static volatile uint16_t scd30pressure = 0;
+static volatile int scd30pressurepending = 0;
+static volatile uint16_t scd30newinterval = 0; /* 0 = no change pending */
+static uint16_t scd30sentinterval = 0; /* What we sent in SCD30PH_SETINTERVAL */
+
+void scd30_init(uint16_t measinterval)
+{
+    int ret;
+    scd30interval = measinterval;
+    /* Configure measurement interval */
+    ret = scd30_sendcmd(0x4600, 1, measinterval);
+    if (ret != 0) {
       ESP_LOGW("scd30.c", "Sensor init command 1 failed: code %d %s", ret, esp_err_to_name(ret));
     }
     /* Activate Automatic Self Calibration. It shouldn't hurt
      * even if the conditions required for it to work (1 hour
      * of fresh air per day) are not met, it should just do
      * nothing. */
-    uint8_t cmdasc[4] = { 0x53, 0x06, 0x00, 0x01 };
-    ret = i2c_master_write_to_device(scd30i2cport, SCD30ADDR,
-                                     cmdasc, sizeof(cmdasc),
-                                     I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-    if (ret != ESP_OK) {
+    ret = scd30_sendcmd(0x5306, 1, 0x0001);
+    if (ret != 0) {
       ESP_LOGW("scd30.c", "Sensor init command 2 failed: code %d %s", ret, esp_err_to_name(ret));
     }
     /* Start periodic measurements without pressure correction */
@@ -42,99 +109,180 @@ void scd30_init(uint16_t measinterval)
 
 void scd30_startpermeas(uint16_t presscorr)
 {
-    uint8_t cmd[4] = { 0x00, 0x10, 0x00, 0x00 };
-    cmd[2] = ((presscorr >> 8) & 0xff);
-    cmd[3] = ((presscorr >> 0) & 0xff);
-    esp_err_t ret;
-    ret = i2c_master_write_to_device(scd30i2cport, SCD30ADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-    if (ret != ESP_OK) {
+    int ret = scd30_sendcmd(0x0010, 1, presscorr);
+    if (ret != 0) {
       ESP_LOGW("scd30.c", "Start measurement command failed: code %d %s", ret, esp_err_to_name(ret));
     }
 }
 
 void scd30_stoppermeas(void)
 {
-    uint8_t cmd[2] = { 0x01, 0x04 };
-    i2c_master_write_to_device(scd30i2cport, SCD30ADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    scd30_sendcmd(0x0104, 0, 0);
     /* FIXME? we ignore the return value and just assume success. */
 }
 
-/* This function is based on Sensirons example code and datasheet
- * for the SHT3x and was written for that. CRC-calculation is
- * exactly the same for the SCD30, so we reuse it. */
-static uint8_t scd30_crc(uint8_t b1, uint8_t b2)
+void scd30_setpressure(uint16_t mbar)
+{
+    if (mbar == scd30pressure) return;
+    scd30pressure = mbar;
+    scd30pressurepending = 1;
+}
+
+void scd30_setinterval(uint16_t secs)
 {
-    uint8_t crc = 0xff; /* Start value */
-    uint8_t b;
-    crc ^= b1;
-    for (b = 0; b < 8; b++) {
-      if (crc & 0x80) {
-        crc = (crc << 1) ^ 0x131;
-      } else {
-        crc = crc << 1;
+    if (secs < 2) secs = 2;
+    if (secs > 1800) secs = 1800;
+    if (secs == scd30interval) {
+      scd30newinterval = 0;
+      return;
+    }
+    scd30newinterval = secs;
+}
+
+uint16_t scd30_getinterval(void)
+{
+    return scd30interval;
+}
+
+static int scd30_drvtrigger(void * ctx)
+{
+    if ((scd30phase == SCD30PH_CHECKREADY) && (scd30newinterval != 0)) {
+      scd30phase = SCD30PH_SETINTERVAL;
+      scd30sentinterval = scd30newinterval;
+      /* This can be changed while measurements are running. */
+      if (scd30_sendcmd(0x4600, 1, scd30sentinterval) != 0) {
+        /* Still pending, so it gets retried. */
+        scd30phase = SCD30PH_CHECKREADY;
+        return -1;
       }
+      return 0;
     }
-    crc ^= b2;
-    for (b = 0; b < 8; b++) {
-      if (crc & 0x80) {
-        crc = (crc << 1) ^ 0x131;
-      } else {
-        crc = crc << 1;
+    if ((scd30phase == SCD30PH_CHECKREADY) && scd30pressurepending) {
+      scd30phase = SCD30PH_SETPRESSURE;
+      scd30pressurepending = 0;
+      /* Sending the start command again while measurements are
+       * running just updates the compensation. */
+      if (scd30_sendcmd(0x0010, 1, scd30pressure) != 0) {
+        /* Same as for the interval, try again next time. */
+        scd30pressurepending = 1;
+        scd30phase = SCD30PH_CHECKREADY;
+        return -1;
       }
+      return 0;
+    }
+    if (scd30phase == SCD30PH_READDATA) {
+      return (scd30_sendcmd(0x0300, 0, 0) == 0) ? 22 : -1;
+    }
+    /* Same as for reading the data, the sensor needs a bit of
+     * time before the answer can be read. */
+    return (scd30_sendcmd(0x0202, 0, 0) == 0) ? 22 : -1;
+}
+
+/* Reads the answer to "is data ready?". Returns 1 if it is. */
+static int scd30_fetchready(void)
+{
+    uint8_t readbuf[3];
+    uint16_t w;
+    if (scd30tp->read(scd30tp->ctx, readbuf, sizeof(readbuf)) != 0) {
+      return 0;
+    }
+    if (scd30proto_decodeword(readbuf, &w) != 0) {
+      return 0;
     }
-    return crc;
+    return (w == 1);
 }
 
-void scd30_read(struct scd30data * d)
+/* Reads and decodes measurement data, and updates our statistics. */
+static void scd30_fetchmeas(struct scd30data * d)
 {
-    uint8_t readbuf[18];
-    uint8_t cmd[2] = { 0x03, 0x00 };
-    i2c_master_write_to_device(scd30i2cport, SCD30ADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    uint8_t readbuf[SCD30_MEASLEN];
     d->valid = 0;
     d->co2raw = 0xffffffff;  d->tempraw = 0xffffffff; d->humraw = 0xffffffff;
     d->co2 = -999.99; d->temp = -999.9; d->hum = -999.99;
-    /* Datasheet says we need to give the sensor at least 20 ms time before
-     * we can read the data so that it can fill its internal buffers */
-    vTaskDelay(pdMS_TO_TICKS(22));
-    int res = i2c_master_read_from_device(scd30i2cport, SCD30ADDR,
-                                          readbuf, sizeof(readbuf),
-                                          I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-    if (res != ESP_OK) {
+    int64_t readstart = esp_timer_get_time();
+    int res = scd30tp->read(scd30tp->ctx, readbuf, sizeof(readbuf));
+    uint32_t lat = esp_timer_get_time() - readstart;
+    int b = 0;
+    while ((b < (SCD30_LATBUCKETS - 1)) && (lat > scd30_latbounds[b])) b++;
+    portENTER_CRITICAL(&scd30statsmux);
+    scd30stats.latbuckets[b]++;
+    scd30stats.latsumus += lat;
+    if (res != 0) scd30stats.i2cfails++;
+    portEXIT_CRITICAL(&scd30statsmux);
+    if (res != 0) {
       ESP_LOGI("scd30.c", "ERROR: I2C-read from SCD30 failed.");
       return;
     }
-    /* Check CRC */
-    for (int p = 0; p < 6; p++) {
-      if (scd30_crc(readbuf[(p * 3) + 0], readbuf[(p * 3) + 1]) != readbuf[(p * 3) + 2]) {
-        ESP_LOGI("scd30.c", "ERROR: CRC-check for read part %d failed.", p + 1);
-        return;
-      }
+    int badword = 0;
+    res = scd30proto_decodemeas(readbuf, d, &badword);
+    portENTER_CRITICAL(&scd30statsmux);
+    if (res == SCD30_DECODE_CRCFAIL) {
+      scd30stats.crcfails[badword]++;
+    } else if (res == SCD30_DECODE_INSANE) {
+      scd30stats.sanityfails++;
+    } else {
+      scd30stats.readsok++;
     }
-    /* OK, CRC matches, this is looking good. */
-    d->co2raw = ((uint32_t)readbuf[0] << 24) | ((uint32_t)readbuf[1] << 16)
-              | ((uint32_t)readbuf[3] <<  8) | ((uint32_t)readbuf[4] <<  0);
-    d->tempraw = ((uint32_t)readbuf[6] << 24) | ((uint32_t)readbuf[7]  << 16)
-               | ((uint32_t)readbuf[9] <<  8) | ((uint32_t)readbuf[10] <<  0);
-    d->humraw = ((uint32_t)readbuf[12] << 24) | ((uint32_t)readbuf[13] << 16)
-              | ((uint32_t)readbuf[15] <<  8) | ((uint32_t)readbuf[16] <<  0);
-    memcpy(&(d->co2), &(d->co2raw), 4);
-    memcpy(&(d->temp), &(d->tempraw), 4);
-    memcpy(&(d->hum), &(d->humraw), 4);
-    /* Some sanity checks. */
-    if (isnan(d->co2)) return;
-    if (isnan(d->temp)) return;
-    if (isnan(d->hum)) return;
-    if (d->co2 < 100.0) return; /* That cannot be valid */
-    if ((d->hum < -1.0) || (d->hum > 101.0)) { /* That cannot be valid */
-      return;
+    portEXIT_CRITICAL(&scd30statsmux);
+    if (res == SCD30_DECODE_CRCFAIL) {
+      ESP_LOGI("scd30.c", "ERROR: CRC-check for read part %d failed.", badword + 1);
+    }
+}
+
+static uint32_t scd30_drvfetch(void * ctx)
+{
+    struct scd30data d;
+    switch (scd30phase) {
+    case SCD30PH_SETPRESSURE:
+      scd30phase = SCD30PH_CHECKREADY;
+      return 0;
+    case SCD30PH_SETINTERVAL:
+      ESP_LOGI("scd30.c", "Measurement interval changed from %u to %u seconds",
+               scd30interval, scd30sentinterval);
+      scd30interval = scd30sentinterval;
+      /* Unless someone asked for yet another change in between */
+      if (scd30newinterval == scd30sentinterval) scd30newinterval = 0;
+      scd30phase = SCD30PH_CHECKREADY;
+      /* The next value is now due at a different time. Asking in
+       * a second and then twice a second as usual works either way. */
+      return 1000;
+    case SCD30PH_READDATA:
+      scd30_fetchmeas(&d);
+      scd30phase = SCD30PH_CHECKREADY;
+      if (scd30resultfn != NULL) scd30resultfn(&d);
+      /* With the RDY pin, we get kicked when the next value is there,
+       * this is just in case that never happens. Without it, we sleep
+       * until shortly before the next value is due, and then ask. */
+      if (scd30haverdy) return scd30interval * 2000;
+      return (scd30interval > 4) ? ((scd30interval - 2) * 1000) : 500;
+    default:
+      if (scd30_fetchready()) {
+        scd30phase = SCD30PH_READDATA;
+        return 0;
+      }
+      /* Not yet, ask again twice a second. */
+      return 500;
     }
-    /* All sanity checks passed. Mark the result as valid. */
-    d->valid = 1;
+}
+
+static const struct sensordriver scd30drv = {
+  .name = "SCD30",
+  .trigger = scd30_drvtrigger,
+  .fetch = scd30_drvfetch,
+  .ctx = NULL
+};
+
+const struct sensordriver * scd30_driver(scd30_resultfn fn, int haverdy)
+{
+    scd30resultfn = fn;
+    scd30haverdy = haverdy;
+    return &scd30drv;
+}
+
+void scd30_getstats(struct scd30stats * s)
+{
+    portENTER_CRITICAL(&scd30statsmux);
+    memcpy(s, &scd30stats, sizeof(struct scd30stats));
+    portEXIT_CRITICAL(&scd30statsmux);
 }
 
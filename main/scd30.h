@@ -5,17 +5,34 @@
 #define _SCD30_H_
 
 #include "driver/i2c.h" /* Needed for i2c_port_t */
+#include "scd30proto.h" /* struct scd30data and struct scd30transport */
+#include "sensorbus.h"
 
-struct scd30data {
-  uint8_t valid;
-  uint32_t co2raw;  /* CO2 */
-  uint32_t tempraw; /* Temperature */
-  uint32_t humraw;  /* Humidity */
-  float co2;  /* CO2 */
-  float temp; /* Temperature */
-  float hum; /* Humidity */
+/* Number of buckets in the read latency histogram, and their upper
+ * bounds in microseconds. The last bucket catches everything else. */
+#define SCD30_LATBUCKETS 8
+extern const uint32_t scd30_latbounds[SCD30_LATBUCKETS - 1];
+
+/* Statistics about all attempts to read measurements so far. */
+struct scd30stats {
+  uint32_t readsok;     /* Reads that returned valid data */
+  uint32_t i2cfails;    /* I2C transaction failed */
+  uint32_t crcfails[6]; /* CRC mismatch, per 16 bit word read */
+  uint32_t sanityfails; /* Data was read fine but looked implausible */
+  /* Histogram of the time the I2C read took (excluding the fixed
+   * delay before it), NOT cumulative. */
+  uint32_t latbuckets[SCD30_LATBUCKETS];
+  uint64_t latsumus;    /* Sum of all latencies, in microseconds */
 };
 
+/* Replace the way we talk to the sensor. The default is I2C port 0
+ * of the ESP32. If you want to change it, do so before scd30_init. */
+void scd30_settransport(const struct scd30transport * t);
+
+/* Talk to the sensor on another I2C port and/or address than the
+ * default (port 0, address 0x61). Call before scd30_init. */
+void scd30_seti2c(i2c_port_t port, uint8_t addr);
+
 /* Initialize the SCD30.
  * Also starts periodic measurements. */
 void scd30_init(uint16_t measurementinterval);
@@ -25,9 +42,30 @@ void scd30_startpermeas(uint16_t pressurecorrection);
 /* Stop periodic measurements */
 void scd30_stoppermeas(void);
 
-/* Read measurement data (particulate matter)
- * from the sensor. */
-void scd30_read(struct scd30data * d);
+/* Set the ambient pressure in mbar (0 = no compensation), e.g. from
+ * a pressure sensor on the same bus. The sensor is told the next time
+ * our driver gets its turn on the bus. */
+void scd30_setpressure(uint16_t mbar);
+
+/* Change the measurement interval (2 to 1800 seconds). Like the
+ * pressure, this is sent to the sensor the next time our driver gets
+ * its turn on the bus. */
+void scd30_setinterval(uint16_t secs);
+/* The measurement interval the sensor is currently running with. */
+uint16_t scd30_getinterval(void);
+
+/* Called by our driver with every measurement read from the sensor,
+ * valid or not. Runs in the sensorbus task. */
+typedef void (*scd30_resultfn)(const struct scd30data * d);
+
+/* Returns our driver for the sensorbus scheduler. It asks the sensor
+ * whether it has new data, and if so, reads it and passes it to fn.
+ * If haverdy is set, the RDY pin of the sensor is connected and will
+ * make the sensorbus kick us when there is new data. */
+const struct sensordriver * scd30_driver(scd30_resultfn fn, int haverdy);
+
+/* Get a consistent copy of the statistics. */
+void scd30_getstats(struct scd30stats * s);
 
 #endif /* _SCD30_H_ */
 
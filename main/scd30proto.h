@@ -0,0 +1,59 @@
+
+/* Talking to SCD30 CO2 sensors - the hardware independent parts:
+ * Building command frames, and checking and decoding what the sensor
+ * sends back. Nothing in here depends on the ESP-IDF, the actual bus
+ * access happens through a struct scd30transport. */
+
+#ifndef _SCD30PROTO_H_
+#define _SCD30PROTO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct scd30data {
+  uint8_t valid;
+  uint32_t co2raw;  /* CO2 */
+  uint32_t tempraw; /* Temperature */
+  uint32_t humraw;  /* Humidity */
+  float co2;  /* CO2 */
+  float temp; /* Temperature */
+  float hum; /* Humidity */
+};
+
+/* How we get bytes to and from the sensor.
+ * write and read return 0 on success. */
+struct scd30transport {
+  int (*write)(void * ctx, const uint8_t * buf, size_t len);
+  int (*read)(void * ctx, uint8_t * buf, size_t len);
+  void * ctx;
+};
+
+/* A measurement is 6 words, each 2 bytes + 1 byte CRC */
+#define SCD30_MEASLEN 18
+/* Maximum length of a command frame: command, argument, CRC */
+#define SCD30_MAXCMDLEN 5
+
+/* Return values of scd30proto_decodemeas */
+#define SCD30_DECODE_OK 0
+#define SCD30_DECODE_CRCFAIL 1 /* The index of the bad word is in *badword */
+#define SCD30_DECODE_INSANE 2  /* The data is not plausible */
+
+/* Calculates the CRC over one 16 bit word as sent by the sensor. */
+uint8_t scd30proto_crc(uint8_t b1, uint8_t b2);
+
+/* Builds a command frame into buf (at least SCD30_MAXCMDLEN bytes).
+ * If hasarg is set, the 16 bit argument and its CRC are appended.
+ * Returns the length of the frame. */
+size_t scd30proto_buildcmd(uint8_t * buf, uint16_t cmd, int hasarg, uint16_t arg);
+
+/* Checks and decodes a single word reply (3 bytes).
+ * Returns 0 on success, -1 if the CRC does not match. */
+int scd30proto_decodeword(const uint8_t * buf, uint16_t * w);
+
+/* Checks and decodes a measurement (SCD30_MEASLEN bytes) into d,
+ * including sanity checks on the values. d->valid is only set if
+ * everything was fine. */
+int scd30proto_decodemeas(const uint8_t * buf, struct scd30data * d, int * badword);
+
+#endif /* _SCD30PROTO_H_ */
+
@@ -0,0 +1,137 @@
+
+/* A scheduler for the sensors on our I2C bus.
+ * A single task does all transactions on the bus, so they can never
+ * collide. For every sensor we know when its next step is due: either
+ * the next trigger, or the fetch after a trigger once the settle delay
+ * is over. The task always does whatever is due next, and sleeps in
+ * between. That way, while one sensor is busy preparing its answer,
+ * we can already talk to another one, instead of just sleeping
+ * through the delay like we used to. */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <esp_log.h>
+#include "sensorbus.h"
+
+struct sbslot {
+  const struct sensordriver * drv;
+  int settling;    /* trigger was called, fetch is next */
+  TickType_t due;  /* When the next step is due */
+};
+
+static struct sbslot sbslots[SENSORBUS_MAXDRIVERS];
+static int sbnum = 0;
+static volatile uint32_t sbkicked = 0; /* Bitmask of kicked slots */
+static portMUX_TYPE sbkickmux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t sbmutex = NULL;
+static TaskHandle_t sbtaskhandle = NULL;
+
+/* Converts a delay to ticks, rounding up: With 100 ticks per second,
+ * pdMS_TO_TICKS(22) is 2 ticks, which can be as little as 11 ms if we
+ * are at the end of a tick. */
+static TickType_t sensorbus_mstoticks(uint32_t ms)
+{
+    if (ms == 0) return 0;
+    return ((ms * configTICK_RATE_HZ) + 999) / 1000 + 1;
+}
+
+int sensorbus_add(const struct sensordriver * drv)
+{
+    if (sbnum >= SENSORBUS_MAXDRIVERS) {
+      ESP_LOGE("sensorbus.c", "Too many sensors, ignoring %s", drv->name);
+      return -1;
+    }
+    sbslots[sbnum].drv = drv;
+    sbslots[sbnum].settling = 0;
+    sbslots[sbnum].due = xTaskGetTickCount();
+    sbnum++;
+    return sbnum - 1;
+}
+
+void sensorbus_kickfromisr(int id)
+{
+    BaseType_t woken = pdFALSE;
+    if ((id < 0) || (sbtaskhandle == NULL)) return;
+    portENTER_CRITICAL_ISR(&sbkickmux);
+    sbkicked |= (1UL << id);
+    portEXIT_CRITICAL_ISR(&sbkickmux);
+    vTaskNotifyGiveFromISR(sbtaskhandle, &woken);
+    if (woken) portYIELD_FROM_ISR();
+}
+
+void sensorbus_lock(void)
+{
+    if (sbmutex != NULL) xSemaphoreTake(sbmutex, portMAX_DELAY);
+}
+
+void sensorbus_unlock(void)
+{
+    if (sbmutex != NULL) xSemaphoreGive(sbmutex);
+}
+
+static void sensorbustask(void * pvParameters)
+{
+    while (1) {
+      TickType_t now = xTaskGetTickCount();
+      portENTER_CRITICAL(&sbkickmux);
+      uint32_t kicked = sbkicked;
+      sbkicked = 0;
+      portEXIT_CRITICAL(&sbkickmux);
+      /* Find the step that is due first. On a tie, a fetch goes first,
+       * so sensors don't have to hold their answer longer than needed. */
+      int next = -1;
+      for (int i = 0; i < sbnum; i++) {
+        struct sbslot * s = &sbslots[i];
+        if ((kicked & (1UL << i)) && !s->settling) {
+          s->due = now;
+        }
+        if (next < 0) {
+          next = i;
+          continue;
+        }
+        int32_t diff = (int32_t)(s->due - sbslots[next].due);
+        if ((diff < 0) || ((diff == 0) && s->settling && !sbslots[next].settling)) {
+          next = i;
+        }
+      }
+      if (next < 0) { /* Nothing on the bus at all */
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        continue;
+      }
+      struct sbslot * s = &sbslots[next];
+      int32_t wait = (int32_t)(s->due - now);
+      if (wait > 0) {
+        /* A kick wakes us up early. */
+        ulTaskNotifyTake(pdTRUE, wait);
+        continue;
+      }
+      xSemaphoreTake(sbmutex, portMAX_DELAY);
+      if (s->settling) {
+        uint32_t ms = s->drv->fetch(s->drv->ctx);
+        s->settling = 0;
+        s->due = xTaskGetTickCount() + sensorbus_mstoticks(ms);
+      } else {
+        int ms = s->drv->trigger(s->drv->ctx);
+        if (ms < 0) {
+          ESP_LOGW("sensorbus.c", "Talking to %s failed, will retry.", s->drv->name);
+          s->due = xTaskGetTickCount() + sensorbus_mstoticks(1000);
+        } else {
+          s->settling = 1;
+          s->due = xTaskGetTickCount() + sensorbus_mstoticks(ms);
+        }
+      }
+      xSemaphoreGive(sbmutex);
+    }
+}
+
+void sensorbus_start(void)
+{
+    sbmutex = xSemaphoreCreateMutex();
+    /* The WiFi driver and the lwIP task are pinned to the other core
+     * (see sdkconfig), so they can never hold us up. Everything else
+     * that may run on this core has a lower priority. */
+    xTaskCreatePinnedToCore(sensorbustask, "sensorbus", 4096, NULL, 10,
+                            &sbtaskhandle, APP_CPU_NUM);
+}
+
@@ -0,0 +1,46 @@
+
+/* A scheduler for the sensors on our I2C bus. */
+
+#ifndef _SENSORBUS_H_
+#define _SENSORBUS_H_
+
+#include <stdint.h>
+
+#define SENSORBUS_MAXDRIVERS 4
+
+/* Every sensor is driven through transactions that come in two
+ * phases: trigger sends a command to the sensor, and after the sensor
+ * had the time it needs to prepare the answer ("settle delay"), fetch
+ * reads that answer. The scheduler uses the settle delays of one
+ * sensor to talk to the others. Both are only ever called from the
+ * scheduler task, with the bus locked. */
+struct sensordriver {
+  const char * name;
+  /* Start the next transaction. Returns the settle delay in
+   * milliseconds until fetch may be called, or a negative value if
+   * the command failed, in which case trigger is tried again later. */
+  int (*trigger)(void * ctx);
+  /* Finish the transaction started by trigger. Returns the number of
+   * milliseconds until trigger should be called again. */
+  uint32_t (*fetch)(void * ctx);
+  void * ctx;
+};
+
+/* Add a sensor to the bus. Must be called before sensorbus_start.
+ * Returns an id for sensorbus_kickfromisr, or -1 if we're full. */
+int sensorbus_add(const struct sensordriver * drv);
+
+/* Start the task driving all sensors. */
+void sensorbus_start(void);
+
+/* Makes the sensor with the given id due right away, e.g. because it
+ * signalled through an interrupt that it has new data. ISR-safe. */
+void sensorbus_kickfromisr(int id);
+
+/* Everything else that wants to talk to a device on the bus while
+ * the scheduler is running has to do so between these two. */
+void sensorbus_lock(void);
+void sensorbus_unlock(void);
+
+#endif /* _SENSORBUS_H_ */
+
@@ -0,0 +1,47 @@
+
+/* The latest measurement, shared between the task reading the
+ * sensor and everyone else (e.g. the webserver).
+ * This is a classic seqlock: The writer makes the lock counter odd
+ * while it updates the data, and even again when it is done. Readers
+ * copy the data and retry if the counter was odd or changed while
+ * they were copying. Readers never block the writer, and as there is
+ * only one new measurement a minute, they practically never retry. */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <string.h>
+#include "snapshot.h"
+
+static uint32_t snaplock = 0;
+static struct snapshot snapdata;
+
+void snapshot_publish(time_t ts, float co2, float temp, float hum)
+{
+    uint32_t l = __atomic_load_n(&snaplock, __ATOMIC_RELAXED);
+    __atomic_store_n(&snaplock, l + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    snapdata.seq++;
+    snapdata.ts = ts;
+    snapdata.co2 = co2;
+    snapdata.temp = temp;
+    snapdata.hum = hum;
+    __atomic_store_n(&snaplock, l + 2, __ATOMIC_RELEASE);
+}
+
+void snapshot_get(struct snapshot * s)
+{
+    uint32_t l1, l2;
+    int tries = 0;
+    do {
+      if (tries++ > 10) {
+        /* The writer seems to have been interrupted in the middle
+         * of an update. Give it a chance to finish. */
+        vTaskDelay(1);
+      }
+      l1 = __atomic_load_n(&snaplock, __ATOMIC_ACQUIRE);
+      memcpy(s, &snapdata, sizeof(struct snapshot));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      l2 = __atomic_load_n(&snaplock, __ATOMIC_RELAXED);
+    } while ((l1 & 1) || (l1 != l2));
+}
+
@@ -0,0 +1,27 @@
+
+/* The latest measurement, shared between the task reading the
+ * sensor and everyone else (e.g. the webserver). */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+#include <time.h>
+
+struct snapshot {
+  uint32_t seq; /* Incremented with every new measurement. 0 = none yet. */
+  time_t ts;    /* When the measurement was taken */
+  float co2;    /* CO2 in ppm */
+  float temp;   /* Temperature in degrees celsius */
+  float hum;    /* Relative humidity in percent */
+};
+
+/* Publish a new measurement. Must only ever be called from one task. */
+void snapshot_publish(time_t ts, float co2, float temp, float hum);
+
+/* Get a consistent copy of the latest measurement. This never blocks
+ * the publishing task, it just retries if it raced with it. */
+void snapshot_get(struct snapshot * s);
+
+#endif /* _SNAPSHOT_H_ */
+
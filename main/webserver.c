@@ -1,121 +1,140 @@
 
 #include <esp_http_server.h>
 #include <esp_log.h>
+#include <esp_system.h>
+#include <stdlib.h>
+#include <math.h>
 #include <time.h>
 #include <esp_ota_ops.h>
-#include <esp_http_client.h>
-#include <esp_https_ota.h>
-#include <esp_crt_bundle.h>
+#include <esp_timer.h>
+#include <lwip/sockets.h>
 #include "webserver.h"
+#include "boottime.h"
+#include "exporter.h"
+#include "fwupdate.h"
+#include "mcast.h"
+#include "measlog.h"
+#include "perf.h"
+#include "pipeline.h"
+#include "network.h"
+#include "pages.h"
+#include "respbuf.h"
+#include "sampling.h"
+#include "scd30.h"
+#include "snapshot.h"
 #include "secrets.h"
 
 /* These are in foxco2_2022_main.c */
-extern float lastco2;
-extern float lasttemp;
-extern float lasthum;
-extern time_t lastvaluets;
-
-static const char startp_p1[] = R"EOSP1(
-<!DOCTYPE html>
-
-<html><head><title>FoxCO2-2022</title>
-<style type="text/css">
-body { background-color:#000000;color:#cccccc; }
-table, th, td { border:1px solid #aaaaff;border-collapse:collapse;padding:5px; }
-th { text-align:left; }
-td { text-align:right; }
-a:link, a:visited, a:hover { color:#ccccff; }
-</style>
-</head><body>
-<h1>FoxCO2-2022</h1>
-<noscript>Because you have JavaScript disabled, this cannot
- automatically update, you'll have to reload the page.<br></noscript>
-<h2>Currently measured values:</h2>
-)EOSP1";
-
-static const char startp_p2[] = R"EOSP2(
-<script type="text/javascript">
-var getJSON = function(url, callback) {
-    var xhr = new XMLHttpRequest();
-    xhr.open('GET', url, true);
-    xhr.responseType = 'json';
-    xhr.onload = function() {
-      var status = xhr.status;
-      if (status === 200) {
-        callback(null, xhr.response);
-      } else {
-        callback(status, xhr.response);
-      }
-    };
-    xhr.send();
-};
-function updrcvd(err, data) {
-  if (err != null) {
-    document.getElementById("ts").innerHTML = "---";
-    document.getElementById("co2").innerHTML = "----";
-    document.getElementById("temp").innerHTML = "--.--";
-    document.getElementById("hum").innerHTML = "--.-";
-  } else {
-    document.getElementById("ts").innerHTML = data.ts;
-    document.getElementById("co2").innerHTML = data.co2;
-    document.getElementById("temp").innerHTML = data.temp;
-    document.getElementById("hum").innerHTML = data.hum;
-  }
-}
-function updatethings() {
-  getJSON('/json', updrcvd);
-}
-var myrefresher = setInterval(updatethings, 30000);
-</script>
-<br>For querying this data in scripts, you can use
- <a href="/json">the JSON output under /json</a>.
-<h2>Firmware-Update:</h2>
-Current firmware version:
-)EOSP2";
-
-static const char startp_p3[] = R"EOSP3(
-<br><form action="/firmwareupdate" method="POST">
-Update from URL:
-<input type="text" name="updateurl" value="https://www.poempelfox.de/espfw/foxco2-2022.bin">
-Admin-Password:
-<input type="text" name="updatepw">
-<input type="submit" name="su" value="Flash Update">
-</form>
-Be very patient after clicking "Flash Update", this will take about 30 seconds before anything happens.
-</body></html>
-)EOSP3";
+extern uint16_t valueinterval;
+
+/* The static parts of the webinterface (CSS and JavaScript) are in
+ * the www directory. They get gzipped during the build and embedded
+ * into the firmware, see CMakeLists.txt. */
+extern const uint8_t style_css_gz_start[] asm("_binary_style_css_gz_start");
+extern const uint8_t style_css_gz_end[]   asm("_binary_style_css_gz_end");
+extern const uint8_t app_js_gz_start[]    asm("_binary_app_js_gz_start");
+extern const uint8_t app_js_gz_end[]      asm("_binary_app_js_gz_end");
 
 /********************************************************
  * End of embedded webpages definition                  *
  ********************************************************/
 
-esp_err_t get_startpage_handler(httpd_req_t * req) {
-  char myresponse[sizeof(startp_p1) + sizeof(startp_p2) + 1000];
-  char * pfp;
-  strcpy(myresponse, startp_p1);
-  pfp = myresponse + strlen(startp_p1);
-  pfp += sprintf(pfp, "<table><tr><th>UpdateTS</th><td id=\"ts\">%ld</td></tr>", lastvaluets);
-  if ((lastco2 < 0) || ((time(NULL) - lastvaluets) > 300)) {
-    pfp += sprintf(pfp, "<tr><th>CO2 (ppm)</th><td id=\"co2\">----</td></tr>");
-    pfp += sprintf(pfp, "<tr><th>Temperature (C)</th><td id=\"temp\">--.--</td></tr>");
-    pfp += sprintf(pfp, "<tr><th>Humidity (%%)</th><td id=\"hum\">--.-</td></tr></table>");
-  } else {
-    pfp += sprintf(pfp, "<tr><th>CO2 (ppm)</th><td id=\"co2\">%.0f</td></tr>", lastco2);
-    pfp += sprintf(pfp, "<tr><th>Temperature (C)</th><td id=\"temp\">%.2f</td></tr>", lasttemp);
-    pfp += sprintf(pfp, "<tr><th>Humidity (%%)</th><td id=\"hum\">%.1f</td></tr></table>", lasthum);
+/* Brings the rendercache (see pages.h) up to date. */
+static void rendercache_update(void) {
+  pages_update(time(NULL), valueinterval);
+}
+
+/* Sets ETag and Cache-Control headers from the rendercache. Then, if the
+ * client already has the current version, answers with 304 and returns 1.
+ * Otherwise returns 0 and the caller needs to send the actual content. */
+static int rendercache_notmodified_etag(httpd_req_t * req, const char * etag) {
+  char inm[64];
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", rcache.cachecontrol);
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm)) != ESP_OK) {
+    return 0;
   }
-  const esp_app_desc_t * appd = esp_ota_get_app_description();
-  strcat(myresponse, startp_p2);
-  pfp = myresponse + strlen(myresponse);
-  pfp += sprintf(pfp, "%s version %s compiled %s %s",
-                 appd->project_name, appd->version, appd->date, appd->time);
-  strcat(myresponse, startp_p3);
-  /* The following two lines are the default und thus redundant. */
-  httpd_resp_set_status(req, "200 OK");
+  if (strstr(inm, etag) == NULL) {
+    return 0;
+  }
+  httpd_resp_set_status(req, "304 Not Modified");
+  httpd_resp_send(req, NULL, 0);
+  return 1;
+}
+
+static int rendercache_notmodified(httpd_req_t * req) {
+  return rendercache_notmodified_etag(req, rcache.etag);
+}
+
+/* Content negotiation for the machine readable outputs: Returns 1 if
+ * the client wants CBOR instead of JSON, either through format=cbor
+ * in the query string (qry may be NULL) or through its Accept header. */
+static int want_cbor(httpd_req_t * req, const char * qry) {
+  char tmp[128];
+  /* Whatever we answer, caches need to know that it depends on this. */
+  httpd_resp_set_hdr(req, "Vary", "Accept");
+  if ((qry != NULL)
+   && (httpd_query_key_value(qry, "format", tmp, sizeof(tmp)) == ESP_OK)) {
+    return (strcmp(tmp, "cbor") == 0);
+  }
+  /* Browsers send long Accept headers. If it does not fit, we only
+   * look at the part that does. */
+  esp_err_t e = httpd_req_get_hdr_value_str(req, "Accept", tmp, sizeof(tmp));
+  if ((e != ESP_OK) && (e != ESP_ERR_HTTPD_RESULT_TRUNC)) {
+    return 0;
+  }
+  return (strstr(tmp, "application/cbor") != NULL);
+}
+
+/* Responses are built with a respbuf, that sends out HTTP chunks
+ * whenever it is full. */
+static int resp_flushchunk(void * ctx, const char * data, size_t len) {
+  return (httpd_resp_send_chunk((httpd_req_t *)ctx, data, len) == ESP_OK) ? 0 : -1;
+}
+
+/* Gets a respbuf for the response to req. If that fails, it has
+ * already answered with an error and returns -1. */
+static int resp_begin(struct respbuf * rb, httpd_req_t * req) {
+  if (respbuf_init(rb, resp_flushchunk, req) != 0) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_send(req, "Out of response buffers.", HTTPD_RESP_USE_STRLEN);
+    return -1;
+  }
+  return 0;
+}
+
+/* Sends what is left in the respbuf and finishes the response. If it
+ * all fit into the buffer, it is sent in one piece with a
+ * Content-Length instead of chunked. */
+static esp_err_t resp_end(struct respbuf * rb, httpd_req_t * req) {
+  boottime_mark(BOOT_FIRSTREQUEST);
+  if (rb->flushes == 0) {
+    esp_err_t res = httpd_resp_send(req, rb->buf, rb->len);
+    respbuf_release(rb);
+    return res;
+  }
+  if (respbuf_finish(rb) != 0) {
+    return ESP_FAIL;
+  }
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/* Sends a short, constant text as the complete response. */
+static void resp_text(httpd_req_t * req, const char * status, const char * text) {
+  httpd_resp_set_status(req, status);
+  httpd_resp_send(req, text, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t get_startpage_handler(httpd_req_t * req) {
+  rendercache_update();
   httpd_resp_set_type(req, "text/html");
-  httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
-  httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
-  return ESP_OK;
+  if (rendercache_notmodified(req)) {
+    return ESP_OK;
+  }
+  struct respbuf rb;
+  if (resp_begin(&rb, req) != 0) return ESP_OK;
+  pages_startpage(&rb);
+  return resp_end(&rb, req);
 }
 
 static httpd_uri_t uri_startpage = {
@@ -125,26 +144,49 @@ static httpd_uri_t uri_startpage = {
   .user_ctx = NULL
 };
 
+/* /json?agg=1 additionally contains the rolling aggregates. Those
+ * change in between measurements, so that cannot be cached. */
+static esp_err_t send_json_with_agg(httpd_req_t * req) {
+  struct respbuf rb;
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (resp_begin(&rb, req) != 0) return ESP_OK;
+  pages_jsonagg(&rb);
+  return resp_end(&rb, req);
+}
+
+/* The current values as CBOR. */
+static esp_err_t send_cbor(httpd_req_t * req) {
+  struct respbuf rb;
+  httpd_resp_set_type(req, "application/cbor");
+  if (rendercache_notmodified_etag(req, rcache.etagcbor)) {
+    return ESP_OK;
+  }
+  if (resp_begin(&rb, req) != 0) return ESP_OK;
+  pages_cbor(&rb);
+  return resp_end(&rb, req);
+}
+
 esp_err_t get_json_handler(httpd_req_t * req) {
-  char myresponse[1000];
-  char * pfp;
-  strcpy(myresponse, "");
-  pfp = myresponse;
-  pfp += sprintf(pfp, "{\"ts\":%ld,", lastvaluets);
-  if ((lastco2 < 0) || ((time(NULL) - lastvaluets) > 300)) {
-    pfp += sprintf(pfp, "\"co2\":\"----\",");
-    pfp += sprintf(pfp, "\"temp\":\"--.--\",");
-    pfp += sprintf(pfp, "\"hum\":\"--.-\"}");
-  } else {
-    pfp += sprintf(pfp, "\"co2\":\"%.0f\",", lastco2);
-    pfp += sprintf(pfp, "\"temp\":\"%.2f\",", lasttemp);
-    pfp += sprintf(pfp, "\"hum\":\"%.1f\"}", lasthum);
+  char qry[32];
+  char param[8];
+  int hasqry;
+  rendercache_update();
+  hasqry = (httpd_req_get_url_query_str(req, qry, sizeof(qry)) == ESP_OK);
+  if (want_cbor(req, (hasqry ? qry : NULL))) {
+    return send_cbor(req);
+  }
+  httpd_resp_set_type(req, "application/json");
+  if (hasqry
+   && (httpd_query_key_value(qry, "agg", param, sizeof(param)) == ESP_OK)
+   && (strcmp(param, "1") == 0)) {
+    return send_json_with_agg(req);
+  }
+  if (rendercache_notmodified(req)) {
+    return ESP_OK;
   }
   /* The following line is the default und thus redundant. */
   httpd_resp_set_status(req, "200 OK");
-  httpd_resp_set_type(req, "application/json");
-  httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
-  httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+  httpd_resp_send(req, rcache.json, HTTPD_RESP_USE_STRLEN);
   return ESP_OK;
 }
 
@@ -155,6 +197,472 @@ static httpd_uri_t uri_json = {
   .user_ctx = NULL
 };
 
+/* /metrics is several KB by now, far more than any buffer we could put
+ * on the stack, so it always goes out in chunks. We start a new chunk
+ * at the beginning of a metric family whenever less than this is left
+ * in the buffer, so that a family (with all its labels) normally ends
+ * up in one chunk instead of being split mid-line. */
+#define METRICS_FAMILYROOM 320
+
+/* Appends a metric with HELP and TYPE to a /metrics response. The
+ * value (and anything else on that line) has to be appended next. */
+static void metrics_head(struct respbuf * rb, const char * name,
+                         const char * type, const char * help) {
+  if ((RESPBUF_SIZE - rb->len) < METRICS_FAMILYROOM) {
+    respbuf_flush(rb);
+  }
+  respbuf_str(rb, "# HELP ");
+  respbuf_str(rb, name);
+  respbuf_char(rb, ' ');
+  respbuf_str(rb, help);
+  respbuf_str(rb, "\n# TYPE ");
+  respbuf_str(rb, name);
+  respbuf_char(rb, ' ');
+  respbuf_str(rb, type);
+  respbuf_char(rb, '\n');
+}
+
+/* Appends a complete metric that has a single unlabeled value. */
+static void metrics_simple(struct respbuf * rb, const char * name,
+                           const char * type, const char * help, uint64_t v) {
+  metrics_head(rb, name, type, help);
+  respbuf_str(rb, name);
+  respbuf_char(rb, ' ');
+  respbuf_uint(rb, v);
+  respbuf_char(rb, '\n');
+}
+
+/* A gauge with a fixed point value and a timestamp in milliseconds */
+static void metrics_gaugets(struct respbuf * rb, const char * name, const char * help,
+                            int32_t v, int decimals, time_t ts) {
+  metrics_head(rb, name, "gauge", help);
+  respbuf_str(rb, name);
+  respbuf_char(rb, ' ');
+  respbuf_fixed(rb, v, decimals);
+  respbuf_char(rb, ' ');
+  respbuf_int(rb, (int64_t)ts * 1000);
+  respbuf_char(rb, '\n');
+}
+
+esp_err_t get_metrics_handler(httpd_req_t * req) {
+  struct respbuf rb;
+  struct scd30stats st;
+  struct exporterstats es;
+  struct snapshot sn;
+  struct networkstats ns;
+  struct mcaststats ms;
+  struct samplingstatus ss;
+  struct pipelinestats ps[PIPELINE_MAXCONSUMERS];
+  int nps = pipeline_getstats(ps, PIPELINE_MAXCONSUMERS);
+  scd30_getstats(&st);
+  sampling_getstatus(&ss);
+  mcast_getstats(&ms);
+  exporter_getstats(&es);
+  network_getstats(&ns);
+  snapshot_get(&sn);
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (resp_begin(&rb, req) != 0) return ESP_OK;
+  if (!pages_stale(&sn, time(NULL))) {
+    metrics_gaugets(&rb, "foxco2_co2_ppm", "CO2 concentration",
+                    lroundf(sn.co2), 0, sn.ts);
+    metrics_gaugets(&rb, "foxco2_temperature_celsius", "Temperature",
+                    lroundf(sn.temp * 100.0), 2, sn.ts);
+    metrics_gaugets(&rb, "foxco2_humidity_percent", "Relative humidity",
+                    lroundf(sn.hum * 10.0), 1, sn.ts);
+  }
+  metrics_simple(&rb, "foxco2_measurement_interval_seconds", "gauge",
+                 "Current measurement interval", ss.interval);
+  metrics_simple(&rb, "foxco2_measurement_interval_changes_total", "counter",
+                 "Changes of the adaptive measurement interval", ss.changes);
+  metrics_simple(&rb, "foxco2_scd30_reads_total", "counter",
+                 "Successful reads from the SCD30", st.readsok);
+  metrics_simple(&rb, "foxco2_scd30_i2c_failures_total", "counter",
+                 "Failed I2C reads from the SCD30", st.i2cfails);
+  metrics_head(&rb, "foxco2_scd30_crc_failures_total", "counter",
+               "CRC mismatches in data read from the SCD30, per word");
+  for (int i = 0; i < 6; i++) {
+    respbuf_str(&rb, "foxco2_scd30_crc_failures_total{word=\"");
+    respbuf_uint(&rb, i + 1);
+    respbuf_str(&rb, "\"} ");
+    respbuf_uint(&rb, st.crcfails[i]);
+    respbuf_char(&rb, '\n');
+  }
+  metrics_simple(&rb, "foxco2_scd30_sanity_rejects_total", "counter",
+                 "Reads from the SCD30 rejected as implausible", st.sanityfails);
+  metrics_simple(&rb, "foxco2_exporter_queue_depth", "gauge",
+                 "Measurements waiting to be pushed", es.queuedepth);
+  metrics_simple(&rb, "foxco2_exporter_sent_total", "counter",
+                 "Measurements pushed", es.sent);
+  metrics_simple(&rb, "foxco2_exporter_dropped_total", "counter",
+                 "Measurements dropped because the queue was full", es.dropped);
+  metrics_head(&rb, "foxco2_exporter_posts_total", "counter",
+               "HTTP POSTs to push measurements");
+  respbuf_str(&rb, "foxco2_exporter_posts_total{result=\"ok\"} ");
+  respbuf_uint(&rb, es.postsok);
+  respbuf_str(&rb, "\nfoxco2_exporter_posts_total{result=\"failed\"} ");
+  respbuf_uint(&rb, es.postsfailed);
+  respbuf_char(&rb, '\n');
+  metrics_head(&rb, "foxco2_pipeline_samples_total", "counter",
+               "Measurements handed to each consumer, by result");
+  for (int i = 0; i < nps; i++) {
+    respbuf_str(&rb, "foxco2_pipeline_samples_total{consumer=\"");
+    respbuf_str(&rb, ps[i].name);
+    respbuf_str(&rb, "\",result=\"queued\"} ");
+    respbuf_uint(&rb, ps[i].delivered);
+    respbuf_str(&rb, "\nfoxco2_pipeline_samples_total{consumer=\"");
+    respbuf_str(&rb, ps[i].name);
+    respbuf_str(&rb, "\",result=\"dropped\"} ");
+    respbuf_uint(&rb, ps[i].dropped);
+    respbuf_char(&rb, '\n');
+  }
+  metrics_head(&rb, "foxco2_pipeline_queue_max_depth", "gauge",
+               "Most measurements ever waiting for each consumer");
+  for (int i = 0; i < nps; i++) {
+    respbuf_str(&rb, "foxco2_pipeline_queue_max_depth{consumer=\"");
+    respbuf_str(&rb, ps[i].name);
+    respbuf_str(&rb, "\"} ");
+    respbuf_uint(&rb, ps[i].maxdepth);
+    respbuf_char(&rb, '\n');
+  }
+  metrics_head(&rb, "foxco2_mcast_datagrams_total", "counter",
+               "Measurements for the multicast group");
+  respbuf_str(&rb, "foxco2_mcast_datagrams_total{result=\"sent\"} ");
+  respbuf_uint(&rb, ms.sent);
+  respbuf_str(&rb, "\nfoxco2_mcast_datagrams_total{result=\"nonetwork\"} ");
+  respbuf_uint(&rb, ms.skipped);
+  respbuf_str(&rb, "\nfoxco2_mcast_datagrams_total{result=\"failed\"} ");
+  respbuf_uint(&rb, ms.failed);
+  respbuf_char(&rb, '\n');
+  metrics_head(&rb, "foxco2_scd30_read_latency_seconds", "histogram",
+               "Duration of the I2C read from the SCD30");
+  uint32_t cumulative = 0;
+  for (int i = 0; i < SCD30_LATBUCKETS; i++) {
+    cumulative += st.latbuckets[i];
+    respbuf_str(&rb, "foxco2_scd30_read_latency_seconds_bucket{le=\"");
+    if (i < (SCD30_LATBUCKETS - 1)) {
+      respbuf_fixed(&rb, scd30_latbounds[i], 6);
+    } else {
+      respbuf_str(&rb, "+Inf");
+    }
+    respbuf_str(&rb, "\"} ");
+    respbuf_uint(&rb, cumulative);
+    respbuf_char(&rb, '\n');
+  }
+  respbuf_str(&rb, "foxco2_scd30_read_latency_seconds_sum ");
+  respbuf_fixed(&rb, st.latsumus, 6);
+  respbuf_str(&rb, "\nfoxco2_scd30_read_latency_seconds_count ");
+  respbuf_uint(&rb, cumulative);
+  respbuf_char(&rb, '\n');
+  metrics_simple(&rb, "foxco2_wifi_up", "gauge",
+                 "Whether we have an IP address", (ns.state == NETST_UP));
+  metrics_simple(&rb, "foxco2_wifi_connect_attempts_total", "counter",
+                 "WiFi connection attempts", ns.connectattempts);
+  metrics_head(&rb, "foxco2_wifi_disconnects_total", "counter",
+               "Lost connections and failed connection attempts, by reason code");
+  for (int i = 0; i < NETWORK_REASONSLOTS; i++) {
+    if (ns.reasoncounts[i] == 0) break;
+    respbuf_str(&rb, "foxco2_wifi_disconnects_total{reason=\"");
+    respbuf_uint(&rb, ns.reasons[i]);
+    respbuf_str(&rb, "\"} ");
+    respbuf_uint(&rb, ns.reasoncounts[i]);
+    respbuf_char(&rb, '\n');
+  }
+  if (ns.reasonother > 0) {
+    respbuf_str(&rb, "foxco2_wifi_disconnects_total{reason=\"other\"} ");
+    respbuf_uint(&rb, ns.reasonother);
+    respbuf_char(&rb, '\n');
+  }
+  metrics_head(&rb, "foxco2_wifi_outage_seconds", "histogram",
+               "Time from losing the IP address to having one again");
+  cumulative = 0;
+  for (int i = 0; i < NETWORK_OUTAGEBUCKETS; i++) {
+    cumulative += ns.outagebuckets[i];
+    respbuf_str(&rb, "foxco2_wifi_outage_seconds_bucket{le=\"");
+    if (i < (NETWORK_OUTAGEBUCKETS - 1)) {
+      respbuf_uint(&rb, network_outagebounds[i]);
+    } else {
+      respbuf_str(&rb, "+Inf");
+    }
+    respbuf_str(&rb, "\"} ");
+    respbuf_uint(&rb, cumulative);
+    respbuf_char(&rb, '\n');
+  }
+  respbuf_str(&rb, "foxco2_wifi_outage_seconds_sum ");
+  respbuf_fixed(&rb, ns.outagesumms, 3);
+  respbuf_str(&rb, "\nfoxco2_wifi_outage_seconds_count ");
+  respbuf_uint(&rb, ns.outages);
+  respbuf_char(&rb, '\n');
+  metrics_head(&rb, "foxco2_wifi_last_recovery_seconds", "gauge",
+               "Duration of the last outage that has ended");
+  respbuf_str(&rb, "foxco2_wifi_last_recovery_seconds ");
+  respbuf_fixed(&rb, ns.lastoutagems, 3);
+  respbuf_char(&rb, '\n');
+  metrics_head(&rb, "foxco2_wifi_current_outage_seconds", "gauge",
+               "Duration of the current outage, 0 while connected");
+  respbuf_str(&rb, "foxco2_wifi_current_outage_seconds ");
+  respbuf_fixed(&rb, ns.curoutagems, 3);
+  respbuf_char(&rb, '\n');
+  struct perfheap heap;
+  struct perfheaptrend htrend, dtrend;
+  perf_getheap(&heap);
+  perf_getheaptrend(&htrend, &dtrend);
+  metrics_simple(&rb, "foxco2_heap_free_bytes", "gauge",
+                 "Free heap", heap.free);
+  metrics_simple(&rb, "foxco2_heap_min_free_bytes", "gauge",
+                 "Lowest free heap since boot", heap.minfree);
+  metrics_simple(&rb, "foxco2_heap_largest_free_block_bytes", "gauge",
+                 "Largest free block on the heap", heap.largest);
+  if (htrend.n >= 24) {
+    metrics_head(&rb, "foxco2_heap_trend_bytes_per_day", "gauge",
+                 "Trend of the hourly heap minimums over the last week");
+    respbuf_str(&rb, "foxco2_heap_trend_bytes_per_day{value=\"free\"} ");
+    respbuf_int(&rb, htrend.freeslope);
+    respbuf_str(&rb, "\nfoxco2_heap_trend_bytes_per_day{value=\"largestblock\"} ");
+    respbuf_int(&rb, htrend.largestslope);
+    respbuf_char(&rb, '\n');
+  }
+  metrics_head(&rb, "foxco2_boot_phase_seconds", "gauge",
+               "Time after boot at which a boot phase was reached");
+  for (int i = 0; i < BOOT_NUMPHASES; i++) {
+    int64_t t = boottime_get(i);
+    if (t == 0) continue; /* not reached (yet) */
+    respbuf_str(&rb, "foxco2_boot_phase_seconds{phase=\"");
+    respbuf_str(&rb, boottime_names[i]);
+    respbuf_str(&rb, "\"} ");
+    respbuf_fixed(&rb, t, 6);
+    respbuf_char(&rb, '\n');
+  }
+  return resp_end(&rb, req);
+}
+
+static httpd_uri_t uri_metrics = {
+  .uri      = "/metrics",
+  .method   = HTTP_GET,
+  .handler  = get_metrics_handler,
+  .user_ctx = NULL
+};
+
+esp_err_t get_history_handler(httpd_req_t * req) {
+  char qry[64];
+  char tmp1[32];
+  struct respbuf rb;
+  time_t since = 0;
+  int hasqry;
+  int cbor;
+  hasqry = (httpd_req_get_url_query_str(req, qry, sizeof(qry)) == ESP_OK);
+  if (hasqry) {
+    if (httpd_query_key_value(qry, "since", tmp1, sizeof(tmp1)) == ESP_OK) {
+      since = strtol(tmp1, NULL, 10);
+    }
+  }
+  cbor = want_cbor(req, (hasqry ? qry : NULL));
+  httpd_resp_set_type(req, (cbor ? "application/cbor" : "application/json"));
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (resp_begin(&rb, req) != 0) return ESP_OK;
+  pages_history(&rb, since, cbor);
+  return resp_end(&rb, req);
+}
+
+static httpd_uri_t uri_history = {
+  .uri      = "/history",
+  .method   = HTTP_GET,
+  .handler  = get_history_handler,
+  .user_ctx = NULL
+};
+
+static int log_sendchunk(void * ctx, const void * data, size_t len) {
+  httpd_req_t * req = (httpd_req_t *)ctx;
+  return (httpd_resp_send_chunk(req, data, len) == ESP_OK) ? 0 : -1;
+}
+
+/* Serves records from the persistent log, in the binary format
+ * described in measlog.h, for the time range given by the
+ * parameters from and to (both optional). */
+esp_err_t get_log_handler(httpd_req_t * req) {
+  char qs[100];
+  char tmp1[32];
+  time_t from = 0;
+  time_t to = time(NULL);
+  if (httpd_req_get_url_query_str(req, qs, sizeof(qs)) == ESP_OK) {
+    if (httpd_query_key_value(qs, "from", tmp1, sizeof(tmp1)) == ESP_OK) {
+      from = strtol(tmp1, NULL, 10);
+    }
+    if (httpd_query_key_value(qs, "to", tmp1, sizeof(tmp1)) == ESP_OK) {
+      to = strtol(tmp1, NULL, 10);
+    }
+  }
+  httpd_resp_set_type(req, "application/octet-stream");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (measlog_query(from, to, log_sendchunk, req) != 0) {
+    return ESP_FAIL;
+  }
+  httpd_resp_send_chunk(req, NULL, 0);
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_log = {
+  .uri      = "/log",
+  .method   = HTTP_GET,
+  .handler  = get_log_handler,
+  .user_ctx = NULL
+};
+
+/* /live is a stream of Server-Sent Events: We keep the connections
+ * open and push an event with the same JSON as /json to all of them
+ * whenever there is a new measurement, followed by an "agg" event
+ * with the rolling aggregates. The slots for the connections are
+ * managed in pages.c. */
+static httpd_handle_t liveserver = NULL;
+
+/* Called by the httpd when a /live connection is closed. */
+static void live_sessclosed(void * ctx) {
+  pages_liveclosed((struct livesess *)ctx);
+}
+
+esp_err_t get_live_handler(httpd_req_t * req) {
+  struct respbuf rb;
+  struct livesess * ls;
+  int full;
+  ls = pages_livenew(httpd_req_to_sockfd(req), &full);
+  if (full) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "60");
+    httpd_resp_send(req, "Too many live subscribers.", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  if (ls == NULL) {
+    resp_text(req, "503 Service Unavailable", "Out of memory.");
+    return ESP_OK;
+  }
+  rendercache_update();
+  httpd_resp_set_type(req, "text/event-stream");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (resp_begin(&rb, req) != 0) {
+    pages_liveclosed(ls);
+    return ESP_OK;
+  }
+  pages_livestart(&rb);
+  if (respbuf_finish(&rb) != 0) {
+    pages_liveclosed(ls);
+    return ESP_FAIL;
+  }
+  /* We do NOT finish the response. The connection stays open, and
+   * webserver_newdata will send more chunks into it. We get notified
+   * through the session context when it is closed. */
+  pages_liveactivate(ls);
+  req->sess_ctx = ls;
+  req->free_ctx = live_sessclosed;
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_live = {
+  .uri      = "/live",
+  .method   = HTTP_GET,
+  .handler  = get_live_handler,
+  .user_ctx = NULL
+};
+
+/* Sends what is in rb, wrapped into a HTTP chunk, to all /live
+ * subscribers that are not in the bitmask *gone. Those that fail get
+ * added to it, and their connections are closed. */
+static void live_sendall(struct respbuf * rb, uint32_t * gone) {
+  char chunkhdr[12];
+  int hdrlen = sprintf(chunkhdr, "%x\r\n", (unsigned int)rb->len);
+  respbuf_str(rb, "\r\n");
+  if (rb->err) {
+    /* Does not fit - better send nothing than a broken event. */
+    ESP_LOGW("webserver.c", "/live event too large, not sent");
+    return;
+  }
+  for (int i = 0; i < PAGES_LIVEMAXSUBS; i++) {
+    int fd = pages_livefd(i);
+    if ((fd < 0) || (*gone & (1 << i))) continue;
+    if ((httpd_socket_send(liveserver, fd, chunkhdr, hdrlen, 0) < 0)
+     || (httpd_socket_send(liveserver, fd, rb->buf, rb->len, 0) < 0)) {
+      ESP_LOGI("webserver.c", "/live subscriber on fd %d is gone", fd);
+      /* This does not close it right away, only once we return to the
+       * httpd. live_sessclosed then frees the slot. */
+      httpd_sess_trigger_close(liveserver, fd);
+      *gone |= (1 << i);
+    }
+  }
+}
+
+/* This runs inside the httpd task, queued by webserver_newdata. */
+static void live_push(void * arg) {
+  struct respbuf rb;
+  uint32_t gone = 0;
+  rendercache_update();
+  /* No flush function: we send each event to every subscriber
+   * ourselves. */
+  if (respbuf_init(&rb, NULL, NULL) != 0) return;
+  pages_liveevent(&rb);
+  live_sendall(&rb, &gone);
+  respbuf_release(&rb);
+  if (respbuf_init(&rb, NULL, NULL) != 0) return;
+  pages_liveaggevent(&rb);
+  live_sendall(&rb, &gone);
+  respbuf_release(&rb);
+}
+
+void webserver_newdata(void) {
+  if (liveserver == NULL) return;
+  httpd_queue_work(liveserver, live_push, NULL);
+}
+
+/* Static assets, served gzipped, as they are embedded in the firmware.
+ * Their URLs are /static/<key>/<name>, where the key changes with
+ * every firmware, so browsers can cache them forever. */
+struct staticasset {
+  const char * name;
+  const char * type;
+  const uint8_t * start;
+  const uint8_t * end;
+};
+
+static const struct staticasset staticassets[] = {
+  { "style.css", "text/css", style_css_gz_start, style_css_gz_end },
+  { "app.js", "text/javascript", app_js_gz_start, app_js_gz_end }
+};
+
+esp_err_t get_static_handler(httpd_req_t * req) {
+  /* Skip "/static/", then the key should be followed by a "/" */
+  const char * key = req->uri + strlen("/static/");
+  const char * name = strchr(key, '/');
+  if (name == NULL) {
+    httpd_resp_send_404(req);
+    return ESP_OK;
+  }
+  name++;
+  for (int i = 0; i < (sizeof(staticassets) / sizeof(staticassets[0])); i++) {
+    const struct staticasset * sa = &staticassets[i];
+    if (strcmp(name, sa->name) != 0) continue;
+    httpd_resp_set_type(req, sa->type);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    if ((strncmp(key, rcache.assetkey, strlen(rcache.assetkey)) == 0)
+     && (key[strlen(rcache.assetkey)] == '/')) {
+      httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=31536000, immutable");
+    } else {
+      /* Probably a page from before a firmware update. Give them
+       * what we have, but don't let them keep it. */
+      httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    }
+    httpd_resp_send(req, (const char *)sa->start, sa->end - sa->start);
+    boottime_mark(BOOT_FIRSTREQUEST);
+    return ESP_OK;
+  }
+  httpd_resp_send_404(req);
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_static = {
+  .uri      = "/static/*",
+  .method   = HTTP_GET,
+  .handler  = get_static_handler,
+  .user_ctx = NULL
+};
+
 /* Unescapes a x-www-form-urlencoded string.
  * Modifies the string inplace! */
 void unescapeuestring(char * s) {
@@ -178,68 +686,65 @@ void unescapeuestring(char * s) {
 
 esp_err_t post_fwup(httpd_req_t * req) {
   char postcontent[600];
-  char myresponse[1000];
   char tmp1[600];
   //ESP_LOGI("webserver.c", "POST request with length: %d", req->content_len);
   if (req->content_len >= sizeof(postcontent)) {
-    httpd_resp_set_status(req, "500 Internal Server Error");
-    strcpy(myresponse, "Sorry, your request was too large. Try a shorter update URL?");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    resp_text(req, "500 Internal Server Error", "Sorry, your request was too large. Try a shorter update URL?");
     return ESP_OK;
   }
   int ret = httpd_req_recv(req, postcontent, req->content_len);
   if (ret < req->content_len) {
-    httpd_resp_set_status(req, "500 Internal Server Error");
-    strcpy(myresponse, "Your request was incompletely received.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    resp_text(req, "500 Internal Server Error", "Your request was incompletely received.");
     return ESP_OK;
   }
   postcontent[req->content_len] = 0;
   ESP_LOGI("webserver.c", "Received data: '%s'", postcontent);
   if (httpd_query_key_value(postcontent, "updatepw", tmp1, sizeof(tmp1)) != ESP_OK) {
-    httpd_resp_set_status(req, "400 Bad Request");
-    strcpy(myresponse, "No updatepw submitted.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    resp_text(req, "400 Bad Request", "No updatepw submitted.");
     return ESP_OK;
   }
   unescapeuestring(tmp1);
   ESP_LOGI("webserver.c", "UE AdminPW: '%s'", tmp1);
   if (strcmp(tmp1, FCO2_ADMINPW) != 0) {
-    httpd_resp_set_status(req, "403 Forbidden");
-    strcpy(myresponse, "Admin-Password incorrect.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    resp_text(req, "403 Forbidden", "Admin-Password incorrect.");
     return ESP_OK;
   }
   if (httpd_query_key_value(postcontent, "updateurl", tmp1, sizeof(tmp1)) != ESP_OK) {
-    httpd_resp_set_status(req, "400 Bad Request");
-    strcpy(myresponse, "No updateurl submitted.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    resp_text(req, "400 Bad Request", "No updateurl submitted.");
     return ESP_OK;
   }
   unescapeuestring(tmp1);
   ESP_LOGI("webserver.c", "UE UpdateURL: '%s'", tmp1);
-  sprintf(myresponse, "OK, will try to update from: %s'", tmp1);
-  esp_http_client_config_t httpccfg = {
-      .url = tmp1,
-      .timeout_ms = 60000,
-      .keep_alive_enable = true,
-      .crt_bundle_attach = esp_crt_bundle_attach
-  };
-  ret = esp_https_ota(&httpccfg);
-  if (ret == ESP_OK) {
-    ESP_LOGI("webserver.c", "OTA Succeed, Rebooting...");
-    strcat(myresponse, "OTA Update reported success. Will reboot.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
-    vTaskDelay(3 * (1000 / portTICK_PERIOD_MS)); 
-    esp_restart();
-  } else {
-    ESP_LOGE("webserver.c", "Firmware upgrade failed");
-    strcat(myresponse, "OTA Update reported failure.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+  /* The expected SHA256 of the image is optional, an empty field
+   * means there is none. But if there is one, it has to be valid -
+   * we don't want to silently install an unchecked image. */
+  char expsha[65];
+  esp_err_t sharet = httpd_query_key_value(postcontent, "sha256", expsha, sizeof(expsha));
+  if (sharet == ESP_ERR_NOT_FOUND) {
+    expsha[0] = 0;
+  } else if (sharet != ESP_OK) {
+    resp_text(req, "400 Bad Request", "sha256 has to be 64 hex digits.");
     return ESP_OK;
   }
-  /* This should not be reached. */
-  return ESP_OK;
+  /* The actual update runs in the background, we just kick it off. */
+  ret = fwupdate_start(tmp1, (expsha[0] != 0) ? expsha : NULL);
+  if (ret == -2) {
+    resp_text(req, "400 Bad Request", "sha256 has to be 64 hex digits.");
+    return ESP_OK;
+  }
+  if (ret != 0) {
+    resp_text(req, "409 Conflict", "There already is an update running.");
+    return ESP_OK;
+  }
+  httpd_resp_set_status(req, "202 Accepted");
+  httpd_resp_set_hdr(req, "Location", "/firmwareupdate/status");
+  struct respbuf rb;
+  if (resp_begin(&rb, req) != 0) return ESP_OK;
+  respbuf_str(&rb, "OK, will try to update from: '");
+  respbuf_str(&rb, tmp1);
+  respbuf_str(&rb, "'. See /firmwareupdate/status for progress. "
+                   "If the update succeeds, we will reboot.");
+  return resp_end(&rb, req);
 }
 
 static httpd_uri_t uri_fwup = {
@@ -249,23 +754,318 @@ static httpd_uri_t uri_fwup = {
   .user_ctx = NULL
 };
 
+esp_err_t get_fwupstatus_handler(httpd_req_t * req) {
+  static const char * statenames[] = { "idle", "running", "done", "failed" };
+  struct respbuf rb;
+  struct fwupstatus st;
+  fwupdate_getstatus(&st);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  if (resp_begin(&rb, req) != 0) return ESP_OK;
+  respbuf_str(&rb, "{\"state\":\"");
+  respbuf_str(&rb, statenames[st.state]);
+  respbuf_str(&rb, "\",\"written\":");
+  respbuf_uint(&rb, st.written);
+  respbuf_str(&rb, ",\"imagesize\":");
+  respbuf_int(&rb, st.imagesize);
+  respbuf_str(&rb, ",\"elapsedms\":");
+  respbuf_uint(&rb, st.elapsedms);
+  respbuf_str(&rb, ",\"bytespersec\":");
+  respbuf_uint(&rb, st.bytespersec);
+  respbuf_char(&rb, '}');
+  return resp_end(&rb, req);
+}
+
+static httpd_uri_t uri_fwupstatus = {
+  .uri      = "/firmwareupdate/status",
+  .method   = HTTP_GET,
+  .handler  = get_fwupstatus_handler,
+  .user_ctx = NULL
+};
+
+/* The adaptive measurement interval, and why it is what it is. */
+esp_err_t get_sampling_handler(httpd_req_t * req) {
+  struct respbuf rb;
+  struct samplingstatus st;
+  sampling_getstatus(&st);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (resp_begin(&rb, req) != 0) return ESP_OK;
+  respbuf_str(&rb, "{\"interval\":");
+  respbuf_uint(&rb, st.interval);
+  respbuf_str(&rb, ",\"sensorinterval\":");
+  respbuf_uint(&rb, scd30_getinterval());
+  respbuf_str(&rb, ",\"levels\":[");
+  for (int i = 0; i < SAMPLING_NUMLEVELS; i++) {
+    if (i > 0) respbuf_char(&rb, ',');
+    respbuf_uint(&rb, sampling_levels[i]);
+  }
+  respbuf_str(&rb, "],\"slope\":");
+  if (st.slopevalid) {
+    respbuf_fixed(&rb, st.slope, 1);
+  } else {
+    respbuf_str(&rb, "null");
+  }
+  respbuf_str(&rb, ",\"uptime\":");
+  respbuf_uint(&rb, esp_timer_get_time() / 1000000);
+  respbuf_str(&rb, ",\"changes\":");
+  respbuf_uint(&rb, st.changes);
+  respbuf_str(&rb, ",\"decisions\":[");
+  for (int i = 0; i < st.ndecisions; i++) {
+    if (i > 0) respbuf_char(&rb, ',');
+    respbuf_str(&rb, "{\"uptime\":");
+    respbuf_uint(&rb, st.decisions[i].uptime);
+    respbuf_str(&rb, ",\"from\":");
+    respbuf_uint(&rb, st.decisions[i].from);
+    respbuf_str(&rb, ",\"to\":");
+    respbuf_uint(&rb, st.decisions[i].to);
+    respbuf_str(&rb, ",\"slope\":");
+    respbuf_fixed(&rb, st.decisions[i].slope, 1);
+    respbuf_char(&rb, '}');
+  }
+  respbuf_str(&rb, "]}");
+  return resp_end(&rb, req);
+}
+
+static httpd_uri_t uri_sampling = {
+  .uri      = "/sampling",
+  .method   = HTTP_GET,
+  .handler  = get_sampling_handler,
+  .user_ctx = NULL
+};
+
+/* Latency histograms per URI handler. Every handler is registered
+ * through webserver_register, which puts timed_handler in front of
+ * it. All of this only ever runs in the httpd task, so no locking. */
+#define URILAT_MAX 12 /* same as max_uri_handlers */
+#define URILAT_BUCKETS 10
+/* Upper bounds of all but the last bucket, in microseconds */
+static const uint32_t urilatbounds[URILAT_BUCKETS - 1] = {
+  1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000
+};
+struct urilat {
+  const char * uri;
+  httpd_method_t method;
+  esp_err_t (*handler)(httpd_req_t * req);
+  uint32_t buckets[URILAT_BUCKETS]; /* NOT cumulative */
+  uint64_t sumus;
+  uint32_t maxus;
+};
+static struct urilat urilats[URILAT_MAX];
+static int nurilats = 0;
+
+static esp_err_t timed_handler(httpd_req_t * req) {
+  struct urilat * ul = (struct urilat *)req->user_ctx;
+  int64_t start = esp_timer_get_time();
+  /* None of our handlers use user_ctx themselves. */
+  esp_err_t res = ul->handler(req);
+  uint32_t lat = esp_timer_get_time() - start;
+  int b = 0;
+  while ((b < (URILAT_BUCKETS - 1)) && (lat > urilatbounds[b])) b++;
+  ul->buckets[b]++;
+  ul->sumus += lat;
+  if (lat > ul->maxus) ul->maxus = lat;
+  return res;
+}
+
+static void webserver_register(httpd_handle_t server, const httpd_uri_t * uri) {
+  if (nurilats >= URILAT_MAX) {
+    httpd_register_uri_handler(server, uri);
+    return;
+  }
+  struct urilat * ul = &urilats[nurilats++];
+  ul->uri = uri->uri;
+  ul->method = uri->method;
+  ul->handler = uri->handler;
+  /* The httpd keeps a copy, so this can be on the stack. */
+  httpd_uri_t timed = *uri;
+  timed.handler = timed_handler;
+  timed.user_ctx = ul;
+  httpd_register_uri_handler(server, &timed);
+}
+
+/* Where the CPU time, stack and heap go, and how long requests take. */
+esp_err_t get_perf_handler(httpd_req_t * req) {
+  /* These are too large for the stack */
+  static struct perftask tasks[PERF_MAXTASKS];
+  static struct perfheapentry heaphist[PERF_HOURS];
+  struct respbuf rb;
+  struct perfheap heap;
+  struct perfheaptrend trend[2];
+  int ntasks = perf_gettasks(tasks, PERF_MAXTASKS);
+  perf_getheap(&heap);
+  perf_getheaptrend(&trend[0], &trend[1]);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  if (resp_begin(&rb, req) != 0) return ESP_OK;
+  respbuf_str(&rb, "{\"uptime\":");
+  respbuf_uint(&rb, esp_timer_get_time() / 1000000);
+  respbuf_str(&rb, ",\"heap\":{\"free\":");
+  respbuf_uint(&rb, heap.free);
+  respbuf_str(&rb, ",\"minfree\":");
+  respbuf_uint(&rb, heap.minfree);
+  respbuf_str(&rb, ",\"largestblock\":");
+  respbuf_uint(&rb, heap.largest);
+  /* The long term history: minimum free heap and minimum largest
+   * block per hour and per day, oldest first, and the trend of both
+   * in bytes per day. */
+  for (int d = 0; d < 2; d++) {
+    int n = perf_getheaphistory(d, heaphist, PERF_HOURS);
+    respbuf_str(&rb, ((d == 0) ? ",\"hourly\":{\"freeslope\":" : "},\"daily\":{\"freeslope\":"));
+    respbuf_int(&rb, trend[d].freeslope);
+    respbuf_str(&rb, ",\"largestslope\":");
+    respbuf_int(&rb, trend[d].largestslope);
+    respbuf_str(&rb, ",\"minfree\":[");
+    for (int i = 0; i < n; i++) {
+      if (i > 0) respbuf_char(&rb, ',');
+      respbuf_uint(&rb, heaphist[i].minfree);
+    }
+    respbuf_str(&rb, "],\"minlargest\":[");
+    for (int i = 0; i < n; i++) {
+      if (i > 0) respbuf_char(&rb, ',');
+      respbuf_uint(&rb, heaphist[i].minlargest);
+    }
+    respbuf_char(&rb, ']');
+  }
+  /* CPU is in percent of one core */
+  respbuf_str(&rb, "}},\"sampleperiod\":");
+  respbuf_uint(&rb, PERF_SAMPLEPERIOD);
+  respbuf_str(&rb, ",\"tasks\":[");
+  for (int i = 0; i < ntasks; i++) {
+    respbuf_str(&rb, ((i > 0) ? ",{\"name\":\"" : "{\"name\":\""));
+    respbuf_str(&rb, tasks[i].name);
+    respbuf_str(&rb, "\",\"prio\":");
+    respbuf_uint(&rb, tasks[i].prio);
+    respbuf_str(&rb, ",\"stackfree\":");
+    respbuf_uint(&rb, tasks[i].stackfree);
+    respbuf_str(&rb, ",\"cpu\":");
+    respbuf_fixed(&rb, tasks[i].cpulast, 1);
+    respbuf_str(&rb, ",\"cpuavg\":");
+    respbuf_fixed(&rb, tasks[i].cpuavg, 1);
+    respbuf_char(&rb, '}');
+  }
+  /* Latencies are in microseconds */
+  respbuf_str(&rb, "],\"latbounds\":[");
+  for (int i = 0; i < (URILAT_BUCKETS - 1); i++) {
+    if (i > 0) respbuf_char(&rb, ',');
+    respbuf_uint(&rb, urilatbounds[i]);
+  }
+  respbuf_str(&rb, "],\"handlers\":[");
+  for (int i = 0; i < nurilats; i++) {
+    struct urilat * ul = &urilats[i];
+    uint32_t count = 0;
+    respbuf_str(&rb, ((i > 0) ? ",{\"uri\":\"" : "{\"uri\":\""));
+    respbuf_str(&rb, ul->uri);
+    respbuf_str(&rb, "\",\"method\":\"");
+    respbuf_str(&rb, ((ul->method == HTTP_POST) ? "POST" : "GET"));
+    respbuf_str(&rb, "\",\"buckets\":[");
+    for (int b = 0; b < URILAT_BUCKETS; b++) {
+      if (b > 0) respbuf_char(&rb, ',');
+      respbuf_uint(&rb, ul->buckets[b]);
+      count += ul->buckets[b];
+    }
+    respbuf_str(&rb, "],\"count\":");
+    respbuf_uint(&rb, count);
+    respbuf_str(&rb, ",\"sumus\":");
+    respbuf_uint(&rb, ul->sumus);
+    respbuf_str(&rb, ",\"maxus\":");
+    respbuf_uint(&rb, ul->maxus);
+    respbuf_char(&rb, '}');
+  }
+  respbuf_str(&rb, "]}");
+  return resp_end(&rb, req);
+}
+
+static httpd_uri_t uri_perf = {
+  .uri      = "/debug/perf",
+  .method   = HTTP_GET,
+  .handler  = get_perf_handler,
+  .user_ctx = NULL
+};
+
+/* Fills in the parts of the rendercache that cannot change without
+ * a reboot. */
+static void rendercache_init(void) {
+  const esp_app_desc_t * appd = esp_ota_get_app_description();
+  rcache.bootid = esp_random();
+  snprintf(rcache.fwversion, sizeof(rcache.fwversion), "%s version %s compiled %s %s",
+           appd->project_name, appd->version, appd->date, appd->time);
+  /* The start of the SHA256 of our firmware. */
+  esp_ota_get_app_elf_sha256(rcache.assetkey, 9);
+  sprintf(rcache.assethead,
+          "<link rel=\"stylesheet\" type=\"text/css\" href=\"/static/%s/style.css\">\n"
+          "<script type=\"text/javascript\" src=\"/static/%s/app.js\" defer></script>",
+          rcache.assetkey, rcache.assetkey);
+}
+
+/* Called by the httpd for every new connection. */
+static esp_err_t webserver_sockopen(httpd_handle_t hd, int sockfd) {
+  int one = 1;
+  /* Our responses are sent as lots of small chunks. Without this,
+   * Nagle's algorithm together with delayed ACKs on the client side
+   * holds many of them back for up to 200 ms. */
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  /* Clients are allowed to keep their connection open for further
+   * requests. For those that vanish without closing it (e.g. phones
+   * leaving the WiFi) we want to notice after a minute or so, instead
+   * of wasting a socket on them forever. */
+  int idle = 30;
+  int intvl = 10;
+  int cnt = 3;
+  setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+  setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+  setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+  return ESP_OK;
+}
+
 void webserver_start(void) {
   httpd_handle_t server = NULL;
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  rendercache_init();
   /* Documentation is - as usual - a bit patchy, but I assume
    * the following drops the oldest connection if the ESP runs
    * out of connections. */
   config.lru_purge_enable = true;
   config.server_port = 80;
-  /* The default is undocumented, but seems to be only 4k. */
-  config.stack_size = 10000;
+  /* The default of 7 connections is quickly used up by a few browsers
+   * (which like to open several connections each) plus subscribers to
+   * /live, and then clients start evicting each other. LWIP_MAX_SOCKETS
+   * is 16 in sdkconfig. The httpd needs 3 of those for itself, and we
+   * leave 3 for outgoing connections (NTP, exporter, firmware update). */
+  config.max_open_sockets = 10;
+  config.backlog_conn = 8;
+  /* The httpd serves one request at a time, so a slow client stalls
+   * everyone else for up to this many seconds per send/receive. The
+   * default of 5 is a bit generous for a page this small. */
+  config.recv_wait_timeout = 3;
+  config.send_wait_timeout = 3;
+  config.open_fn = webserver_sockopen;
+  /* We have more handlers than the default of 8, and /static/
+   * needs wildcard matching. */
+  config.max_uri_handlers = 12;
+  config.uri_match_fn = httpd_uri_match_wildcard;
+  /* The default is undocumented, but seems to be only 4k.
+   * Firmware updates now run in their own task, so this only needs to
+   * be large enough for the buffers in our handlers. */
+  config.stack_size = 6144;
   ESP_LOGI("webserver.c", "Starting webserver on port %d", config.server_port);
   if (httpd_start(&server, &config) != ESP_OK) {
     ESP_LOGE("webserver.c", "Failed to start HTTP server.");
     return;
   }
-  httpd_register_uri_handler(server, &uri_startpage);
-  httpd_register_uri_handler(server, &uri_json);
-  httpd_register_uri_handler(server, &uri_fwup);
+  webserver_register(server, &uri_startpage);
+  webserver_register(server, &uri_json);
+  webserver_register(server, &uri_history);
+  webserver_register(server, &uri_metrics);
+  webserver_register(server, &uri_log);
+  webserver_register(server, &uri_fwup);
+  webserver_register(server, &uri_fwupstatus);
+  webserver_register(server, &uri_live);
+  webserver_register(server, &uri_static);
+  webserver_register(server, &uri_sampling);
+  webserver_register(server, &uri_perf);
+  liveserver = server;
+  boottime_mark(BOOT_WEBSERVERUP);
 }
 
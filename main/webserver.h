@@ -7,5 +7,9 @@
 /* Initialize and start the Webserver. */
 void webserver_start(void);
 
+/* Tell the webserver that there is a new measurement, so it can
+ * push it to everyone subscribed to /live. */
+void webserver_newdata(void);
+
 #endif /* _WEBSERVER_H_ */
 
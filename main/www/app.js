@@ -0,0 +1,75 @@
+/* JavaScript for the startpage of FoxCO2-2022: Keeps the values
+ * on the page current, using /live or (if that is not supported)
+ * by polling /json. */
+var getJSON = function(url, callback) {
+    var xhr = new XMLHttpRequest();
+    xhr.open('GET', url, true);
+    xhr.responseType = 'json';
+    xhr.onload = function() {
+      var status = xhr.status;
+      if (status === 200) {
+        callback(null, xhr.response);
+      } else {
+        callback(status, xhr.response);
+      }
+    };
+    xhr.send();
+};
+function aggrcvd(err, data) {
+  if ((err != null) || (data.agg == null)) return;
+  /* No const or for..of here, old browsers (IE11) choke on those. */
+  var vals = ['co2', 'temp', 'hum'];
+  for (var w in data.agg) {
+    for (var i = 0; i < vals.length; i++) {
+      var v = vals[i];
+      var c = document.getElementById('agg_' + w + '_' + v);
+      if (c == null) continue;
+      if (data.agg[w].n > 0) {
+        var a = data.agg[w][v];
+        c.innerHTML = a.min + ' / ' + a.mean + ' / ' + a.max;
+      } else {
+        c.innerHTML = '-';
+      }
+    }
+  }
+}
+function updrcvd(err, data) {
+  if (err != null) {
+    document.getElementById("ts").innerHTML = "---";
+    document.getElementById("co2").innerHTML = "----";
+    document.getElementById("temp").innerHTML = "--.--";
+    document.getElementById("hum").innerHTML = "--.-";
+  } else {
+    document.getElementById("ts").innerHTML = data.ts;
+    document.getElementById("co2").innerHTML = data.co2;
+    document.getElementById("temp").innerHTML = data.temp;
+    document.getElementById("hum").innerHTML = data.hum;
+  }
+}
+function updatethings() {
+  getJSON('/json?agg=1', function(err, data) { updrcvd(err, data); aggrcvd(err, data); });
+}
+var myrefresher = null;
+if (typeof(EventSource) !== "undefined") {
+  /* The server pushes every new measurement to us */
+  var mylive = new EventSource('/live');
+  mylive.onmessage = function(ev) {
+    updrcvd(null, JSON.parse(ev.data));
+  };
+  /* The aggregates come right after every measurement as well. */
+  mylive.addEventListener('agg', function(ev) {
+    aggrcvd(null, { agg: JSON.parse(ev.data) });
+  });
+  mylive.onerror = function() {
+    updrcvd(1, null);
+    /* Usually the browser reconnects by itself. But if the server
+     * refused us (e.g. because it has too many live subscribers),
+     * it gives up for good, so we fall back to polling. */
+    if ((mylive.readyState === EventSource.CLOSED) && (myrefresher == null)) {
+      updatethings();
+      myrefresher = setInterval(updatethings, 30000);
+    }
+  };
+} else {
+  myrefresher = setInterval(updatethings, 30000);
+}
@@ -0,0 +1,15 @@
+#!/usr/bin/env python3
+# Gzips a file for embedding into the firmware.
+# Usage: compress.py <infile> <outfile>
+# Unlike the gzip commandline tool, this is available everywhere ESP-IDF
+# is, and with mtime=0 the output only depends on the input, so the
+# firmware does not change with every build.
+import gzip
+import sys
+
+with open(sys.argv[1], 'rb') as inf:
+    data = inf.read()
+with open(sys.argv[2], 'wb') as outf:
+    with gzip.GzipFile(filename='', mode='wb', compresslevel=9,
+                       fileobj=outf, mtime=0) as gzf:
+        gzf.write(data)
@@ -0,0 +1,275 @@
+#!/usr/bin/env python3
+# Serves a firmware image for /firmwareupdate the way a bad connection
+# would: supports Range requests like a proper webserver, but drops
+# connections at random in the middle of the image. Can also ignore
+# Range, and replace the image while a download is running, so every
+# path of the resuming download in main/fwupdate.c can be tried out.
+#
+#   ./fwserve.py build/foxco2-2022.bin        serve on port 8070
+#   ./fwserve.py -D 0.5 build/foxco2-2022.bin drop half the connections
+#   ./fwserve.py --norange ...                always send the whole image
+#   ./fwserve.py --change 3 ...               after 3 requests, serve a
+#                                             larger image instead
+#   ./fwserve.py --selftest                   download from ourselves the
+#                                             way fwupdate.c does
+
+import argparse
+import hashlib
+import http.client
+import http.server
+import random
+import re
+import socketserver
+import sys
+import threading
+
+DEFAULTPORT = 8070
+# Same as in fwupdate.c, SPI_FLASH_SEC_SIZE and FWUPBUFSIZE
+SECSIZE = 4096
+BUFSIZE = 4096
+MAXFAILS = 20
+
+
+class ImageServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+    def __init__(self, addr, image, droprate=0.0, dropfirst=0, norange=False,
+                 change=0, seed=None, quiet=False):
+        super().__init__(addr, ImageHandler)
+        self.image = image
+        self.droprate = droprate
+        self.dropfirst = dropfirst
+        self.norange = norange
+        self.change = change
+        self.quiet = quiet
+        self.rng = random.Random(seed)
+        self.lock = threading.Lock()
+        self.requests = 0
+        self.drops = 0
+        self.statuses = {200: 0, 206: 0, 416: 0}
+
+    def log(self, msg):
+        if not self.quiet:
+            print(msg, flush=True)
+
+    def handle_error(self, request, client_address):
+        # Clients that give up on a reply close the connection on us,
+        # that is nothing to print a traceback for.
+        if not isinstance(sys.exc_info()[1], OSError):
+            super().handle_error(request, client_address)
+
+    def nextrequest(self):
+        """Counts a request, and returns the image to serve for it and
+        how far into it to drop the connection, as a random number
+        between 0 and 1 (None = don't)."""
+        with self.lock:
+            self.requests += 1
+            if (self.change > 0) and (self.requests == self.change + 1):
+                # As if someone uploaded a new build in the meantime.
+                self.image = self.image + bytes(self.rng.getrandbits(8) for _ in range(SECSIZE + 123))
+                self.log("image replaced, now %d bytes, sha256 %s"
+                         % (len(self.image), hashlib.sha256(self.image).hexdigest()))
+            drop = None
+            if (self.requests <= self.dropfirst) or (self.rng.random() < self.droprate):
+                self.drops += 1
+                drop = self.rng.random()
+            return self.image, drop
+
+
+class ImageHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        pass
+
+    def do_GET(self):
+        srv = self.server
+        image, drop = srv.nextrequest()
+        start = 0
+        rh = self.headers.get("Range")
+        m = re.match(r"bytes=(\d+)-$", rh or "")
+        if (m is not None) and not srv.norange:
+            start = int(m.group(1))
+            if start >= len(image):
+                with srv.lock:
+                    srv.statuses[416] += 1
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(image))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                srv.log("GET %s -> 416" % rh)
+                return
+            status = 206
+            self.send_response(status)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, len(image) - 1, len(image)))
+        else:
+            status = 200
+            self.send_response(status)
+        with srv.lock:
+            srv.statuses[status] += 1
+        body = image[start:]
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if drop is not None:
+            # Somewhere in the middle, so there is something to resume.
+            cut = int(len(body) * (0.25 + drop / 2))
+            srv.log("GET %s -> %d, dropping after %d of %d bytes" % (rh, status, cut, len(body)))
+            try:
+                self.wfile.write(body[:cut])
+                self.wfile.flush()
+            except OSError:
+                pass
+            self.close_connection = True
+            return
+        srv.log("GET %s -> %d, %d bytes" % (rh, status, len(body)))
+        try:
+            self.wfile.write(body)
+        except OSError:
+            self.close_connection = True
+
+
+class Download:
+    """Does what fwupdate_download() and fwupdatetask() in fwupdate.c
+    do, against a 'flash' in a bytearray, and counts which way they
+    went."""
+
+    def __init__(self, host, port, path, partsize):
+        self.host = host
+        self.port = port
+        self.path = path
+        self.flash = bytearray(b"\xff" * partsize)
+        self.offset = 0
+        self.size = 0
+        self.resumes = 0
+        self.restarts = 0
+        self.sizechanges = 0
+
+    def attempt(self):
+        self.offset -= self.offset % SECSIZE
+        headers = {}
+        if self.offset > 0:
+            headers["Range"] = "bytes=%d-" % self.offset
+        conn = http.client.HTTPConnection(self.host, self.port, timeout=10)
+        try:
+            conn.request("GET", self.path, headers=headers)
+            resp = conn.getresponse()
+            contlen = int(resp.getheader("Content-Length", "-1"))
+            rangestart = -1
+            cr = resp.getheader("Content-Range")
+            if (cr is not None) and (" " in cr):
+                rangestart = int(re.match(r"\d+", cr.split(" ", 1)[1]).group(0))
+            if (resp.status == 206) and (rangestart == self.offset) and (contlen > 0):
+                if (self.size > 0) and (self.size != self.offset + contlen):
+                    self.sizechanges += 1
+                    self.offset = 0
+                    self.size = 0
+                    return False
+                self.resumes += 1
+                self.size = self.offset + contlen
+            elif (resp.status == 200) and (contlen > 0):
+                if self.offset > 0:
+                    self.restarts += 1
+                self.offset = 0
+                self.size = contlen
+            else:
+                return False
+            if self.size > len(self.flash):
+                # fwupdate.c gives up for good then, so do we
+                raise ValueError("image larger than the partition")
+            while self.offset < self.size:
+                toread = min(self.size - self.offset, SECSIZE - (self.offset % SECSIZE), BUFSIZE)
+                try:
+                    data = resp.read(toread)
+                except (OSError, http.client.HTTPException):
+                    data = b""
+                if not data:
+                    return False
+                if (self.offset % SECSIZE) == 0:
+                    self.flash[self.offset:self.offset + SECSIZE] = b"\xff" * SECSIZE
+                self.flash[self.offset:self.offset + len(data)] = data
+                self.offset += len(data)
+            return True
+        except (OSError, http.client.HTTPException):
+            return False
+        finally:
+            conn.close()
+
+    def run(self):
+        fails = 0
+        while fails < MAXFAILS:
+            before = self.offset
+            try:
+                done = self.attempt()
+            except ValueError:
+                return None
+            if done:
+                return hashlib.sha256(self.flash[:self.size]).hexdigest()
+            fails = 0 if self.offset > before else fails + 1
+        return None
+
+
+def selftest():
+    rng = random.Random(1)
+    base = bytes(rng.getrandbits(8) for _ in range(300 * 1024 + 17))
+    # name, server settings, and what has to have happened
+    cases = [
+        ("resume", dict(droprate=0.3, dropfirst=3),
+         lambda d, s: (d.resumes >= 3) and (s.statuses[206] >= 3)),
+        ("norange", dict(droprate=0.3, dropfirst=2, norange=True),
+         lambda d, s: (d.restarts >= 2) and (s.statuses[206] == 0)),
+        ("sizechange", dict(dropfirst=1, change=1),
+         lambda d, s: (d.sizechanges == 1) and (len(s.image) > len(base))),
+    ]
+    ok = True
+    for name, settings, check in cases:
+        srv = ImageServer(("127.0.0.1", 0), base, seed=2, quiet=True, **settings)
+        threading.Thread(target=srv.serve_forever, daemon=True).start()
+        dl = Download("127.0.0.1", srv.server_address[1], "/fw.bin", 1024 * 1024)
+        got = dl.run()
+        srv.shutdown()
+        srv.server_close()
+        want = hashlib.sha256(srv.image).hexdigest()
+        good = (got == want) and check(dl, srv)
+        print("%-10s %s: %d requests, %d dropped, %d resumed, %d restarted, %d size changes, sha256 %s"
+              % (name, "ok" if good else "FAILED", srv.requests, srv.drops, dl.resumes,
+                 dl.restarts, dl.sizechanges, "matches" if got == want else "MISMATCH"))
+        ok = ok and good
+    print("selftest %s" % ("passed" if ok else "FAILED"))
+    return 0 if ok else 1
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Serve a firmware image over a flaky connection")
+    ap.add_argument("image", nargs="?", help="the firmware image, e.g. build/foxco2-2022.bin")
+    ap.add_argument("-p", "--port", type=int, default=DEFAULTPORT)
+    ap.add_argument("-D", "--drop", type=float, default=0.2,
+                    help="probability that a connection is dropped in the middle")
+    ap.add_argument("--dropfirst", type=int, default=0,
+                    help="always drop the first this many connections")
+    ap.add_argument("--norange", action="store_true",
+                    help="ignore Range and always send the whole image")
+    ap.add_argument("--change", type=int, default=0,
+                    help="replace the image with a larger one after this many requests")
+    ap.add_argument("--selftest", action="store_true",
+                    help="download from ourselves the way the firmware does")
+    args = ap.parse_args()
+    if args.selftest:
+        return selftest()
+    if args.image is None:
+        ap.error("need an image to serve (or --selftest)")
+    with open(args.image, "rb") as f:
+        image = f.read()
+    srv = ImageServer(("0.0.0.0", args.port), image, droprate=args.drop,
+                      dropfirst=args.dropfirst, norange=args.norange, change=args.change)
+    print("Serving %d bytes on port %d, sha256 %s"
+          % (len(image), args.port, hashlib.sha256(image).hexdigest()), flush=True)
+    try:
+        srv.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,292 @@
+#!/usr/bin/env python3
+# Stand-in for the InfluxDB the sensors push to when FCO2_INFLUXURL is
+# set in secrets.h (see main/exporter.c). Accepts line protocol on
+# /api/v2/write (or any path ending in /write), prints it, and notices
+# duplicates and malformed lines. It can also go down for a while
+# every now and then, so the sensors have to queue and backfill.
+# With --sensor, it compares what it received with the exporter
+# counters the sensor reports on /metrics.
+#
+#   ./influxstandin.py                        listen on port 8086
+#   ./influxstandin.py --up 300 --down 120    refuse writes for 2 of
+#                                             every 7 minutes
+#   ./influxstandin.py --sensor http://192.168.1.50 ...
+#                                             also check the sensor's
+#                                             sent/dropped counters
+#   ./influxstandin.py --selftest             push to ourselves with
+#                                             the queue logic of exporter.c
+
+import argparse
+import http.client
+import http.server
+import re
+import socketserver
+import sys
+import threading
+import time
+import urllib.parse
+
+DEFAULTPORT = 8086
+# What exporter.c sends, e.g.
+# co2,sensor=foxco2-a1b2c3 co2=612i,temp=21.46,hum=40.3 1700000000
+LINERE = re.compile(r"co2,sensor=(\S+) co2=(\d+)i,temp=(-?\d+\.\d\d),hum=(\d+\.\d) (\d+)$")
+
+
+class Store:
+    """Everything received, per sensor."""
+
+    def __init__(self, quiet=False):
+        self.lock = threading.Lock()
+        self.quiet = quiet
+        self.points = {}  # sensor -> list of timestamps, in arrival order
+        self.seen = {}    # sensor -> set of timestamps
+        self.duplicates = 0
+        self.malformed = 0
+        self.posts = 0
+        self.refused = 0
+
+    def add(self, body):
+        with self.lock:
+            self.posts += 1
+            for line in body.decode("utf-8", "replace").splitlines():
+                if not line:
+                    continue
+                m = LINERE.match(line)
+                if m is None:
+                    self.malformed += 1
+                    print("malformed: %r" % line, flush=True)
+                    continue
+                sensor, ts = m.group(1), int(m.group(5))
+                if ts in self.seen.setdefault(sensor, set()):
+                    self.duplicates += 1
+                else:
+                    self.seen[sensor].add(ts)
+                    self.points.setdefault(sensor, []).append(ts)
+                if not self.quiet:
+                    print(line, flush=True)
+
+    def received(self, sensor=None):
+        with self.lock:
+            if sensor is not None:
+                return len(self.seen.get(sensor, ()))
+            return sum(len(s) for s in self.seen.values())
+
+
+class Outages:
+    """Up for 'up' seconds, then down for 'down' seconds, and so on."""
+
+    def __init__(self, up, down):
+        self.up = up
+        self.down = down
+        self.start = time.monotonic()
+
+    def isdown(self):
+        if self.down <= 0:
+            return False
+        return ((time.monotonic() - self.start) % (self.up + self.down)) >= self.up
+
+
+class WriteHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        pass
+
+    def reply(self, status):
+        self.send_response(status)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def do_POST(self):
+        srv = self.server
+        body = self.rfile.read(int(self.headers.get("Content-Length", "0")))
+        if not urllib.parse.urlsplit(self.path).path.endswith("/write"):
+            self.reply(404)
+            return
+        if srv.outages.isdown():
+            with srv.store.lock:
+                srv.store.refused += 1
+            self.reply(503)
+            return
+        srv.store.add(body)
+        # Like InfluxDB 2.x
+        self.reply(204)
+
+
+class StandinServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+    def __init__(self, addr, store, outages):
+        super().__init__(addr, WriteHandler)
+        self.store = store
+        self.outages = outages
+
+
+def sensorcounters(url):
+    """Returns the exporter counters from /metrics of a sensor."""
+    u = urllib.parse.urlsplit(url if "//" in url else "http://" + url)
+    conn = http.client.HTTPConnection(u.hostname, u.port or 80, timeout=10)
+    try:
+        conn.request("GET", "/metrics")
+        text = conn.getresponse().read().decode()
+    finally:
+        conn.close()
+    res = {}
+    for name in ("sent_total", "dropped_total", "queue_depth"):
+        m = re.search(r"^foxco2_exporter_%s (\d+)$" % name, text, re.M)
+        res[name] = int(m.group(1)) if m else None
+    return res
+
+
+class Exporter:
+    """The queue of exporter.c: exporter_add, exporter_formatbatch and
+    exporter_consume, with a smaller queue. Also remembers what it
+    dropped, so the selftest can check against it."""
+
+    def __init__(self, qsize, batchsize):
+        self.lock = threading.Lock()
+        self.qsize = qsize
+        self.batchsize = batchsize
+        self.queue = []
+        self.sent = 0
+        self.dropped = 0
+        self.droppedts = set()
+        self.batchdropped = 0
+        self.wake = threading.Event()
+
+    def add(self, ts):
+        with self.lock:
+            if len(self.queue) >= self.qsize:
+                self.droppedts.add(self.queue.pop(0))
+                self.dropped += 1
+            self.queue.append(ts)
+        self.wake.set()
+
+    def formatbatch(self, sensor):
+        with self.lock:
+            batch = self.queue[:self.batchsize]
+            self.batchdropped = self.dropped
+        return len(batch), "".join("co2,sensor=%s co2=%di,temp=21.46,hum=40.3 %d\n"
+                                   % (sensor, 400 + (ts % 1000), ts) for ts in batch)
+
+    def consume(self, n):
+        with self.lock:
+            self.sent += n
+            gone = self.dropped - self.batchdropped
+            n = max(0, n - gone)
+            del self.queue[:n]
+
+    def task(self, port, sensor, stop):
+        while not (stop.is_set() and not self.queue):
+            self.wake.wait(0.02)
+            self.wake.clear()
+            while True:
+                n, body = self.formatbatch(sensor)
+                if n == 0:
+                    break
+                conn = http.client.HTTPConnection("127.0.0.1", port, timeout=5)
+                try:
+                    conn.request("POST", "/api/v2/write?precision=s", body=body.encode())
+                    status = conn.getresponse().status
+                except OSError:
+                    status = 0
+                finally:
+                    conn.close()
+                if not (200 <= status <= 299):
+                    break
+                self.consume(n)
+
+
+def selftest():
+    """Pushes measurements through the exporter queue to a stand-in
+    that keeps going down, long enough for the queue to overflow, and
+    checks that everything arrives exactly once, in order, except what
+    was counted as dropped."""
+    store = Store(quiet=True)
+    srv = StandinServer(("127.0.0.1", 0), store, Outages(0.4, 0.3))
+    threading.Thread(target=srv.serve_forever, daemon=True).start()
+    exp = Exporter(qsize=64, batchsize=10)
+    stop = threading.Event()
+    sender = threading.Thread(target=exp.task, args=(srv.server_address[1], "foxco2-selftest", stop))
+    sender.start()
+    produced = list(range(1700000000, 1700000000 + 1000))
+    for ts in produced:
+        exp.add(ts)
+        time.sleep(0.002)
+    # Wait for the last outage to be over and the backfill to be sent.
+    stop.set()
+    sender.join(timeout=30)
+    srv.shutdown()
+    srv.server_close()
+    got = store.points.get("foxco2-selftest", [])
+    missing = set(produced) - set(got)
+    checks = [
+        ("queue overflowed", exp.dropped > 0),
+        ("writes were refused", store.refused > 0),
+        ("no duplicates", store.duplicates == 0),
+        ("no malformed lines", store.malformed == 0),
+        ("in order", got == sorted(got)),
+        ("everything missing was counted as dropped", missing <= exp.droppedts),
+        ("dropped count matches", exp.dropped == len(exp.droppedts)),
+        ("sent count matches", exp.sent == len(got)),
+        ("queue empty", not exp.queue),
+    ]
+    print("produced %d, received %d in %d posts, %d refused, %d dropped"
+          % (len(produced), len(got), store.posts, store.refused, exp.dropped))
+    ok = True
+    for name, good in checks:
+        print("%-42s %s" % (name, "ok" if good else "FAILED"))
+        ok = ok and good
+    print("selftest %s" % ("passed" if ok else "FAILED"))
+    return 0 if ok else 1
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Stand-in for the InfluxDB foxco2 sensors push to")
+    ap.add_argument("-p", "--port", type=int, default=DEFAULTPORT)
+    ap.add_argument("--up", type=float, default=300,
+                    help="seconds to accept writes between outages")
+    ap.add_argument("--down", type=float, default=0,
+                    help="seconds every outage lasts (default: no outages)")
+    ap.add_argument("--sensor", help="URL of a sensor, to compare with its /metrics")
+    ap.add_argument("-i", "--interval", type=float, default=60,
+                    help="seconds between summaries")
+    ap.add_argument("-q", "--quiet", action="store_true", help="don't print every line")
+    ap.add_argument("--selftest", action="store_true",
+                    help="push to ourselves through the queue logic of exporter.c")
+    args = ap.parse_args()
+    if args.selftest:
+        return selftest()
+    store = Store(quiet=args.quiet)
+    outages = Outages(args.up, args.down)
+    srv = StandinServer(("0.0.0.0", args.port), store, outages)
+    threading.Thread(target=srv.serve_forever, daemon=True).start()
+    print("Listening on port %d" % args.port, flush=True)
+    # The sensor has been counting since it booted, so we can only
+    # compare what changed since we started.
+    first = sensorcounters(args.sensor) if args.sensor else None
+    try:
+        while True:
+            time.sleep(args.interval)
+            with store.lock:
+                summary = ("%d points from %d sensors in %d posts, %d refused, %d duplicates, %d malformed"
+                           % (sum(len(s) for s in store.seen.values()), len(store.seen),
+                              store.posts, store.refused, store.duplicates, store.malformed))
+            print(summary, flush=True)
+            if first is not None:
+                now = sensorcounters(args.sensor)
+                if None in now.values():
+                    print("sensor: no exporter counters on /metrics", flush=True)
+                    continue
+                sent = now["sent_total"] - first["sent_total"]
+                print("sensor: %d sent, %d dropped, %d queued since we started%s"
+                      % (sent, now["dropped_total"] - first["dropped_total"], now["queue_depth"],
+                         "" if sent == store.received() else
+                         " - but we received %d!" % store.received()), flush=True)
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,350 @@
+#!/usr/bin/env python3
+# Load test for the webserver of a sensor: Many clients at once, each
+# with its own keep-alive connection, request /, /json, /history and
+# /metrics in a loop, while a few more hang on /live like open
+# browser tabs would. Reports p50/p99 latency and requests per second
+# for each path, and how often connections had to be reopened.
+#
+#   ./loadtest.py http://192.168.1.50         test a sensor
+#   ./loadtest.py -c 16 -d 60 http://...      16 clients for a minute
+#   ./loadtest.py --standin                   test a local stand-in
+#                                             that behaves like one,
+#                                             to check the harness
+
+import argparse
+import http.client
+import http.server
+import json
+import socket
+import socketserver
+import sys
+import threading
+import time
+import urllib.parse
+
+PATHS = ["/", "/json", "/history", "/metrics"]
+
+
+def percentile(sortedvals, q):
+    if not sortedvals:
+        return float("nan")
+    return sortedvals[min(len(sortedvals) - 1, int(q * len(sortedvals)))]
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.lat = {p: [] for p in PATHS}
+        self.errors = {p: 0 for p in PATHS}
+        self.notmodified = {p: 0 for p in PATHS}
+        self.bytes = 0
+        self.connects = 0
+        self.liveok = 0
+        self.liverefused = 0
+        self.liveerrors = 0
+        self.liveevents = 0
+        self.livefirst = []
+
+    def add(self, path, lat, nbytes, status):
+        with self.lock:
+            if status == 304:
+                self.notmodified[path] += 1
+            self.lat[path].append(lat)
+            self.bytes += nbytes
+
+
+class Client(threading.Thread):
+    """Requests all PATHS in turn over one keep-alive connection, and
+    only opens a new one if the server closed it."""
+
+    def __init__(self, host, port, stats, stop, idx, conditional):
+        super().__init__(daemon=True)
+        self.host = host
+        self.port = port
+        self.stats = stats
+        self.stop = stop
+        self.idx = idx
+        self.conditional = conditional
+        self.etags = {}
+        self.conn = None
+
+    def connect(self):
+        self.conn = http.client.HTTPConnection(self.host, self.port, timeout=10)
+        with self.stats.lock:
+            self.stats.connects += 1
+
+    def run(self):
+        n = self.idx  # so not everyone hits the same path at once
+        while not self.stop.is_set():
+            path = PATHS[n % len(PATHS)]
+            n += 1
+            if self.conn is None:
+                self.connect()
+            headers = {}
+            if self.conditional and (path in self.etags):
+                headers["If-None-Match"] = self.etags[path]
+            start = time.monotonic()
+            try:
+                self.conn.request("GET", path, headers=headers)
+                resp = self.conn.getresponse()
+                body = resp.read()
+                lat = time.monotonic() - start
+            except (OSError, http.client.HTTPException):
+                with self.stats.lock:
+                    self.stats.errors[path] += 1
+                self.conn.close()
+                self.conn = None
+                continue
+            if resp.status not in (200, 304):
+                with self.stats.lock:
+                    self.stats.errors[path] += 1
+            else:
+                self.stats.add(path, lat, len(body), resp.status)
+                etag = resp.getheader("ETag")
+                if etag is not None:
+                    self.etags[path] = etag
+            if resp.will_close:
+                self.conn.close()
+                self.conn = None
+        if self.conn is not None:
+            self.conn.close()
+
+
+class LiveClient(threading.Thread):
+    """Subscribes to /live and counts the events that arrive. This
+    reads from the socket itself, as http.client cannot cope with
+    timeouts in the middle of a chunked response."""
+
+    def __init__(self, host, port, stats, stop):
+        super().__init__(daemon=True)
+        self.host = host
+        self.port = port
+        self.stats = stats
+        self.stop = stop
+
+    def run(self):
+        start = time.monotonic()
+        try:
+            sock = socket.create_connection((self.host, self.port), timeout=10)
+        except OSError:
+            with self.stats.lock:
+                self.stats.liveerrors += 1
+            return
+        try:
+            sock.sendall(b"GET /live HTTP/1.1\r\nHost: %s\r\n"
+                         b"Accept: text/event-stream\r\n\r\n" % self.host.encode())
+            buf = b""
+            while b"\r\n\r\n" not in buf:
+                data = sock.recv(1500)
+                if not data:
+                    raise OSError("connection closed")
+                buf += data
+            head, buf = buf.split(b"\r\n\r\n", 1)
+            status = int(head.split(b" ", 2)[1])
+            if status == 503:
+                with self.stats.lock:
+                    self.stats.liverefused += 1
+                return
+            if status != 200:
+                with self.stats.lock:
+                    self.stats.liveerrors += 1
+                return
+            with self.stats.lock:
+                self.stats.liveok += 1
+            sock.settimeout(0.5)
+            first = True
+            while not self.stop.is_set():
+                # Every event has exactly one data line. Keep the end of
+                # the buffer, in case one is split between two reads.
+                n = buf.count(b"\ndata:") + (1 if buf.startswith(b"data:") else 0)
+                if n > 0:
+                    with self.stats.lock:
+                        self.stats.liveevents += n
+                        if first:
+                            self.stats.livefirst.append(time.monotonic() - start)
+                    first = False
+                    buf = buf[buf.rindex(b"data:") + 5:]
+                buf = buf[-8:]
+                try:
+                    data = sock.recv(1500)
+                except socket.timeout:
+                    continue
+                if not data:
+                    break
+                buf += data
+        except (OSError, ValueError, IndexError):
+            with self.stats.lock:
+                self.stats.liveerrors += 1
+        finally:
+            sock.close()
+
+
+def report(stats, duration):
+    total = 0
+    print("%-10s %8s %7s %6s %9s %9s %9s %8s"
+          % ("path", "requests", "errors", "304s", "p50 ms", "p99 ms", "max ms", "req/s"))
+    for p in PATHS:
+        lat = sorted(stats.lat[p])
+        total += len(lat)
+        print("%-10s %8d %7d %6d %9.1f %9.1f %9.1f %8.1f"
+              % (p, len(lat), stats.errors[p], stats.notmodified[p],
+                 percentile(lat, 0.5) * 1000, percentile(lat, 0.99) * 1000,
+                 (lat[-1] if lat else float("nan")) * 1000, len(lat) / duration))
+    alllat = sorted(sum(stats.lat.values(), []))
+    print("%-10s %8d %7d %6s %9.1f %9.1f %9.1f %8.1f"
+          % ("all", total, sum(stats.errors.values()), "",
+             percentile(alllat, 0.5) * 1000, percentile(alllat, 0.99) * 1000,
+             (alllat[-1] if alllat else float("nan")) * 1000, total / duration))
+    print("%d connections opened for %d requests, %.1f KB/s"
+          % (stats.connects, total, stats.bytes / 1024.0 / duration))
+    first = sorted(stats.livefirst)
+    print("/live: %d subscribed, %d refused, %d failed, %d events, first event after %.1f ms (p50)"
+          % (stats.liveok, stats.liverefused, stats.liveerrors, stats.liveevents,
+             percentile(first, 0.5) * 1000))
+    return total
+
+
+def loadtest(url, clients, live, duration, conditional):
+    u = urllib.parse.urlsplit(url if "//" in url else "http://" + url)
+    host = u.hostname
+    port = u.port or 80
+    stats = Stats()
+    stop = threading.Event()
+    threads = [LiveClient(host, port, stats, stop) for _ in range(live)]
+    threads += [Client(host, port, stats, stop, i, conditional) for i in range(clients)]
+    print("%d clients and %d /live subscribers against %s:%d for %d seconds"
+          % (clients, live, host, port, duration), flush=True)
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    time.sleep(duration)
+    stop.set()
+    for t in threads:
+        t.join(timeout=15)
+    return stats, time.monotonic() - start
+
+
+class StandinHandler(http.server.BaseHTTPRequestHandler):
+    """Answers like a sensor does, with similar sizes and limits."""
+    protocol_version = "HTTP/1.1"
+    disable_nagle_algorithm = True  # the ESP32 does not delay either
+    livesubs = 0
+    livelock = threading.Lock()
+    LIVEMAX = 4
+
+    def log_message(self, format, *args):
+        pass
+
+    def values(self):
+        return {"ts": int(time.time()), "co2": "612", "temp": "21.46", "hum": "40.3"}
+
+    def send(self, ctype, body, etag=None):
+        if (etag is not None) and (self.headers.get("If-None-Match") == etag):
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        self.send_response(200)
+        self.send_header("Content-Type", ctype)
+        self.send_header("Content-Length", str(len(body)))
+        if etag is not None:
+            self.send_header("ETag", etag)
+        self.end_headers()
+        self.wfile.write(body)
+
+    def chunk(self, data):
+        self.wfile.write(b"%x\r\n%s\r\n" % (len(data), data))
+
+    def do_GET(self):
+        etag = '"%x"' % (int(time.time()) // 10)
+        if self.path == "/":
+            self.send("text/html", b"<html>" + b"x" * 2400 + b"</html>", etag)
+        elif self.path == "/json":
+            self.send("application/json", json.dumps(self.values()).encode(), etag)
+        elif self.path == "/metrics":
+            self.send("text/plain", b"foxco2_metric 1\n" * 250)
+        elif self.path == "/history":
+            self.send_response(200)
+            self.send_header("Content-Type", "application/json")
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            for i in range(8):
+                self.chunk(b"[1700000000,612,21.46,40.3]," * 36)
+            self.chunk(b"[]")
+            self.chunk(b"")
+        elif self.path == "/live":
+            self.live()
+        else:
+            self.send_error(404)
+
+    def live(self):
+        cls = StandinHandler
+        with cls.livelock:
+            if cls.livesubs >= cls.LIVEMAX:
+                self.send_response(503)
+                self.send_header("Retry-After", "60")
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            cls.livesubs += 1
+        try:
+            self.send_response(200)
+            self.send_header("Content-Type", "text/event-stream")
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            seq = 0
+            while True:
+                seq += 1
+                self.chunk(b"id: %d\ndata: %s\n\n" % (seq, json.dumps(self.values()).encode()))
+                self.wfile.flush()
+                time.sleep(1)
+        except OSError:
+            pass
+        finally:
+            with cls.livelock:
+                cls.livesubs -= 1
+            self.close_connection = True
+
+
+class StandinServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Load test the webserver of a foxco2 sensor")
+    ap.add_argument("url", nargs="?", help="e.g. http://192.168.1.50")
+    ap.add_argument("-c", "--clients", type=int, default=8,
+                    help="number of concurrent keep-alive clients")
+    ap.add_argument("-l", "--live", type=int, default=2,
+                    help="number of /live subscribers")
+    ap.add_argument("-d", "--duration", type=int, default=20,
+                    help="how long to run, in seconds")
+    ap.add_argument("--conditional", action="store_true",
+                    help="send If-None-Match like browsers do, so / and /json may be 304s")
+    ap.add_argument("--standin", action="store_true",
+                    help="run against a local stand-in for a sensor")
+    args = ap.parse_args()
+    if args.standin:
+        srv = StandinServer(("127.0.0.1", 0), StandinHandler)
+        threading.Thread(target=srv.serve_forever, daemon=True).start()
+        url = "http://127.0.0.1:%d" % srv.server_address[1]
+    elif args.url is None:
+        ap.error("need the URL of a sensor (or --standin)")
+    else:
+        url = args.url
+    stats, duration = loadtest(url, args.clients, args.live, args.duration, args.conditional)
+    total = report(stats, duration)
+    if args.standin:
+        # Against the stand-in, everything has to work.
+        ok = ((total > 0) and (sum(stats.errors.values()) == 0)
+              and (stats.liveok == min(args.live, StandinHandler.LIVEMAX))
+              and (stats.liverefused == max(0, args.live - StandinHandler.LIVEMAX))
+              and ((args.live == 0) or (stats.liveevents > 0)))
+        print("stand-in run %s" % ("passed" if ok else "FAILED"))
+        return 0 if ok else 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
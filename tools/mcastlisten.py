@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+# Reference receiver for the measurement datagrams the sensors send
+# when FCO2_MCASTGROUP is set in secrets.h. The format is described in
+# main/mcast.h. Prints every measurement, and notices missed ones
+# (gaps in the sequence numbers) and reboots (new boot id).
+#
+#   ./mcastlisten.py 239.255.42.2           listen on the default port
+#   ./mcastlisten.py --selftest             send test datagrams to
+#                                           ourselves over loopback
+
+import argparse
+import socket
+import struct
+import sys
+import threading
+import time
+
+MAGIC = b"FCO2"
+# Version 1 header and values, see mcast.h
+DGFORMAT = ">4sBB6sIIIHhHH"
+DGLEN = struct.calcsize(DGFORMAT)
+DEFAULTPORT = 5612
+
+
+class Sensor:
+    def __init__(self, bootid, seq):
+        self.bootid = bootid
+        self.lastseq = seq
+        self.received = 1
+        self.lost = 0
+
+
+class Collector:
+    def __init__(self, quiet=False):
+        self.sensors = {}
+        self.quiet = quiet
+
+    def log(self, msg):
+        if not self.quiet:
+            print(msg, flush=True)
+
+    def handle(self, data, addr):
+        if (len(data) < DGLEN) or (data[0:4] != MAGIC):
+            self.log("%s: not one of ours, ignored" % addr[0])
+            return None
+        (magic, version, flags, mac, bootid, seq, ts,
+         co2, temp, hum, interval) = struct.unpack(DGFORMAT, data[:DGLEN])
+        if version != 1:
+            # Later versions only append fields, so we could parse
+            # them, but the meaning of flags might have changed.
+            self.log("%s: unknown version %d, ignored" % (addr[0], version))
+            return None
+        macstr = mac.hex(":")
+        s = self.sensors.get(macstr)
+        if (s is None) or (s.bootid != bootid):
+            if s is not None:
+                self.log("%s rebooted" % macstr)
+            s = Sensor(bootid, seq)
+            self.sensors[macstr] = s
+        else:
+            if seq <= s.lastseq:
+                self.log("%s: duplicate or reordered datagram %d" % (macstr, seq))
+                return s
+            if seq > (s.lastseq + 1):
+                missed = seq - s.lastseq - 1
+                s.lost += missed
+                self.log("%s: missed %d measurement(s) before %d" % (macstr, missed, seq))
+            s.lastseq = seq
+            s.received += 1
+        tsstr = time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(ts)) if (flags & 1) else "no time"
+        self.log("%s seq %d %s: CO2 %d ppm, %.2f C, %.1f %% (next in %d s)"
+                 % (macstr, seq, tsstr, co2, temp / 100.0, hum / 10.0, interval))
+        return s
+
+
+def opensocket(group, port, iface):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", port))
+    if group is not None:
+        mreq = socket.inet_aton(group) + socket.inet_aton(iface)
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+    return sock
+
+
+def selftest(port):
+    """Sends datagrams from two fake sensors over loopback, dropping
+    some on purpose, and checks that exactly those are reported lost."""
+    sock = opensocket(None, port, "0.0.0.0")
+    sock.settimeout(2)
+    coll = Collector(quiet=True)
+    drop = {1: {3, 4, 10}, 2: {7}}
+    count = 20
+
+    def sender():
+        out = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        for seq in range(1, count + 1):
+            for sensor in (1, 2):
+                if seq in drop[sensor]:
+                    continue
+                dg = struct.pack(DGFORMAT, MAGIC, 1, 1,
+                                 bytes([2, 0, 0, 0, 0, sensor]), 0x1234 + sensor,
+                                 seq, int(time.time()), 400 + seq, 2150, 455, 55)
+                out.sendto(dg, ("127.0.0.1", port))
+            time.sleep(0.001)
+
+    t = threading.Thread(target=sender)
+    t.start()
+    received = 0
+    try:
+        while received < ((2 * count) - 4):
+            data, addr = sock.recvfrom(1500)
+            coll.handle(data, addr)
+            received += 1
+    except socket.timeout:
+        pass
+    t.join()
+    ok = True
+    for sensor in (1, 2):
+        s = coll.sensors.get(bytes([2, 0, 0, 0, 0, sensor]).hex(":"))
+        # Drops at the very end would be invisible until the next
+        # datagram, but we don't drop any there.
+        lost = s.lost if s is not None else None
+        print("sensor %d: received %s, lost %s, expected lost %d"
+              % (sensor, s.received if s else 0, lost, len(drop[sensor])))
+        if lost != len(drop[sensor]):
+            ok = False
+    print("selftest %s" % ("passed" if ok else "FAILED"))
+    return 0 if ok else 1
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Receive measurements from foxco2 sensors")
+    ap.add_argument("group", nargs="?", help="multicast group, e.g. 239.255.42.2")
+    ap.add_argument("-p", "--port", type=int, default=DEFAULTPORT)
+    ap.add_argument("-i", "--iface", default="0.0.0.0",
+                    help="address of the interface to join the group on")
+    ap.add_argument("--selftest", action="store_true",
+                    help="send test datagrams to ourselves over loopback")
+    args = ap.parse_args()
+    if args.selftest:
+        return selftest(args.port)
+    if args.group is None:
+        ap.error("need a multicast group (or --selftest)")
+    sock = opensocket(args.group, args.port, args.iface)
+    coll = Collector()
+    while True:
+        data, addr = sock.recvfrom(1500)
+        coll.handle(data, addr)
+
+
+if __name__ == "__main__":
+    sys.exit(main())